@@ -1,9 +1,33 @@
 #include <beryl.h>
 #include <sqlite3.h>
 
+#include "zpage_vfs.h"
+#include "vector_funcs.h"
+#include "row_hash.h"
+#include "table_diff.h"
+#include "partitions.h"
+#include "ttl_worker.h"
+#include "bloom.h"
+#include "result_cache.h"
+#include "bulk_load.h"
+#include "stmt_cache.h"
+#include "group_commit.h"
+#include "writer.h"
+#include "prefetch.h"
+#include "completion.h"
+#include "executor.h"
+#include "file_key.h"
+#include "warmer.h"
+#include "idle_release.h"
+
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <time.h>
 
 // https://www.sqlite.org/quickstart.html
 
@@ -23,15 +47,338 @@ static char *beryl_str_to_cstr(struct i_val val) {
 	return cstr;
 }
 
+static bool is_option(struct i_val val, const char *name) {
+	size_t len = strlen(name);
+	return BERYL_TYPEOF(val) == TYPE_STR && BERYL_LENOF(val) == len && memcmp(beryl_get_raw_str(&val), name, len) == 0;
+}
+
+static bool strs_equal(struct i_val a, struct i_val b) {
+	return BERYL_TYPEOF(a) == TYPE_STR && BERYL_TYPEOF(b) == TYPE_STR && BERYL_LENOF(a) == BERYL_LENOF(b)
+		&& memcmp(beryl_get_raw_str(&a), beryl_get_raw_str(&b), BERYL_LENOF(a)) == 0;
+}
+
+struct reader_conn {
+	sqlite3 *db;
+	struct stmt_cache stmts;
+};
+
+// Everything 'open' does to set up the connection, kept in the object until the first use with :lazy
+struct pending_open {
+	char *path;
+	const char *vfs;
+	int n_readers;
+	char **pragmas; // Collected by 'open', then owned by the object
+	int n_pragmas;
+	bool warm;
+	char **warm_names; // Tables and indexes to warm; none for the whole file
+	int n_warm_names;
+};
+
+static void free_strs(char **strs, int n) {
+	for(int i = 0; strs != NULL && i < n; i++)
+		sqlite3_free(strs[i]);
+	free(strs);
+}
+
+static void pending_open_free(struct pending_open *pending) {
+	if(pending == NULL)
+		return;
+	sqlite3_free(pending->path);
+	free_strs(pending->pragmas, pending->n_pragmas);
+	free_strs(pending->warm_names, pending->n_warm_names);
+	free(pending);
+}
+
+struct shared_conn;
+
 struct beryl_sqldb_object {
 	struct beryl_object header;
 	sqlite3 *db;
+	struct ttl_worker *ttl; // NULL unless a table has been registered with 'ttl'
+	struct stmt_cache stmts; // Statements generated by 'insert'
+	struct group_commit *batch; // NULL unless group commit has been enabled with 'batch'
+	struct writer *writer; // NULL unless writer mode has been enabled with 'writer'
+	bool has_writer_rowid; // Whether a write through the writer has changed rows
+	sqlite3_int64 writer_rowid; // The writer connection's last insert rowid after that write
+	sqlite3_int64 writer_rowid_changes; // sqlite3_total_changes64 of db at that time
+	struct executor *executor; // NULL unless started with 'executor'
+	struct completion_queue *completions; // Created by the first 'submit', 'query' or 'completion-fd'
+	double next_request_id;
+	struct reader_conn *readers; // Opened with :readers n; NULL otherwise
+	int n_readers, next_reader;
+	struct shared_conn *shared; // Registry entry if opened with :shared
+	struct warmer *warmer; // Started with :warm; NULL otherwise
+	struct pending_open *pending; // Set until the connection has been opened, which :lazy defers to the first use
+	char **pragmas; // From :pragma; run as "PRAGMA <pragma>" on every connection opened (see setup_connection)
+	int n_pragmas;
+	
+	int idle_release_s; // Set with :idle-release n; 0 otherwise
+	time_t last_use;
+	bool released; // Whether the memory has been released since the last use
+	struct beryl_sqldb_object *next_idle; // In idle_conns while idle_release_s is set
+	struct idle_watch *idle_watch; // Releases the page caches in the background; set once opened with :idle-release
+};
+
+// Connections opened with :shared, found again by file and options. The entries do not hold a reference;
+// they are removed when their connection is closed or freed. Like the values themselves, the registry
+// belongs to the interpreter's thread.
+struct shared_conn {
+	struct shared_conn *next;
+	char *key;
+	struct i_val db_obj;
+};
+
+static struct shared_conn *shared_conns = NULL;
+
+// The key of a connection opened as set up by 'open': the file and every option that changes how the connection
+// behaves, so that opens with different options get connections of their own; free with sqlite3_free
+static char *shared_key(const struct pending_open *pending, int idle_release_s) {
+	char *key = file_key(pending->path, pending->vfs);
+	if(key == NULL)
+		return NULL;
+	sqlite3_str *str = sqlite3_str_new(NULL);
+	sqlite3_str_appendf(str, "%s|%d|%d|%d", key, pending->n_readers, idle_release_s, pending->warm);
+	sqlite3_free(key);
+	// Length-prefixed, so that no text in them can be mistaken for a separator
+	for(int i = 0; i < pending->n_warm_names; i++)
+		sqlite3_str_appendf(str, "|w%d:%s", (int) strlen(pending->warm_names[i]), pending->warm_names[i]);
+	for(int i = 0; i < pending->n_pragmas; i++)
+		sqlite3_str_appendf(str, "|p%d:%s", (int) strlen(pending->pragmas[i]), pending->pragmas[i]);
+	if(sqlite3_str_errcode(str) != SQLITE_OK) {
+		sqlite3_free(sqlite3_str_finish(str));
+		return NULL;
+	}
+	return sqlite3_str_finish(str);
+}
+
+static struct shared_conn *find_shared(const char *key) {
+	for(struct shared_conn *conn = shared_conns; conn != NULL; conn = conn->next) {
+		if(strcmp(conn->key, key) == 0)
+			return conn;
+	}
+	return NULL;
+}
+
+static void unshare(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->shared == NULL)
+		return;
+	for(struct shared_conn **link = &shared_conns; *link != NULL; link = &(*link)->next) {
+		if(*link == db_obj->shared) {
+			*link = db_obj->shared->next;
+			break;
+		}
+	}
+	sqlite3_free(db_obj->shared->key);
+	free(db_obj->shared);
+	db_obj->shared = NULL;
+}
+
+static sqlite3_int64 db_memory_used(sqlite3 *db) {
+	int cache = 0, stmts = 0, highwater;
+	sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &cache, &highwater, 0);
+	sqlite3_db_status(db, SQLITE_DBSTATUS_STMT_USED, &stmts, &highwater, 0);
+	return (sqlite3_int64) cache + stmts;
+}
+
+// Frees the unused pages of the page caches and the cached statements of the connection and its readers;
+// returns the number of bytes freed. No statement from the caches may be in use.
+static sqlite3_int64 release_db_memory(struct beryl_sqldb_object *db_obj) {
+	sqlite3_int64 before = db_memory_used(db_obj->db), after;
+	for(int i = 0; i < db_obj->n_readers; i++)
+		before += db_memory_used(db_obj->readers[i].db);
+	
+	stmt_cache_free(&db_obj->stmts);
+	sqlite3_db_release_memory(db_obj->db);
+	after = db_memory_used(db_obj->db);
+	for(int i = 0; i < db_obj->n_readers; i++) {
+		stmt_cache_free(&db_obj->readers[i].stmts);
+		sqlite3_db_release_memory(db_obj->readers[i].db);
+		after += db_memory_used(db_obj->readers[i].db);
+	}
+	return before > after ? before - after : 0;
+}
+
+// Connections opened with :idle-release. Their page caches are released by a background thread (see
+// idle_release.h), but the statement caches can only be freed here, on the interpreter's thread, where no cached
+// statement is in use: like the shared registry, the list belongs to that thread, and idle connections are looked
+// for whenever a database is used (at most once a second).
+static struct beryl_sqldb_object *idle_conns = NULL;
+static time_t last_idle_sweep = 0;
+
+static void release_idle(time_t now) {
+	if(now == last_idle_sweep)
+		return;
+	last_idle_sweep = now;
+	for(struct beryl_sqldb_object *db_obj = idle_conns; db_obj != NULL; db_obj = db_obj->next_idle) {
+		if(!db_obj->released && db_obj->db != NULL && now - db_obj->last_use >= db_obj->idle_release_s) {
+			release_db_memory(db_obj);
+			db_obj->released = true;
+		}
+	}
+}
+
+static void unregister_idle(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->idle_watch != NULL) {
+		idle_watch_stop(db_obj->idle_watch);
+		db_obj->idle_watch = NULL;
+	}
+	if(db_obj->idle_release_s == 0)
+		return;
+	for(struct beryl_sqldb_object **link = &idle_conns; *link != NULL; link = &(*link)->next_idle) {
+		if(*link == db_obj) {
+			*link = db_obj->next_idle;
+			break;
+		}
+	}
+	db_obj->idle_release_s = 0;
+}
+
+// Called whenever a query is about to run on the connection
+static void note_db_use(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->ttl != NULL)
+		ttl_worker_touch(db_obj->ttl);
+	if(db_obj->batch != NULL)
+		group_commit_tick(db_obj->batch);
+	
+	if(db_obj->idle_watch != NULL)
+		idle_watch_touch(db_obj->idle_watch);
+	
+	time_t now = time(NULL);
+	db_obj->last_use = now;
+	db_obj->released = false;
+	if(idle_conns != NULL)
+		release_idle(now);
+}
+
+// Commits any pending batch and turns group commit off
+static int end_batching(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->batch == NULL)
+		return SQLITE_OK;
+	group_commit_free(db_obj->batch);
+	int n_committed;
+	int err = group_commit_flush(db_obj->batch, &n_committed);
+	if(db_obj->batch->open) // The commit failed; the batch is rolled back rather than leaked as an open transaction
+		sqlite3_exec(db_obj->db, "ROLLBACK", NULL, NULL, NULL);
+	free(db_obj->batch);
+	db_obj->batch = NULL;
+	return err;
+}
+
+// A write queued by 'submit' or a query queued by 'query', owned by the database object until collected by 'completions'
+struct async_request {
+	union { // Both start with their queue node, so a completed node points to the request as well
+		struct write_request write;
+		struct query_request query;
+	} req;
+	bool is_query;
+	double id;
+	char *sql;
+	struct native_value *params;
+	int n_params;
 };
 
+static void async_request_free(struct async_request *ar) {
+	if(ar->is_query)
+		query_request_free_results(&ar->req.query);
+	for(int i = 0; i < ar->n_params; i++)
+		native_value_free(&ar->params[i]);
+	free(ar->params);
+	free(ar->sql);
+	free(ar);
+}
+
+// Fails the queries that have not started yet and waits for the running ones
+static void stop_executor(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->executor != NULL)
+		executor_stop(db_obj->executor);
+	db_obj->executor = NULL;
+}
+
+// Waits for outstanding asynchronous requests (as the writer would drop queued writes) and releases the writer
+static void stop_writer(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->writer == NULL)
+		return;
+	if(db_obj->completions != NULL)
+		completion_queue_wait_idle(db_obj->completions);
+	writer_release(db_obj->writer);
+	db_obj->writer = NULL;
+}
+
+// Drops completions that were never collected; the writer and executor must have been stopped
+static void free_completions(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->completions == NULL)
+		return;
+	struct writer_node *node = completion_queue_take(db_obj->completions);
+	while(node != NULL) {
+		struct writer_node *next = node->next;
+		async_request_free((struct async_request *) node);
+		node = next;
+	}
+	completion_queue_free(db_obj->completions);
+	db_obj->completions = NULL;
+}
+
+static void close_readers(struct beryl_sqldb_object *db_obj) {
+	for(int i = 0; i < db_obj->n_readers; i++) {
+		stmt_cache_free(&db_obj->readers[i].stmts);
+		sqlite3_close_v2(db_obj->readers[i].db);
+	}
+	free(db_obj->readers);
+	db_obj->readers = NULL;
+	db_obj->n_readers = 0;
+}
 
 static void beryl_sqldb_object_free(struct beryl_object *obj) {
 	struct beryl_sqldb_object *db_obj = (struct beryl_sqldb_object*) obj;
+	unshare(db_obj);
+	unregister_idle(db_obj);
+	if(db_obj->warmer != NULL)
+		warmer_stop(db_obj->warmer);
+	if(db_obj->ttl != NULL)
+		ttl_worker_stop(db_obj->ttl);
+	end_batching(db_obj);
+	stop_executor(db_obj);
+	stop_writer(db_obj);
+	free_completions(db_obj);
+	close_readers(db_obj);
+	stmt_cache_free(&db_obj->stmts);
 	sqlite3_close_v2(db_obj->db); // https://www.sqlite.org/c3ref/close.html
+	pending_open_free(db_obj->pending);
+	free_strs(db_obj->pragmas, db_obj->n_pragmas);
+}
+
+static int register_sql_functions(sqlite3 *db) {
+	int err = register_vector_functions(db);
+	if(err)
+		return err;
+	return register_row_hash_functions(db);
+}
+
+// Runs the :pragma list of 'open' on a connection; on failure *failed is the index of the pragma that failed.
+// Pragmas that write to the database (such as user_version) only apply to the file itself, and have been applied
+// through the main connection; they are skipped where they fail on read-only connections.
+static int apply_pragmas(struct beryl_sqldb_object *db_obj, sqlite3 *db, int *failed) {
+	for(int i = 0; i < db_obj->n_pragmas; i++) {
+		char *sql = sqlite3_mprintf("PRAGMA %s", db_obj->pragmas[i]);
+		int err = sql ? sqlite3_exec(db, sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+		sqlite3_free(sql);
+		if(err == SQLITE_READONLY && sqlite3_db_readonly(db, "main") == 1)
+			continue;
+		if(err) {
+			*failed = i;
+			return err;
+		}
+	}
+	return SQLITE_OK;
+}
+
+// Sets up every connection the library opens besides the main one (readers, the writer, the executor's, cursors,
+// the TTL worker and the warmer) like the main one: SQL functions and the :pragma list of 'open'.
+// ctx is the database object, which must have been opened.
+static int setup_connection(sqlite3 *db, void *ctx) {
+	int err = register_sql_functions(db);
+	int failed;
+	return err ? err : apply_pragmas(ctx, db, &failed);
 }
 
 static void blame_sql_error(int err) {
@@ -45,6 +392,62 @@ static void blame_sql_error(int err) {
 	beryl_release(err_str);
 }
 
+// Commits the pending batch before operations that run transactions of their own, or whose writes must not wait
+// for the batch; returns an error value on failure
+static struct i_val commit_batch_first(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->batch == NULL)
+		return BERYL_NULL;
+	int n_committed;
+	int err = group_commit_flush(db_obj->batch, &n_committed);
+	if(err == SQLITE_ABORT)
+		return BERYL_ERR("Batched writes were lost (rolled back by SQLite)");
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to commit pending batched writes");
+	}
+	return BERYL_NULL;
+}
+
+// In writer mode only the writer thread writes outside of transactions opened by the script. Helpers that write
+// on the connection itself and cannot hand their work to the writer refuse to run there (NULL if they may).
+static struct i_val check_local_write(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->writer != NULL && sqlite3_get_autocommit(db_obj->db))
+		return BERYL_ERR("Not available in writer mode outside of a transaction (see 'writer')");
+	return BERYL_NULL;
+}
+
+struct beryl_sqlblob_object {
+	struct beryl_object header;
+	unsigned char *data;
+	size_t len;
+};
+
+static void beryl_sqlblob_object_free(struct beryl_object *obj) {
+	struct beryl_sqlblob_object *blob_obj = (struct beryl_sqlblob_object *) obj;
+	free(blob_obj->data);
+}
+
+static struct i_val beryl_sqlblob_object_call(struct beryl_object *obj, const struct i_val *args, i_size n_args) {
+	(void) obj, (void) args, (void) n_args;
+	return BERYL_ERR("Blob objects can only be used as SQL parameters");
+}
+
+struct beryl_object_class beryl_sqlblob_object_class = {
+	beryl_sqlblob_object_free,
+	beryl_sqlblob_object_call,
+	sizeof(struct beryl_sqlblob_object),
+	"sqlblob",
+	sizeof("sqlblob") - 1
+};
+
+// Integers outside the 64-bit range (which cannot be converted without undefined behaviour) are left as doubles
+static bool num_to_int64(double num, sqlite3_int64 *out) {
+	if(!(num >= -9223372036854775808.0 && num < 9223372036854775808.0) || (double) (sqlite3_int64) num != num)
+		return false;
+	*out = (sqlite3_int64) num;
+	return true;
+}
+
 static int bind_i_val_as_sql_param(sqlite3_stmt *stmt, int i, const struct i_val *val) {
 	switch(BERYL_TYPEOF(*val)) {
 		case TYPE_STR:
@@ -55,13 +458,19 @@ static int bind_i_val_as_sql_param(sqlite3_stmt *stmt, int i, const struct i_val
 		case TYPE_NULL:
 			return sqlite3_bind_null(stmt, i);
 		
-		case TYPE_NUMBER:
-			if(beryl_is_integer(*val))
-				return sqlite3_bind_int(stmt, i, beryl_as_num(*val));
+		case TYPE_NUMBER: {
+			sqlite3_int64 num;
+			if(num_to_int64(beryl_as_num(*val), &num))
+				return sqlite3_bind_int64(stmt, i, num);
 			else
 				return sqlite3_bind_double(stmt, i, beryl_as_num(*val));
+		}
 		
 		default:
+			if(beryl_object_class_type(*val) == &beryl_sqlblob_object_class) {
+				struct beryl_sqlblob_object *blob_obj = (struct beryl_sqlblob_object *) beryl_as_object(*val);
+				return sqlite3_bind_blob64(stmt, i, blob_obj->data, blob_obj->len, SQLITE_STATIC);
+			}
 			return sqlite3_bind_text(stmt, i, "Unkown", -1, SQLITE_STATIC);
 	}
 }
@@ -77,6 +486,34 @@ static struct i_val cstr_to_beryl_str(const char *cstr) {
 	return beryl_new_string(len, cstr);
 }
 
+// Returns an error value if the column cannot be converted
+static struct i_val column_to_i_val(sqlite3_stmt *stmt, int i) {
+	switch(sqlite3_column_type(stmt, i)) {
+	
+		case SQLITE_NULL:
+			return BERYL_NULL;
+			
+		case SQLITE_INTEGER:
+		case SQLITE_FLOAT:
+			return BERYL_NUMBER(sqlite3_column_double(stmt, i));
+		
+		case SQLITE_TEXT:
+		case SQLITE_BLOB: {
+			int len = sqlite3_column_bytes(stmt, i);
+			if((unsigned) len > I_SIZE_MAX)
+				return BERYL_ERR("Text/blob too large");
+			struct i_val str = beryl_new_string(len, sqlite3_column_blob(stmt, i));
+			if(BERYL_TYPEOF(str) == TYPE_NULL)
+				return BERYL_ERR("Out of memory");
+			return str;
+		}
+		
+		default:
+			assert(false);
+			return BERYL_NULL;
+	}
+}
+
 static struct i_val create_table_from_row(sqlite3_stmt *stmt, int n_columns, const struct i_val *column_names) {
 	if((unsigned int) n_columns > I_SIZE_MAX)
 		return BERYL_ERR("Too many columns");
@@ -86,35 +523,10 @@ static struct i_val create_table_from_row(sqlite3_stmt *stmt, int n_columns, con
 		return BERYL_ERR("Out of memory");
 	
 	for(int i = 0; i < n_columns; i++) {
-		struct i_val column_val;
-		switch(sqlite3_column_type(stmt, i)) {
-		
-			case SQLITE_NULL:
-				column_val = BERYL_NULL;
-				break;
-				
-			case SQLITE_INTEGER:
-			case SQLITE_FLOAT:
-				column_val = BERYL_NUMBER(sqlite3_column_double(stmt, i));
-				break;
-			
-			case SQLITE_TEXT:
-			case SQLITE_BLOB: {
-				int len = sqlite3_column_bytes(stmt, i);
-				if((unsigned) len > I_SIZE_MAX) {
-					beryl_release(table);
-					return BERYL_ERR("Text/blob too large");
-				}
-				column_val = beryl_new_string(len, sqlite3_column_blob(stmt, i));
-				if(BERYL_TYPEOF(column_val) == TYPE_NULL) {
-					beryl_release(table);
-					return BERYL_ERR("Out of memory");
-				}
-			} break;
-			
-			
-			default:
-				assert(false);
+		struct i_val column_val = column_to_i_val(stmt, i);
+		if(BERYL_TYPEOF(column_val) == TYPE_ERR) {
+			beryl_release(table);
+			return column_val;
 		}
 		
 		beryl_table_insert(&table, column_names[i], column_val, false);
@@ -123,10 +535,301 @@ static struct i_val create_table_from_row(sqlite3_stmt *stmt, int n_columns, con
 	return table;
 }
 
-static struct i_val beryl_sqldb_object_call(struct beryl_object *obj, const struct i_val *args, i_size n_args) {
-	struct beryl_sqldb_object *db_obj = (struct beryl_sqldb_object *) obj;
+// Copies a parameter the way bind_i_val_as_sql_param would bind it; returns false if out of memory
+static bool i_val_to_native_value(const struct i_val *val, struct native_value *out) {
+	memset(out, 0, sizeof(struct native_value));
+	const void *data;
+	switch(BERYL_TYPEOF(*val)) {
+		case TYPE_NULL:
+			out->type = SQLITE_NULL;
+			return true;
+		case TYPE_NUMBER:
+			out->type = num_to_int64(beryl_as_num(*val), &out->i) ? SQLITE_INTEGER : SQLITE_FLOAT;
+			out->f = beryl_as_num(*val);
+			return true;
+		case TYPE_STR:
+			out->type = SQLITE_TEXT;
+			data = beryl_get_raw_str(val);
+			out->len = BERYL_LENOF(*val);
+			break;
+		default:
+			if(beryl_object_class_type(*val) == &beryl_sqlblob_object_class) {
+				struct beryl_sqlblob_object *blob_obj = (struct beryl_sqlblob_object *) beryl_as_object(*val);
+				out->type = SQLITE_BLOB;
+				data = blob_obj->data;
+				out->len = blob_obj->len;
+			} else {
+				out->type = SQLITE_TEXT;
+				data = "Unkown";
+				out->len = strlen("Unkown");
+			}
+			break;
+	}
+	
+	out->data = malloc(out->len ? out->len : 1);
+	if(out->data == NULL)
+		return false;
+	if(out->len != 0)
+		memcpy(out->data, data, out->len);
+	return true;
+}
+
+// Runs a write on the database's writer thread; the writer's rowid is kept for 'get-last-insert-rowid'
+static struct i_val write_through_writer(struct beryl_sqldb_object *db_obj, sqlite3_stmt *stmt, const struct i_val *params, i_size n_params) {
+	if(sqlite3_column_count(stmt) != 0)
+		return BERYL_ERR("Statements returning rows (RETURNING) cannot be run by the writer thread");
+	if(n_params > INT_MAX)
+		return BERYL_ERR("Too many parameters");
+	
+	struct native_value *native_params = malloc(sizeof(struct native_value) * (n_params ? n_params : 1));
+	if(native_params == NULL)
+		return BERYL_ERR("Out of memory");
+	i_size n_converted = 0;
+	while(n_converted < n_params && i_val_to_native_value(&params[n_converted], &native_params[n_converted]))
+		n_converted++;
+	
+	struct write_request req;
+	bool ok = n_converted == n_params;
+	if(ok) {
+		req.sql = sqlite3_sql(stmt);
+		req.sql_len = strlen(req.sql);
+		req.params = native_params;
+		req.n_params = n_params;
+		writer_execute(db_obj->writer, &req);
+	}
+	
+	for(i_size i = 0; i < n_converted; i++)
+		native_value_free(&native_params[i]);
+	free(native_params);
+	
+	if(!ok)
+		return BERYL_ERR("Out of memory");
+	if(req.err) {
+		struct i_val msg = cstr_to_beryl_str(req.err_msg);
+		if(BERYL_TYPEOF(msg) != TYPE_NULL) {
+			beryl_blame_arg(msg);
+			beryl_release(msg);
+		}
+		return req.err == SQLITE_BUSY ? BERYL_ERR("Database is busy (timeout)") : BERYL_ERR("SQL error");
+	}
+	if(req.changes != 0) {
+		db_obj->has_writer_rowid = true;
+		db_obj->writer_rowid = req.last_insert_rowid;
+		db_obj->writer_rowid_changes = sqlite3_total_changes64(db_obj->db);
+	}
+	return BERYL_NUMBER(req.changes);
+}
+
+// Statements from a statement cache are reset instead of finalized
+static void done_with_stmt(sqlite3_stmt *stmt, bool cached) {
+	if(cached) {
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+	} else
+		sqlite3_finalize(stmt);
+}
+
+#define ROUTE_MAIN_ONLY 1 // stmt_cache_entry flag
+#define SINGLE_STATEMENT 2 // stmt_cache_entry flag: nothing but whitespace or comments follows the statement
+
+#define SEVERAL_STATEMENTS (-1) // Not an SQLite result code
+
+// For callers that take exactly one statement: returns SQLITE_MISUSE if the text holds none and
+// SEVERAL_STATEMENTS if more text than whitespace or comments follows it, rather than ignoring the rest.
+static int prepare_single_statement(struct stmt_cache *cache, sqlite3 *db, const char *sql, size_t sql_len, sqlite3_stmt **stmt) {
+	struct stmt_cache_entry *entry;
+	int err = stmt_cache_prepare(cache, db, sql, sql_len, &entry);
+	if(err)
+		return err;
+	if(entry->stmt == NULL)
+		return SQLITE_MISUSE;
+	
+	if(!(entry->flags & SINGLE_STATEMENT)) {
+		const char *tail = entry->sql + entry->used_len;
+		size_t tail_len = entry->sql_len - entry->used_len;
+		sqlite3_stmt *next = NULL;
+		if(tail_len != 0 && (sqlite3_prepare_v2(db, tail, tail_len, &next, NULL) != SQLITE_OK || next != NULL)) {
+			sqlite3_finalize(next);
+			return SEVERAL_STATEMENTS;
+		}
+		entry->flags |= SINGLE_STATEMENT;
+	}
+	*stmt = entry->stmt;
+	return SQLITE_OK;
+}
+
+// With reader connections, statements are prepared (and classified) once through the main connection's cache.
+// Queries outside of transactions are then run on a reader, everything else on the main connection.
+// Advances *expr past the statement; *stmt is NULL if only whitespace or comments were left.
+static int route_statement(struct beryl_sqldb_object *db_obj, const char **expr, const char *expr_end, sqlite3_stmt **stmt) {
+	struct stmt_cache_entry *entry;
+	int err = stmt_cache_prepare(&db_obj->stmts, db_obj->db, *expr, expr_end - *expr, &entry);
+	if(err)
+		return err;
+	
+	const char *sql = *expr;
+	*expr += entry->used_len;
+	*stmt = entry->stmt;
+	
+	// Statements such as BEGIN count as read-only as well, but must stay on the main connection
+	if(*stmt == NULL || !entry->readonly || sqlite3_column_count(*stmt) == 0 || (entry->flags & ROUTE_MAIN_ONLY) || !sqlite3_get_autocommit(db_obj->db))
+		return SQLITE_OK;
+	
+	struct reader_conn *reader = &db_obj->readers[db_obj->next_reader];
+	db_obj->next_reader = (db_obj->next_reader + 1) % db_obj->n_readers;
+	sqlite3_stmt *reader_stmt;
+	err = stmt_cache_get(&reader->stmts, reader->db, sql, entry->used_len, &reader_stmt);
+	if(err == SQLITE_ERROR) {
+		// Queries on TEMP tables or attached databases only work on the main connection
+		entry->flags |= ROUTE_MAIN_ONLY;
+		return SQLITE_OK;
+	}
+	if(!err)
+		*stmt = reader_stmt;
+	return err;
+}
+
+// Read-only connections to the same file, which queries are routed to (see route_statement)
+static int open_readers(struct beryl_sqldb_object *db_obj, int n_readers, const char *vfs) {
+	const char *path = sqlite3_db_filename(db_obj->db, "main");
+	if(path == NULL || *path == '\0')
+		return SQLITE_MISUSE;
+	
+	db_obj->readers = calloc(n_readers, sizeof(struct reader_conn));
+	if(db_obj->readers == NULL)
+		return SQLITE_NOMEM;
+	
+	for(int i = 0; i < n_readers; i++) {
+		struct reader_conn *reader = &db_obj->readers[i];
+		int err = sqlite3_open_v2(path, &reader->db, SQLITE_OPEN_READONLY, vfs);
+		if(!err) {
+			sqlite3_busy_timeout(reader->db, 1000);
+			err = setup_connection(reader->db, db_obj);
+		}
+		if(err) {
+			sqlite3_close(reader->db);
+			return err; // The readers opened so far are closed with the object
+		}
+		stmt_cache_init(&reader->stmts, 32);
+		db_obj->n_readers++;
+	}
+	return SQLITE_OK;
+}
+
+static char *copy_str(struct i_val str) {
+	return sqlite3_mprintf("%.*s", (int) BERYL_LENOF(str), beryl_get_raw_str(&str));
+}
+
+// Opens the connection as set up by 'open'; returns an error value (after blaming the cause) on failure, in which
+// case the pending open is kept, so that the next use tries again
+static struct i_val finish_open(struct beryl_sqldb_object *db_obj) {
+	struct pending_open *pending = db_obj->pending;
+	
+	sqlite3 *db;
+	int err = sqlite3_open_v2(pending->path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, pending->vfs);
+	if(err) {
+		sqlite3_close(db);
+		struct i_val path = cstr_to_beryl_str(pending->path);
+		if(BERYL_TYPEOF(path) == TYPE_STR) {
+			beryl_blame_arg(path);
+			beryl_release(path);
+		}
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to open database");
+	}
+	
+	sqlite3_busy_timeout(db, 1000); //1 second is the default timeout
+	
+	err = register_sql_functions(db);
+	if(err) {
+		sqlite3_close(db);
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to register SQL functions");
+	}
+	
+	int failed;
+	err = apply_pragmas(db_obj, db, &failed);
+	if(err) {
+		struct i_val pragma = cstr_to_beryl_str(db_obj->pragmas[failed]);
+		if(BERYL_TYPEOF(pragma) == TYPE_STR) {
+			beryl_blame_arg(pragma);
+			beryl_release(pragma);
+		}
+		blame_sql_error(err);
+		sqlite3_close(db);
+		return BERYL_ERR("Unable to apply :pragma");
+	}
+	db_obj->db = db;
+	
+	if(pending->n_readers != 0) {
+		err = open_readers(db_obj, pending->n_readers, pending->vfs);
+		if(err) {
+			close_readers(db_obj);
+			sqlite3_close(db);
+			db_obj->db = NULL;
+			if(err == SQLITE_MISUSE)
+				return BERYL_ERR(":readers requires a database file (not an in-memory database)");
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to open reader connections");
+		}
+	}
+	
+	if(pending->warm) {
+		err = warmer_start(&db_obj->warmer, db, (const char *const *) pending->warm_names, pending->n_warm_names, setup_connection, db_obj);
+		if(err) {
+			close_readers(db_obj);
+			sqlite3_close(db);
+			db_obj->db = NULL;
+			if(err == SQLITE_MISUSE)
+				return BERYL_ERR(":warm requires a database file (not an in-memory database)");
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to start warming the database");
+		}
+	}
+	
+	if(db_obj->idle_release_s != 0) {
+		sqlite3 **dbs = malloc(sizeof(sqlite3 *) * (1 + db_obj->n_readers));
+		err = dbs ? SQLITE_OK : SQLITE_NOMEM;
+		if(!err) {
+			dbs[0] = db;
+			for(int i = 0; i < db_obj->n_readers; i++)
+				dbs[1 + i] = db_obj->readers[i].db;
+			err = idle_watch_start(&db_obj->idle_watch, dbs, 1 + db_obj->n_readers, db_obj->idle_release_s);
+			free(dbs);
+		}
+		if(err) {
+			if(db_obj->warmer != NULL) {
+				warmer_stop(db_obj->warmer);
+				db_obj->warmer = NULL;
+			}
+			close_readers(db_obj);
+			sqlite3_close(db);
+			db_obj->db = NULL;
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to start releasing idle memory");
+		}
+	}
+	
+	pending_open_free(pending);
+	db_obj->pending = NULL;
+	return BERYL_NULL;
+}
+
+// Opens a connection whose open was deferred with :lazy; returns an error value on failure
+static struct i_val ensure_open(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->pending != NULL)
+		return finish_open(db_obj);
 	if(db_obj->db == NULL)
 		return BERYL_ERR("Database has been closed");
+	return BERYL_NULL;
+}
+
+static struct i_val beryl_sqldb_object_call(struct beryl_object *obj, const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = (struct beryl_sqldb_object *) obj;
+	struct i_val err = ensure_open(db_obj);
+	if(BERYL_TYPEOF(err) == TYPE_ERR)
+		return err;
+	note_db_use(db_obj);
 	
 	if(BERYL_TYPEOF(args[0]) != TYPE_STR) {
 		beryl_blame_arg(args[0]);
@@ -147,27 +850,46 @@ static struct i_val beryl_sqldb_object_call(struct beryl_object *obj, const stru
 	
 	while(expr != expr_end) {
 		sqlite3_stmt *stmt;
-		int err = sqlite3_prepare_v2(db_obj->db, expr, expr_end - expr, &stmt, &expr);
+		bool cached = db_obj->readers != NULL;
+		int err;
+		if(cached)
+			err = route_statement(db_obj, &expr, expr_end, &stmt);
+		else
+			err = sqlite3_prepare_v2(db_obj->db, expr, expr_end - expr, &stmt, &expr);
 		if(err != SQLITE_OK) {
+			beryl_release(rows);
 			blame_sql_error(err);
 			return BERYL_ERR("SQL compiler error");
 		}
+		if(stmt == NULL) // Only whitespace or comments left
+			continue;
 		
 		for(i_size i = 1; i < n_args; i++) {
 			int err = bind_i_val_as_sql_param(stmt, i, &args[i]);
 			if(err) {
-				sqlite3_finalize(stmt);
+				done_with_stmt(stmt, cached);
 				beryl_release(rows);
 				blame_sql_error(err);
 				return BERYL_ERR("SQL parameter error");
 			}
 		}
 		
+		// In writer mode, writes outside of transactions are run by the database's writer thread
+		if(db_obj->writer != NULL && !sqlite3_stmt_readonly(stmt) && sqlite3_get_autocommit(db_obj->db)) {
+			struct i_val res = write_through_writer(db_obj, stmt, &args[1], n_args - 1);
+			done_with_stmt(stmt, cached);
+			if(BERYL_TYPEOF(res) == TYPE_ERR) {
+				beryl_release(rows);
+				return res;
+			}
+			continue;
+		}
+		
 		int res;
 		int n_columns = sqlite3_column_count(stmt);
 		struct i_val *column_names = beryl_talloc(sizeof(struct i_val) * n_columns);
 		if(column_names == NULL) {
-			sqlite3_finalize(stmt);
+			done_with_stmt(stmt, cached);
 			beryl_release(rows);
 			return BERYL_ERR("Out of memory");
 		}
@@ -179,22 +901,46 @@ static struct i_val beryl_sqldb_object_call(struct beryl_object *obj, const stru
 				for(int j = i - 1; j >= 0; j--)
 					beryl_release(column_names[i]);
 				beryl_tfree(column_names);
-				sqlite3_finalize(stmt);
+				done_with_stmt(stmt, cached);
 				beryl_release(rows);
 				return BERYL_ERR("Out of memory");
 			}
 		}
 		
+		// With group commit, writes join the current batch; other statements that return no rows
+		// (transaction control in particular) commit it first
+		bool batched = false;
+		if(db_obj->batch != NULL) {
+			int err = SQLITE_OK, n_committed;
+			if(!sqlite3_stmt_readonly(stmt))
+				err = group_commit_before_write(db_obj->batch, &batched);
+			else if(n_columns == 0)
+				err = group_commit_flush(db_obj->batch, &n_committed);
+			
+			if(err) {
+				done_with_stmt(stmt, cached);
+				beryl_release(rows);
+				for(int i = 0; i < n_columns; i++)
+					beryl_release(column_names[i]);
+				beryl_tfree(column_names);
+				blame_sql_error(err);
+				return BERYL_ERR(err == SQLITE_ABORT ? "Batched writes were lost (rolled back by SQLite)" : "Unable to start or commit batch");
+			}
+		}
+		
 		while( (res = sqlite3_step(stmt)) != SQLITE_DONE ) { //Fetch a row
+			if(batched && res != SQLITE_ROW)
+				group_commit_after_write(db_obj->batch, false);
+			
 			if(res == SQLITE_BUSY) {
-				sqlite3_finalize(stmt);
+				done_with_stmt(stmt, cached);
 				beryl_release(rows);
 				for(int i = 0; i < n_columns; i++)
 					beryl_release(column_names[i]);
 				beryl_tfree(column_names);
 				return BERYL_ERR("Database is busy (timeout)");
 			} else if(res != SQLITE_ROW) {
-				sqlite3_finalize(stmt);
+				done_with_stmt(stmt, cached);
 				beryl_release(rows);
 				for(int i = 0; i < n_columns; i++)
 					beryl_release(column_names[i]);
@@ -213,7 +959,9 @@ static struct i_val beryl_sqldb_object_call(struct beryl_object *obj, const stru
 			}
 			
 			if(BERYL_TYPEOF(err) == TYPE_ERR) {
-				sqlite3_finalize(stmt);
+				if(batched)
+					group_commit_after_write(db_obj->batch, false);
+				done_with_stmt(stmt, cached);
 				beryl_release(rows);
 				for(int i = 0; i < n_columns; i++)
 					beryl_release(column_names[i]);
@@ -224,7 +972,16 @@ static struct i_val beryl_sqldb_object_call(struct beryl_object *obj, const stru
 		for(int i = 0; i < n_columns; i++)
 			beryl_release(column_names[i]);
 		
-		sqlite3_finalize(stmt);
+		done_with_stmt(stmt, cached);
+		
+		if(batched) {
+			int err = group_commit_after_write(db_obj->batch, true);
+			if(err) {
+				beryl_release(rows);
+				blame_sql_error(err);
+				return BERYL_ERR("Batched write failed");
+			}
+		}
 	}
 	return rows;
 }
@@ -237,6 +994,22 @@ struct beryl_object_class beryl_sqldb_object_class = {
 	sizeof("sqldb") - 1
 };
 
+// Returns NULL (and blames the argument) if val is not a database object that is still open.
+// Opens connections deferred with :lazy.
+static struct beryl_sqldb_object *get_db_arg(struct i_val val) {
+	if(beryl_object_class_type(val) != &beryl_sqldb_object_class) {
+		beryl_blame_arg(val);
+		return NULL;
+	}
+	
+	struct beryl_sqldb_object *db_obj = (struct beryl_sqldb_object *) beryl_as_object(val);
+	if(BERYL_TYPEOF(ensure_open(db_obj)) == TYPE_ERR) {
+		beryl_blame_arg(val);
+		return NULL;
+	}
+	return db_obj;
+}
+
 static struct i_val close_callback(const struct i_val *args, i_size n_args) {
 	(void) n_args;
 	
@@ -246,48 +1019,230 @@ static struct i_val close_callback(const struct i_val *args, i_size n_args) {
 	}
 	
 	struct beryl_sqldb_object *obj = (struct beryl_sqldb_object*) beryl_as_object(args[0]);
+	unshare(obj);
+	unregister_idle(obj);
+	pending_open_free(obj->pending); // Deferred with :lazy and never used; there is nothing else to close
+	obj->pending = NULL;
+	if(obj->warmer != NULL) {
+		warmer_stop(obj->warmer);
+		obj->warmer = NULL;
+	}
 	
-	int err = sqlite3_close(obj->db);
-	if(err != SQLITE_OK) {
-		return BERYL_ERR("Unable to close database");
+	if(obj->ttl != NULL) {
+		ttl_worker_stop(obj->ttl);
+		obj->ttl = NULL;
+	}
+	
+	int batch_err = end_batching(obj);
+	stop_executor(obj);
+	stop_writer(obj);
+	free_completions(obj);
+	close_readers(obj);
+	stmt_cache_free(&obj->stmts);
+	
+	// close_v2, as objects such as key/value stores may still hold statements; the connection is
+	// then released once the last of them has been freed
+	int err = sqlite3_close_v2(obj->db);
+	if(err != SQLITE_OK) {
+		return BERYL_ERR("Unable to close database");
 	}
 	obj->db = NULL;
 	
+	if(batch_err) {
+		blame_sql_error(batch_err);
+		return BERYL_ERR("Database closed, but its pending batched writes could not be committed");
+	}
 	return BERYL_NULL;
 }
 
+// Paths are only checked with :lazy; anything that does not exist yet must at least have a directory to go in
+static bool path_is_openable(const char *path) {
+	if(strcmp(path, ":memory:") == 0 || *path == '\0')
+		return true;
+	return file_path_usable(path);
+}
+
 static struct i_val open_callback(const struct i_val *args, i_size n_args) {
-	(void) n_args;
-	
-	if(BERYL_TYPEOF(args[0]) != TYPE_STR) {
+	if(BERYL_TYPEOF(args[0]) != TYPE_STR || BERYL_LENOF(args[0]) > INT_MAX) {
 		beryl_blame_arg(args[0]);
 		return BERYL_ERR("Expected string path as first argument for 'sql.open'");
 	}
 	
-	char *path = beryl_str_to_cstr(args[0]);
-	if(path == NULL)
+	struct pending_open *pending = calloc(1, sizeof(struct pending_open));
+	if(pending != NULL) {
+		pending->path = copy_str(args[0]);
+		pending->pragmas = calloc(n_args, sizeof(char *)); // Never more than there are arguments
+	}
+	if(pending == NULL || pending->path == NULL || pending->pragmas == NULL) {
+		pending_open_free(pending);
 		return BERYL_ERR("Out of memory");
+	}
 	
-	sqlite3 *db;
-	int err = sqlite3_open(path, &db);
-	beryl_tfree(path);
+	bool shared = false;
+	bool lazy = false;
+	int idle_release_s = 0;
+	struct i_val err = BERYL_NULL;
+	for(i_size i = 1; i < n_args && BERYL_TYPEOF(err) == TYPE_NULL; i++) {
+		if(is_option(args[i], "compress"))
+			pending->vfs = ZPAGE_VFS_NAME;
+		else if(is_option(args[i], "readers") && i + 1 < n_args) {
+			i++;
+			if(BERYL_TYPEOF(args[i]) != TYPE_NUMBER || beryl_as_num(args[i]) < 1 || beryl_as_num(args[i]) > 64) {
+				beryl_blame_arg(args[i]);
+				err = BERYL_ERR("Expected number of reader connections (1 to 64) after :readers");
+			} else
+				pending->n_readers = beryl_as_num(args[i]);
+		} else if(is_option(args[i], "shared"))
+			shared = true;
+		else if(is_option(args[i], "lazy"))
+			lazy = true;
+		else if(is_option(args[i], "idle-release") && i + 1 < n_args) {
+			i++;
+			if(BERYL_TYPEOF(args[i]) != TYPE_NUMBER || beryl_as_num(args[i]) < 1 || beryl_as_num(args[i]) > INT_MAX) {
+				beryl_blame_arg(args[i]);
+				err = BERYL_ERR("Expected number of seconds (at least 1) after :idle-release");
+			} else
+				idle_release_s = beryl_as_num(args[i]);
+		}
+		else if(is_option(args[i], "pragma") && i + 1 < n_args) {
+			i++;
+			if(BERYL_TYPEOF(args[i]) != TYPE_STR || BERYL_LENOF(args[i]) > INT_MAX) {
+				beryl_blame_arg(args[i]);
+				err = BERYL_ERR("Expected pragma (e.g. \"journal_mode=WAL\") after :pragma");
+			} else if( (pending->pragmas[pending->n_pragmas++] = copy_str(args[i])) == NULL )
+				err = BERYL_ERR("Out of memory");
+		} else if(is_option(args[i], "warm")) {
+			pending->warm = true;
+			if(i + 1 < n_args && BERYL_TYPEOF(args[i + 1]) == TYPE_ARRAY) {
+				struct i_val names = args[++i];
+				if(BERYL_LENOF(names) > INT_MAX) {
+					beryl_blame_arg(names);
+					err = BERYL_ERR("Too many names after :warm");
+					break;
+				}
+				pending->warm_names = calloc(BERYL_LENOF(names) ? BERYL_LENOF(names) : 1, sizeof(char *));
+				if(pending->warm_names == NULL) {
+					err = BERYL_ERR("Out of memory");
+					break;
+				}
+				for(i_size j = 0; j < BERYL_LENOF(names); j++) {
+					struct i_val name = beryl_get_raw_array(names)[j];
+					if(BERYL_TYPEOF(name) != TYPE_STR || BERYL_LENOF(name) > INT_MAX) {
+						beryl_blame_arg(name);
+						err = BERYL_ERR("Expected table and index names (strings) after :warm");
+						break;
+					}
+					if( (pending->warm_names[pending->n_warm_names++] = copy_str(name)) == NULL ) {
+						err = BERYL_ERR("Out of memory");
+						break;
+					}
+				}
+			}
+		} else {
+			beryl_blame_arg(args[i]);
+			err = BERYL_ERR("Unknown option for 'sql.open'");
+		}
+	}
 	
-	if(err) {
-		sqlite3_close(db);
+	if(BERYL_TYPEOF(err) == TYPE_NULL && pending->vfs != NULL) {
+		int sql_err = zpage_vfs_register();
+		if(sql_err != SQLITE_OK) {
+			blame_sql_error(sql_err);
+			err = BERYL_ERR("Unable to register compressing VFS");
+		}
+	}
+	if(BERYL_TYPEOF(err) == TYPE_NULL && lazy && !path_is_openable(pending->path)) {
 		beryl_blame_arg(args[0]);
-		blame_sql_error(err);
-		return BERYL_ERR("Unable to open database");
+		err = BERYL_ERR("Unable to open database (no such directory)");
+	}
+	if(BERYL_TYPEOF(err) != TYPE_NULL) {
+		pending_open_free(pending);
+		return err;
 	}
 	
-	sqlite3_busy_timeout(db, 1000); //1 second is the default timeout
+	// The key is taken before the open, from the path as given; file_key resolves it the same way whether or not
+	// the file exists yet
+	char *key = NULL;
+	if(shared && strcmp(pending->path, ":memory:") != 0 && *pending->path != '\0') {
+		key = shared_key(pending, idle_release_s);
+		if(key == NULL) {
+			pending_open_free(pending);
+			return BERYL_ERR("Out of memory");
+		}
+	}
+	struct shared_conn *existing = key ? find_shared(key) : NULL;
+	if(existing != NULL) {
+		sqlite3_free(key);
+		pending_open_free(pending);
+		return beryl_retain(existing->db_obj);
+	}
 	
 	struct i_val db_obj = beryl_new_object(&beryl_sqldb_object_class);
 	if(BERYL_TYPEOF(db_obj) == TYPE_NULL) {
-		sqlite3_close(db);
+		sqlite3_free(key);
+		pending_open_free(pending);
 		return BERYL_ERR("Out of memory");
 	}
 	struct beryl_sqldb_object *db_obj_val = (struct beryl_sqldb_object *) beryl_as_object(db_obj);
-	db_obj_val->db = db;
+	db_obj_val->db = NULL;
+	db_obj_val->pending = pending;
+	db_obj_val->pragmas = pending->pragmas;
+	db_obj_val->n_pragmas = pending->n_pragmas;
+	pending->pragmas = NULL;
+	pending->n_pragmas = 0;
+	db_obj_val->ttl = NULL;
+	stmt_cache_init(&db_obj_val->stmts, 32);
+	db_obj_val->batch = NULL;
+	db_obj_val->writer = NULL;
+	db_obj_val->has_writer_rowid = false;
+	db_obj_val->writer_rowid = 0;
+	db_obj_val->writer_rowid_changes = 0;
+	db_obj_val->executor = NULL;
+	db_obj_val->completions = NULL;
+	db_obj_val->next_request_id = 1;
+	db_obj_val->readers = NULL;
+	db_obj_val->n_readers = 0;
+	db_obj_val->next_reader = 0;
+	db_obj_val->shared = NULL;
+	db_obj_val->warmer = NULL;
+	db_obj_val->idle_release_s = idle_release_s;
+	db_obj_val->last_use = time(NULL);
+	db_obj_val->released = false;
+	db_obj_val->next_idle = NULL;
+	db_obj_val->idle_watch = NULL;
+	if(idle_release_s != 0) {
+		db_obj_val->next_idle = idle_conns;
+		idle_conns = db_obj_val;
+	}
+	
+	if(!lazy) {
+		err = finish_open(db_obj_val);
+		if(BERYL_TYPEOF(err) == TYPE_ERR) {
+			sqlite3_free(key);
+			beryl_release(db_obj);
+			return err;
+		}
+	}
+	
+	// In-memory databases are never shared, however they were named
+	const char *filename = db_obj_val->db ? sqlite3_db_filename(db_obj_val->db, "main") : NULL;
+	if(key != NULL && db_obj_val->db != NULL && (filename == NULL || *filename == '\0')) {
+		sqlite3_free(key);
+		key = NULL;
+	}
+	if(key != NULL) {
+		struct shared_conn *conn = malloc(sizeof(struct shared_conn));
+		if(conn == NULL) {
+			sqlite3_free(key);
+			beryl_release(db_obj);
+			return BERYL_ERR("Out of memory");
+		}
+		conn->key = key;
+		conn->db_obj = db_obj;
+		conn->next = shared_conns;
+		shared_conns = conn;
+		db_obj_val->shared = conn;
+	}
 	
 	return db_obj;
 }
@@ -301,14 +1256,2854 @@ static struct i_val get_last_insert_rowid_callback(const struct i_val *args, i_s
 	}
 	
 	struct beryl_sqldb_object *obj = (struct beryl_sqldb_object *) beryl_as_object(args[0]);
+	if(obj->db == NULL) // Closed, or opened with :lazy and not used yet
+		return BERYL_NUMBER(0);
 	
+	// In writer mode, inserts outside of transactions run on the writer's connection; its rowid counts unless the
+	// main connection has changed rows since
 	sqlite3_int64 id = sqlite3_last_insert_rowid(obj->db);
+	if(obj->has_writer_rowid && sqlite3_total_changes64(obj->db) == obj->writer_rowid_changes)
+		id = obj->writer_rowid;
 	if(id > BERYL_NUM_MAX_INT)
 		return BERYL_ERR("Id out of range");
 	
 	return BERYL_NUMBER(id);
 }
 
+enum packed_number_type { PACKED_I32, PACKED_I64, PACKED_F32, PACKED_F64 };
+
+static bool get_packed_number_type(struct i_val val, enum packed_number_type *type, size_t *size) {
+	if(is_option(val, "i32"))
+		*type = PACKED_I32, *size = 4;
+	else if(is_option(val, "i64"))
+		*type = PACKED_I64, *size = 8;
+	else if(is_option(val, "f32"))
+		*type = PACKED_F32, *size = 4;
+	else if(is_option(val, "f64"))
+		*type = PACKED_F64, *size = 8;
+	else
+		return false;
+	return true;
+}
+
+// Each loop below is branch-free per element, so the compiler is free to vectorize the conversion
+static void decode_packed_numbers(enum packed_number_type type, const unsigned char *src, size_t n, struct i_val *out) {
+	switch(type) {
+		case PACKED_I32:
+			for(size_t i = 0; i < n; i++) {
+				int32_t v;
+				memcpy(&v, src + i * sizeof(v), sizeof(v));
+				out[i] = BERYL_NUMBER(v);
+			}
+			break;
+		case PACKED_I64:
+			for(size_t i = 0; i < n; i++) {
+				int64_t v;
+				memcpy(&v, src + i * sizeof(v), sizeof(v));
+				out[i] = BERYL_NUMBER(v);
+			}
+			break;
+		case PACKED_F32:
+			for(size_t i = 0; i < n; i++) {
+				float v;
+				memcpy(&v, src + i * sizeof(v), sizeof(v));
+				out[i] = BERYL_NUMBER(v);
+			}
+			break;
+		case PACKED_F64:
+			for(size_t i = 0; i < n; i++) {
+				double v;
+				memcpy(&v, src + i * sizeof(v), sizeof(v));
+				out[i] = BERYL_NUMBER(v);
+			}
+			break;
+	}
+}
+
+// Converting a number the type cannot represent is undefined behaviour, so those are rejected up front
+static bool packed_number_fits(enum packed_number_type type, double num) {
+	switch(type) {
+		case PACKED_I32:
+			return num >= -2147483648.0 && num <= 2147483647.0 && num == (double) (int32_t) num;
+		case PACKED_I64:
+			return num >= -9223372036854775808.0 && num < 9223372036854775808.0 && num == (double) (int64_t) num;
+		case PACKED_F32:
+			return isnan(num) || isinf(num) || (num >= -FLT_MAX && num <= FLT_MAX);
+		case PACKED_F64:
+			return true;
+	}
+	return false;
+}
+
+static void encode_packed_numbers(enum packed_number_type type, const struct i_val *src, size_t n, unsigned char *out) {
+	switch(type) {
+		case PACKED_I32:
+			for(size_t i = 0; i < n; i++) {
+				int32_t v = beryl_as_num(src[i]);
+				memcpy(out + i * sizeof(v), &v, sizeof(v));
+			}
+			break;
+		case PACKED_I64:
+			for(size_t i = 0; i < n; i++) {
+				int64_t v = beryl_as_num(src[i]);
+				memcpy(out + i * sizeof(v), &v, sizeof(v));
+			}
+			break;
+		case PACKED_F32:
+			for(size_t i = 0; i < n; i++) {
+				float v = beryl_as_num(src[i]);
+				memcpy(out + i * sizeof(v), &v, sizeof(v));
+			}
+			break;
+		case PACKED_F64:
+			for(size_t i = 0; i < n; i++) {
+				double v = beryl_as_num(src[i]);
+				memcpy(out + i * sizeof(v), &v, sizeof(v));
+			}
+			break;
+	}
+}
+
+static struct i_val blob_to_numbers_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	const unsigned char *data;
+	size_t len;
+	if(BERYL_TYPEOF(args[0]) == TYPE_STR) {
+		data = (const unsigned char *) beryl_get_raw_str(&args[0]);
+		len = BERYL_LENOF(args[0]);
+	} else if(beryl_object_class_type(args[0]) == &beryl_sqlblob_object_class) {
+		struct beryl_sqlblob_object *blob_obj = (struct beryl_sqlblob_object *) beryl_as_object(args[0]);
+		data = blob_obj->data;
+		len = blob_obj->len;
+	} else {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected blob (string) as first argument for 'blob-to-numbers'");
+	}
+	
+	enum packed_number_type type;
+	size_t size;
+	if(!get_packed_number_type(args[1], &type, &size)) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected :i32, :i64, :f32 or :f64 as number type");
+	}
+	
+	if(len % size != 0)
+		return BERYL_ERR("Blob length is not a multiple of the number size");
+	size_t n = len / size;
+	if(n > I_SIZE_MAX)
+		return BERYL_ERR("Blob too large");
+	
+	struct i_val *items = beryl_talloc(sizeof(struct i_val) * (n ? n : 1));
+	if(items == NULL)
+		return BERYL_ERR("Out of memory");
+	decode_packed_numbers(type, data, n, items);
+	
+	struct i_val array = beryl_new_array(n, items, n, false);
+	beryl_tfree(items);
+	if(BERYL_TYPEOF(array) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return array;
+}
+
+static struct i_val numbers_to_blob_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	if(BERYL_TYPEOF(args[0]) != TYPE_ARRAY) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected array of numbers as first argument for 'numbers-to-blob'");
+	}
+	
+	enum packed_number_type type;
+	size_t size;
+	if(!get_packed_number_type(args[1], &type, &size)) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected :i32, :i64, :f32 or :f64 as number type");
+	}
+	
+	const struct i_val *items = beryl_get_raw_array(args[0]);
+	i_size n = BERYL_LENOF(args[0]);
+	for(i_size i = 0; i < n; i++) {
+		if(BERYL_TYPEOF(items[i]) != TYPE_NUMBER) {
+			beryl_blame_arg(items[i]);
+			return BERYL_ERR("Expected array of numbers as first argument for 'numbers-to-blob'");
+		}
+		if(!packed_number_fits(type, beryl_as_num(items[i]))) {
+			beryl_blame_arg(items[i]);
+			return BERYL_ERR("Number cannot be represented as the given number type");
+		}
+	}
+	
+	unsigned char *data = malloc(n * size + 1);
+	if(data == NULL)
+		return BERYL_ERR("Out of memory");
+	encode_packed_numbers(type, items, n, data);
+	
+	struct i_val blob = beryl_new_object(&beryl_sqlblob_object_class);
+	if(BERYL_TYPEOF(blob) == TYPE_NULL) {
+		free(data);
+		return BERYL_ERR("Out of memory");
+	}
+	struct beryl_sqlblob_object *blob_obj = (struct beryl_sqlblob_object *) beryl_as_object(blob);
+	blob_obj->data = data;
+	blob_obj->len = n * size;
+	
+	return blob;
+}
+
+static struct i_val key_list_to_array(const struct key_list *list) {
+	if(list->len > I_SIZE_MAX)
+		return BERYL_NULL;
+	
+	struct i_val array = beryl_new_array(0, NULL, list->len, false);
+	if(BERYL_TYPEOF(array) == TYPE_NULL)
+		return BERYL_NULL;
+	for(size_t i = 0; i < list->len; i++) {
+		if(!beryl_array_push(&array, BERYL_NUMBER(list->keys[i]))) {
+			beryl_release(array);
+			return BERYL_NULL;
+		}
+	}
+	return array;
+}
+
+static struct i_val diff_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'diff'");
+	
+	for(int i = 1; i <= 3; i++) {
+		if(BERYL_TYPEOF(args[i]) != TYPE_STR) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected two table names and a key column name (strings) for 'diff'");
+		}
+	}
+	
+	char *table_a = beryl_str_to_cstr(args[1]);
+	char *table_b = beryl_str_to_cstr(args[2]);
+	char *key = beryl_str_to_cstr(args[3]);
+	
+	struct table_diff diff;
+	const char *err_msg = "Out of memory";
+	int err = SQLITE_NOMEM;
+	if(table_a != NULL && table_b != NULL && key != NULL)
+		err = table_diff(db_obj->db, table_a, table_b, key, &diff, &err_msg);
+	
+	beryl_tfree(table_a);
+	beryl_tfree(table_b);
+	beryl_tfree(key);
+	
+	if(err != SQLITE_OK) {
+		blame_sql_error(err);
+		return BERYL_ERR(err_msg);
+	}
+	
+	struct i_val res = beryl_new_table(3, true);
+	struct i_val only_a = key_list_to_array(&diff.only_a);
+	struct i_val only_b = key_list_to_array(&diff.only_b);
+	struct i_val changed = key_list_to_array(&diff.changed);
+	table_diff_free(&diff);
+	
+	if(BERYL_TYPEOF(res) == TYPE_NULL || BERYL_TYPEOF(only_a) == TYPE_NULL || BERYL_TYPEOF(only_b) == TYPE_NULL || BERYL_TYPEOF(changed) == TYPE_NULL) {
+		beryl_release(res);
+		beryl_release(only_a);
+		beryl_release(only_b);
+		beryl_release(changed);
+		return BERYL_ERR("Out of memory");
+	}
+	
+	beryl_table_insert(&res, BERYL_CONST_STR("only-a"), only_a, false);
+	beryl_table_insert(&res, BERYL_CONST_STR("only-b"), only_b, false);
+	beryl_table_insert(&res, BERYL_CONST_STR("changed"), changed, false);
+	return res;
+}
+
+static int exec_chunk(sqlite3 *db, sqlite3_stmt *stmt, int *changes) {
+	int err = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+	if(err)
+		return err;
+	
+	while( (err = sqlite3_step(stmt)) == SQLITE_ROW )
+		;
+	sqlite3_reset(stmt);
+	if(err != SQLITE_DONE) {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return err;
+	}
+	
+	*changes = sqlite3_changes(db);
+	return sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+}
+
+// Runs a DELETE/UPDATE in many short transactions. The statement selects the chunking mode by the parameters it uses:
+//   :limit       Run repeatedly (bound to the chunk size) until a run changes no rows
+//   :lo and :hi  Run once per rowid range of the chunk size, covering all rowids of the table given with :table
+static struct i_val chunked_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'chunked'");
+	
+	if(BERYL_TYPEOF(args[1]) != TYPE_STR) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected SQL statement (a string) as second argument for 'chunked'");
+	}
+	
+	sqlite3_int64 chunk_size = 1000;
+	int pause_ms = 0;
+	struct i_val progress_fn = BERYL_NULL;
+	struct i_val table_name = BERYL_NULL;
+	for(i_size i = 2; i < n_args; i++) {
+		if(i + 1 == n_args) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Missing value for option");
+		}
+		
+		if(is_option(args[i], "chunk-size") && BERYL_TYPEOF(args[i + 1]) == TYPE_NUMBER && beryl_as_num(args[i + 1]) >= 1)
+			chunk_size = beryl_as_num(args[i + 1]);
+		else if(is_option(args[i], "pause") && BERYL_TYPEOF(args[i + 1]) == TYPE_NUMBER && beryl_as_num(args[i + 1]) >= 0)
+			pause_ms = beryl_as_num(args[i + 1]);
+		else if(is_option(args[i], "progress"))
+			progress_fn = args[i + 1];
+		else if(is_option(args[i], "table") && BERYL_TYPEOF(args[i + 1]) == TYPE_STR)
+			table_name = args[i + 1];
+		else {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown or invalid option for 'chunked'");
+		}
+		i++;
+	}
+	
+	struct i_val flushed = commit_batch_first(db_obj);
+	if(BERYL_TYPEOF(flushed) == TYPE_ERR)
+		return flushed;
+	sqlite3 *db = db_obj->db;
+	if(!sqlite3_get_autocommit(db))
+		return BERYL_ERR("'chunked' cannot be used inside a transaction");
+	struct i_val local = check_local_write(db_obj);
+	if(BERYL_TYPEOF(local) == TYPE_ERR)
+		return local;
+	
+	sqlite3_stmt *stmt;
+	int err = sqlite3_prepare_v2(db, beryl_get_raw_str(&args[1]), BERYL_LENOF(args[1]), &stmt, NULL);
+	if(err != SQLITE_OK) {
+		blame_sql_error(err);
+		return BERYL_ERR("SQL compiler error");
+	}
+	if(stmt == NULL)
+		return BERYL_ERR("Expected SQL statement");
+	
+	int limit_param = sqlite3_bind_parameter_index(stmt, ":limit");
+	int lo_param = sqlite3_bind_parameter_index(stmt, ":lo");
+	int hi_param = sqlite3_bind_parameter_index(stmt, ":hi");
+	bool by_range = lo_param && hi_param;
+	
+	sqlite3_int64 lo = 0, max_rowid = -1;
+	if(by_range) {
+		if(BERYL_TYPEOF(table_name) != TYPE_STR) {
+			sqlite3_finalize(stmt);
+			return BERYL_ERR("Chunking by rowid range (:lo and :hi) requires the :table option");
+		}
+		
+		char *table = beryl_str_to_cstr(table_name);
+		char *bounds_sql = table ? sqlite3_mprintf("SELECT min(rowid), max(rowid) FROM \"%w\"", table) : NULL;
+		beryl_tfree(table);
+		
+		sqlite3_stmt *bounds;
+		err = bounds_sql ? sqlite3_prepare_v2(db, bounds_sql, -1, &bounds, NULL) : SQLITE_NOMEM;
+		sqlite3_free(bounds_sql);
+		if(err == SQLITE_OK) {
+			if(sqlite3_step(bounds) == SQLITE_ROW && sqlite3_column_type(bounds, 0) != SQLITE_NULL) {
+				lo = sqlite3_column_int64(bounds, 0);
+				max_rowid = sqlite3_column_int64(bounds, 1);
+			}
+			err = sqlite3_finalize(bounds);
+		}
+		if(err != SQLITE_OK) {
+			sqlite3_finalize(stmt);
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to read the rowid range of the table");
+		}
+	} else if(limit_param) {
+		sqlite3_bind_int64(stmt, limit_param, chunk_size);
+	} else {
+		sqlite3_finalize(stmt);
+		return BERYL_ERR("The statement for 'chunked' must use either :limit or both :lo and :hi");
+	}
+	
+	sqlite3_int64 total = 0;
+	bool done = by_range && lo > max_rowid;
+	while(!done) {
+		if(by_range) {
+			// Unsigned, as the difference may not fit in an int64
+			sqlite3_int64 hi = ((uint64_t) max_rowid - (uint64_t) lo < (uint64_t) chunk_size) ? max_rowid : lo + chunk_size - 1;
+			sqlite3_bind_int64(stmt, lo_param, lo);
+			sqlite3_bind_int64(stmt, hi_param, hi);
+			done = hi == max_rowid;
+			if(!done)
+				lo = hi + 1;
+		}
+		
+		// The progress function may have made batched writes
+		flushed = commit_batch_first(db_obj);
+		if(BERYL_TYPEOF(flushed) == TYPE_ERR) {
+			sqlite3_finalize(stmt);
+			return flushed;
+		}
+		
+		int changes = 0;
+		err = exec_chunk(db, stmt, &changes);
+		if(err != SQLITE_OK) {
+			sqlite3_finalize(stmt);
+			blame_sql_error(err);
+			return BERYL_ERR("SQL error");
+		}
+		total += changes;
+		
+		if(BERYL_TYPEOF(progress_fn) != TYPE_NULL) {
+			struct i_val progress_arg = BERYL_NUMBER(total);
+			struct i_val res = beryl_call(progress_fn, &progress_arg, 1, true);
+			if(BERYL_TYPEOF(res) == TYPE_ERR) {
+				sqlite3_finalize(stmt);
+				return res;
+			}
+			beryl_release(res);
+		}
+		
+		if(!by_range && changes == 0)
+			done = true;
+		if(!done && pause_ms > 0)
+			sqlite3_sleep(pause_ms); // Lets other writers take the lock between chunks
+	}
+	
+	sqlite3_finalize(stmt);
+	return BERYL_NUMBER(total);
+}
+
+struct beryl_sqlpartitions_object {
+	struct beryl_object header;
+	struct i_val db; // Retained database object
+	struct partition_set ps;
+};
+
+static void beryl_sqlpartitions_object_free(struct beryl_object *obj) {
+	struct beryl_sqlpartitions_object *part_obj = (struct beryl_sqlpartitions_object *) obj;
+	partition_set_free(&part_obj->ps);
+	beryl_release(part_obj->db);
+}
+
+static struct i_val beryl_sqlpartitions_object_call(struct beryl_object *obj, const struct i_val *args, i_size n_args) {
+	struct beryl_sqlpartitions_object *part_obj = (struct beryl_sqlpartitions_object *) obj;
+	
+	struct beryl_sqldb_object *db_obj = (struct beryl_sqldb_object *) beryl_as_object(part_obj->db);
+	if(db_obj->db == NULL)
+		return BERYL_ERR("Database has been closed");
+	note_db_use(db_obj);
+	
+	if(is_option(args[0], "list") && n_args == 1) {
+		sqlite3_int64 *buckets;
+		int n_buckets;
+		int err = partition_set_list(&part_obj->ps, &buckets, &n_buckets);
+		if(err) {
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to list partitions");
+		}
+		
+		struct key_list list = { buckets, n_buckets, n_buckets };
+		struct i_val array = key_list_to_array(&list);
+		sqlite3_free(buckets);
+		if(BERYL_TYPEOF(array) == TYPE_NULL)
+			return BERYL_ERR("Out of memory");
+		return array;
+	}
+	
+	if(n_args != 2 || BERYL_TYPEOF(args[1]) != TYPE_NUMBER) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected :rotate time, :drop-before time or :list");
+	}
+	sqlite3_int64 time = beryl_as_num(args[1]);
+	
+	// ATTACH and DETACH fail inside a transaction, such as a pending batch's
+	struct i_val flushed = commit_batch_first(db_obj);
+	if(BERYL_TYPEOF(flushed) == TYPE_ERR)
+		return flushed;
+	
+	if(is_option(args[0], "rotate")) {
+		char *schema;
+		int err = partition_set_rotate(&part_obj->ps, db_obj->db, time, &schema);
+		if(err) {
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to rotate partitions");
+		}
+		struct i_val res = cstr_to_beryl_str(schema);
+		sqlite3_free(schema);
+		if(BERYL_TYPEOF(res) == TYPE_NULL)
+			return BERYL_ERR("Out of memory");
+		return res;
+	} else if(is_option(args[0], "drop-before")) {
+		int n_dropped;
+		int err = partition_set_drop_before(&part_obj->ps, db_obj->db, time, &n_dropped);
+		if(err) {
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to drop partitions");
+		}
+		return BERYL_NUMBER(n_dropped);
+	}
+	
+	beryl_blame_arg(args[0]);
+	return BERYL_ERR("Expected :rotate time, :drop-before time or :list");
+}
+
+struct beryl_object_class beryl_sqlpartitions_object_class = {
+	beryl_sqlpartitions_object_free,
+	beryl_sqlpartitions_object_call,
+	sizeof(struct beryl_sqlpartitions_object),
+	"sqlpartitions",
+	sizeof("sqlpartitions") - 1
+};
+
+static struct i_val partitions_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'partitions'");
+	
+	for(int i = 1; i <= 3; i++) {
+		if(BERYL_TYPEOF(args[i]) != TYPE_STR) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected directory, table name and CREATE TABLE statement (strings) for 'partitions'");
+		}
+	}
+	
+	sqlite3_int64 bucket_seconds = 86400;
+	int max_attach = sqlite3_limit(db_obj->db, SQLITE_LIMIT_ATTACHED, -1);
+	int n_attach = max_attach < 7 ? max_attach : 7;
+	for(i_size i = 4; i < n_args; i += 2) {
+		if(i + 1 == n_args || BERYL_TYPEOF(args[i + 1]) != TYPE_NUMBER || beryl_as_num(args[i + 1]) < 1) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected a positive number as option value");
+		}
+		
+		if(is_option(args[i], "bucket-seconds"))
+			bucket_seconds = beryl_as_num(args[i + 1]);
+		else if(is_option(args[i], "attach") && beryl_as_num(args[i + 1]) <= max_attach)
+			n_attach = beryl_as_num(args[i + 1]);
+		else {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown or invalid option for 'partitions'");
+		}
+	}
+	
+	if(n_attach < 1)
+		return BERYL_ERR("The connection cannot attach any databases");
+	
+	char *dir = beryl_str_to_cstr(args[1]);
+	char *name = beryl_str_to_cstr(args[2]);
+	char *create_sql = beryl_str_to_cstr(args[3]);
+	
+	struct partition_set ps;
+	int err = SQLITE_NOMEM;
+	if(dir != NULL && name != NULL && create_sql != NULL)
+		err = partition_set_init(&ps, dir, name, create_sql, bucket_seconds, n_attach);
+	beryl_tfree(dir);
+	beryl_tfree(name);
+	beryl_tfree(create_sql);
+	if(err)
+		return BERYL_ERR("Out of memory");
+	
+	struct i_val part_obj = beryl_new_object(&beryl_sqlpartitions_object_class);
+	if(BERYL_TYPEOF(part_obj) == TYPE_NULL) {
+		partition_set_free(&ps);
+		return BERYL_ERR("Out of memory");
+	}
+	struct beryl_sqlpartitions_object *part_obj_val = (struct beryl_sqlpartitions_object *) beryl_as_object(part_obj);
+	part_obj_val->db = beryl_retain(args[0]);
+	part_obj_val->ps = ps;
+	
+	return part_obj;
+}
+
+// The options only take effect for the first table registered on a database
+static struct i_val ttl_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'ttl'");
+	
+	for(int i = 1; i <= 2; i++) {
+		if(BERYL_TYPEOF(args[i]) != TYPE_STR) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected table and expiry column names (strings) for 'ttl'");
+		}
+	}
+	
+	struct ttl_options options = { 500, 1000, 200 };
+	for(i_size i = 3; i < n_args; i += 2) {
+		if(i + 1 == n_args || BERYL_TYPEOF(args[i + 1]) != TYPE_NUMBER || beryl_as_num(args[i + 1]) < 1 || beryl_as_num(args[i + 1]) > INT_MAX) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected a positive number as option value");
+		}
+		
+		if(is_option(args[i], "batch"))
+			options.batch_size = beryl_as_num(args[i + 1]);
+		else if(is_option(args[i], "interval"))
+			options.interval_ms = beryl_as_num(args[i + 1]);
+		else if(is_option(args[i], "idle"))
+			options.idle_ms = beryl_as_num(args[i + 1]);
+		else {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown option for 'ttl'");
+		}
+	}
+	
+	if(db_obj->ttl == NULL) {
+		int err = ttl_worker_start(&db_obj->ttl, db_obj->db, &options, setup_connection, db_obj);
+		if(err == SQLITE_MISUSE)
+			return BERYL_ERR("'ttl' requires a database file (not an in-memory database)");
+		if(err) {
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to start TTL worker");
+		}
+	}
+	
+	char *table = beryl_str_to_cstr(args[1]);
+	char *column = beryl_str_to_cstr(args[2]);
+	int err = SQLITE_NOMEM;
+	if(table != NULL && column != NULL)
+		err = ttl_worker_add(db_obj->ttl, table, column);
+	beryl_tfree(table);
+	beryl_tfree(column);
+	
+	if(err)
+		return BERYL_ERR("Out of memory");
+	return BERYL_NULL;
+}
+
+struct beryl_sqlkv_object {
+	struct beryl_object header;
+	struct i_val db; // Retained database object
+	sqlite3_stmt *get, *put, *del, *range;
+	
+	// Optional Bloom filter over the keys, used to answer definite misses without a lookup.
+	// It is trusted only while nothing but this object has written to the database, which is
+	// tracked with the connection's total change count and PRAGMA data_version (other connections).
+	bool use_bloom, bloom_valid;
+	struct bloom bloom;
+	sqlite3_int64 seen_changes, seen_data_version;
+	sqlite3_stmt *data_version, *count, *scan;
+};
+
+static void beryl_sqlkv_object_free(struct beryl_object *obj) {
+	struct beryl_sqlkv_object *kv_obj = (struct beryl_sqlkv_object *) obj;
+	sqlite3_finalize(kv_obj->get);
+	sqlite3_finalize(kv_obj->put);
+	sqlite3_finalize(kv_obj->del);
+	sqlite3_finalize(kv_obj->range);
+	sqlite3_finalize(kv_obj->data_version);
+	sqlite3_finalize(kv_obj->count);
+	sqlite3_finalize(kv_obj->scan);
+	if(kv_obj->bloom_valid)
+		bloom_free(&kv_obj->bloom);
+	beryl_release(kv_obj->db);
+}
+
+// Numbers are hashed by value, as SQL considers 1 and 1.0 to be the same key.
+// Text and blobs hash alike; that can only cause false positives.
+static uint64_t hash_number_key(double num) {
+	if(num == 0)
+		num = 0; // -0.0
+	return xxh64(&num, sizeof(num), 'n');
+}
+
+static uint64_t hash_bytes_key(const void *data, size_t len) {
+	return xxh64(data, len, 's');
+}
+
+static uint64_t column_key_hash(sqlite3_stmt *stmt, int i) {
+	switch(sqlite3_column_type(stmt, i)) {
+		case SQLITE_INTEGER:
+		case SQLITE_FLOAT:
+			return hash_number_key(sqlite3_column_double(stmt, i));
+		default: {
+			const void *data = sqlite3_column_blob(stmt, i);
+			return hash_bytes_key(data, sqlite3_column_bytes(stmt, i));
+		}
+	}
+}
+
+// Returns false for values that are never stored as keys
+static bool i_val_key_hash(const struct i_val *key, uint64_t *hash) {
+	switch(BERYL_TYPEOF(*key)) {
+		case TYPE_NUMBER:
+			*hash = hash_number_key(beryl_as_num(*key));
+			return true;
+		case TYPE_STR:
+			*hash = hash_bytes_key(beryl_get_raw_str(key), BERYL_LENOF(*key));
+			return true;
+		default:
+			if(beryl_object_class_type(*key) == &beryl_sqlblob_object_class) {
+				struct beryl_sqlblob_object *blob_obj = (struct beryl_sqlblob_object *) beryl_as_object(*key);
+				*hash = hash_bytes_key(blob_obj->data, blob_obj->len);
+				return true;
+			}
+			return false;
+	}
+}
+
+static int kv_data_version(struct beryl_sqlkv_object *kv_obj, sqlite3_int64 *data_version) {
+	int err = sqlite3_step(kv_obj->data_version);
+	*data_version = sqlite3_column_int64(kv_obj->data_version, 0);
+	sqlite3_reset(kv_obj->data_version);
+	return err == SQLITE_ROW ? SQLITE_OK : err;
+}
+
+static int kv_bloom_rebuild(struct beryl_sqlkv_object *kv_obj, sqlite3_int64 data_version) {
+	sqlite3 *db = sqlite3_db_handle(kv_obj->get);
+	if(kv_obj->bloom_valid) {
+		bloom_free(&kv_obj->bloom);
+		kv_obj->bloom_valid = false;
+	}
+	
+	int err = sqlite3_step(kv_obj->count);
+	sqlite3_int64 n_keys = sqlite3_column_int64(kv_obj->count, 0);
+	sqlite3_reset(kv_obj->count);
+	if(err != SQLITE_ROW)
+		return err;
+	
+	if(!bloom_init(&kv_obj->bloom, n_keys))
+		return SQLITE_NOMEM;
+	
+	sqlite3_int64 changes_before = sqlite3_total_changes64(db);
+	while( (err = sqlite3_step(kv_obj->scan)) == SQLITE_ROW )
+		bloom_add(&kv_obj->bloom, column_key_hash(kv_obj->scan, 0));
+	sqlite3_reset(kv_obj->scan);
+	if(err != SQLITE_DONE) {
+		bloom_free(&kv_obj->bloom);
+		return err;
+	}
+	
+	kv_obj->bloom_valid = true;
+	kv_obj->seen_changes = changes_before;
+	kv_obj->seen_data_version = data_version;
+	return SQLITE_OK;
+}
+
+// *usable is false if the filter is out of sync inside a transaction. It is not rebuilt there, as a ROLLBACK could
+// bring back keys missing from it without changing the total changes or data version.
+static int kv_bloom_sync(struct beryl_sqlkv_object *kv_obj, bool *usable) {
+	*usable = true;
+	sqlite3_int64 data_version;
+	int err = kv_data_version(kv_obj, &data_version);
+	if(err)
+		return err;
+	
+	bool in_sync = kv_obj->bloom_valid
+		&& data_version == kv_obj->seen_data_version
+		&& sqlite3_total_changes64(sqlite3_db_handle(kv_obj->get)) == kv_obj->seen_changes
+		&& !bloom_is_saturated(&kv_obj->bloom);
+	if(in_sync)
+		return SQLITE_OK;
+	if(!sqlite3_get_autocommit(sqlite3_db_handle(kv_obj->get))) {
+		*usable = false;
+		return SQLITE_OK;
+	}
+	return kv_bloom_rebuild(kv_obj, data_version);
+}
+
+// Runs a statement that yields at most one row with one column; NULL if there is no row
+static struct i_val kv_single_value(sqlite3_stmt *stmt) {
+	struct i_val res = BERYL_NULL;
+	int err = sqlite3_step(stmt);
+	if(err == SQLITE_ROW)
+		res = column_to_i_val(stmt, 0);
+	else if(err != SQLITE_DONE) {
+		blame_sql_error(err);
+		res = BERYL_ERR("SQL error");
+	}
+	sqlite3_reset(stmt);
+	return res;
+}
+
+static struct i_val kv_get(struct beryl_sqlkv_object *kv_obj, const struct i_val *key) {
+	if(kv_obj->use_bloom) {
+		bool usable;
+		int err = kv_bloom_sync(kv_obj, &usable);
+		if(err) {
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to build Bloom filter");
+		}
+		
+		uint64_t hash;
+		if(usable && (!i_val_key_hash(key, &hash) || !bloom_may_contain(&kv_obj->bloom, hash)))
+			return BERYL_NULL;
+	}
+	
+	int err = bind_i_val_as_sql_param(kv_obj->get, 1, key);
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("SQL parameter error");
+	}
+	return kv_single_value(kv_obj->get);
+}
+
+static struct i_val kv_get_many(struct beryl_sqlkv_object *kv_obj, struct i_val keys) {
+	if(BERYL_TYPEOF(keys) != TYPE_ARRAY) {
+		beryl_blame_arg(keys);
+		return BERYL_ERR("Expected array of keys for :get-many");
+	}
+	
+	const struct i_val *items = beryl_get_raw_array(keys);
+	i_size n = BERYL_LENOF(keys);
+	struct i_val res = beryl_new_array(0, NULL, n, false);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	for(i_size i = 0; i < n; i++) {
+		struct i_val val = kv_get(kv_obj, &items[i]);
+		if(BERYL_TYPEOF(val) == TYPE_ERR) {
+			beryl_release(res);
+			return val;
+		}
+		if(!beryl_array_push(&res, val)) {
+			beryl_release(val);
+			beryl_release(res);
+			return BERYL_ERR("Out of memory");
+		}
+	}
+	return res;
+}
+
+static struct i_val kv_range(struct beryl_sqlkv_object *kv_obj, const struct i_val *lo, const struct i_val *hi) {
+	sqlite3_stmt *stmt = kv_obj->range;
+	int err = bind_i_val_as_sql_param(stmt, 1, lo);
+	if(!err)
+		err = bind_i_val_as_sql_param(stmt, 2, hi);
+	if(err) {
+		sqlite3_reset(stmt);
+		blame_sql_error(err);
+		return BERYL_ERR("SQL parameter error");
+	}
+	
+	struct i_val column_names[] = { BERYL_CONST_STR("key"), BERYL_CONST_STR("value") };
+	struct i_val rows = beryl_new_array(0, NULL, 4, false);
+	if(BERYL_TYPEOF(rows) == TYPE_NULL) {
+		sqlite3_reset(stmt);
+		return BERYL_ERR("Out of memory");
+	}
+	
+	while( (err = sqlite3_step(stmt)) == SQLITE_ROW ) {
+		struct i_val row = create_table_from_row(stmt, 2, column_names);
+		if(BERYL_TYPEOF(row) != TYPE_ERR && !beryl_array_push(&rows, row)) {
+			beryl_release(row);
+			row = BERYL_ERR("Out of memory");
+		}
+		if(BERYL_TYPEOF(row) == TYPE_ERR) {
+			sqlite3_reset(stmt);
+			beryl_release(rows);
+			return row;
+		}
+	}
+	sqlite3_reset(stmt);
+	
+	if(err != SQLITE_DONE) {
+		beryl_release(rows);
+		blame_sql_error(err);
+		return BERYL_ERR("SQL error");
+	}
+	return rows;
+}
+
+// Runs a put (val != NULL) or delete; in writer mode, outside of transactions, it is run by the writer thread
+static struct i_val kv_exec(struct beryl_sqlkv_object *kv_obj, sqlite3_stmt *stmt, const struct i_val *key, const struct i_val *val) {
+	sqlite3 *db = sqlite3_db_handle(stmt);
+	
+	struct beryl_sqldb_object *db_obj = (struct beryl_sqldb_object *) beryl_as_object(kv_obj->db);
+	if(db_obj->writer != NULL && sqlite3_get_autocommit(db)) {
+		// The writer's commit changes the data version as seen from this connection. If the filter was in sync
+		// before, the new data version is taken as in sync too, so that the next lookup does not rebuild it.
+		// A commit by another connection while the write runs is taken for the writer's as well.
+		sqlite3_int64 data_version;
+		bool in_sync = kv_obj->bloom_valid && kv_data_version(kv_obj, &data_version) == SQLITE_OK
+			&& data_version == kv_obj->seen_data_version && sqlite3_total_changes64(db) == kv_obj->seen_changes;
+		
+		struct i_val params[] = { *key, val ? *val : BERYL_NULL };
+		struct i_val res = write_through_writer(db_obj, stmt, params, val ? 2 : 1);
+		uint64_t hash;
+		if(BERYL_TYPEOF(res) != TYPE_ERR && kv_obj->bloom_valid && val != NULL && i_val_key_hash(key, &hash))
+			bloom_add(&kv_obj->bloom, hash);
+		if(BERYL_TYPEOF(res) != TYPE_ERR && in_sync && kv_data_version(kv_obj, &data_version) == SQLITE_OK)
+			kv_obj->seen_data_version = data_version;
+		return res;
+	}
+	sqlite3_int64 changes_before = sqlite3_total_changes64(db);
+	
+	int err = bind_i_val_as_sql_param(stmt, 1, key);
+	if(!err && val != NULL)
+		err = bind_i_val_as_sql_param(stmt, 2, val);
+	if(!err)
+		err = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	
+	if(err != SQLITE_DONE) {
+		blame_sql_error(err);
+		return BERYL_ERR("SQL error");
+	}
+	
+	// Only this object's own write happened since the filter was last in sync, so it stays in sync
+	if(kv_obj->bloom_valid && changes_before == kv_obj->seen_changes) {
+		uint64_t hash;
+		if(val != NULL && i_val_key_hash(key, &hash))
+			bloom_add(&kv_obj->bloom, hash);
+		kv_obj->seen_changes = sqlite3_total_changes64(db);
+	}
+	return BERYL_NUMBER(sqlite3_changes(db));
+}
+
+static struct i_val beryl_sqlkv_object_call(struct beryl_object *obj, const struct i_val *args, i_size n_args) {
+	struct beryl_sqlkv_object *kv_obj = (struct beryl_sqlkv_object *) obj;
+	
+	struct beryl_sqldb_object *db_obj = (struct beryl_sqldb_object *) beryl_as_object(kv_obj->db);
+	if(db_obj->db == NULL)
+		return BERYL_ERR("Database has been closed");
+	note_db_use(db_obj);
+	
+	if(is_option(args[0], "get") && n_args == 2)
+		return kv_get(kv_obj, &args[1]);
+	else if(is_option(args[0], "put") && n_args == 3)
+		return kv_exec(kv_obj, kv_obj->put, &args[1], &args[2]);
+	else if(is_option(args[0], "delete") && n_args == 2)
+		return kv_exec(kv_obj, kv_obj->del, &args[1], NULL);
+	else if(is_option(args[0], "get-many") && n_args == 2)
+		return kv_get_many(kv_obj, args[1]);
+	else if(is_option(args[0], "range") && n_args == 3)
+		return kv_range(kv_obj, &args[1], &args[2]);
+	
+	beryl_blame_arg(args[0]);
+	return BERYL_ERR("Expected :get key, :put key value, :delete key, :get-many keys or :range from to");
+}
+
+struct beryl_object_class beryl_sqlkv_object_class = {
+	beryl_sqlkv_object_free,
+	beryl_sqlkv_object_call,
+	sizeof(struct beryl_sqlkv_object),
+	"sqlkv",
+	sizeof("sqlkv") - 1
+};
+
+static int prepare_printf(sqlite3 *db, sqlite3_stmt **stmt, const char *fmt, const char *name) {
+	char *sql = sqlite3_mprintf(fmt, name, name);
+	if(sql == NULL)
+		return SQLITE_NOMEM;
+	int err = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+	sqlite3_free(sql);
+	return err;
+}
+
+static struct i_val kv_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'kv'");
+	if(BERYL_TYPEOF(args[1]) != TYPE_STR) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected table name (a string) as second argument for 'kv'");
+	}
+	
+	bool use_bloom = false;
+	for(i_size i = 2; i < n_args; i++) {
+		if(is_option(args[i], "bloom"))
+			use_bloom = true;
+		else {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown option for 'kv'");
+		}
+	}
+	
+	char *name = beryl_str_to_cstr(args[1]);
+	if(name == NULL)
+		return BERYL_ERR("Out of memory");
+	
+	char *create_sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\" (k PRIMARY KEY NOT NULL, v) WITHOUT ROWID", name);
+	int err = create_sql ? sqlite3_exec(db_obj->db, create_sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+	sqlite3_free(create_sql);
+	
+	sqlite3_stmt *get = NULL, *put = NULL, *del = NULL, *range = NULL;
+	if(!err)
+		err = prepare_printf(db_obj->db, &get, "SELECT v FROM \"%w\" WHERE k = ?1", name);
+	if(!err)
+		err = prepare_printf(db_obj->db, &put, "INSERT INTO \"%w\" (k, v) VALUES (?1, ?2) ON CONFLICT (k) DO UPDATE SET v = excluded.v", name);
+	if(!err)
+		err = prepare_printf(db_obj->db, &del, "DELETE FROM \"%w\" WHERE k = ?1", name);
+	if(!err)
+		err = prepare_printf(db_obj->db, &range, "SELECT k, v FROM \"%w\" WHERE k >= ?1 AND k < ?2 ORDER BY k", name);
+	
+	sqlite3_stmt *data_version = NULL, *count = NULL, *scan = NULL;
+	if(!err && use_bloom) {
+		err = sqlite3_prepare_v3(db_obj->db, "PRAGMA data_version", -1, SQLITE_PREPARE_PERSISTENT, &data_version, NULL);
+		if(!err)
+			err = prepare_printf(db_obj->db, &count, "SELECT count(*) FROM \"%w\"", name);
+		if(!err)
+			err = prepare_printf(db_obj->db, &scan, "SELECT k FROM \"%w\"", name);
+	}
+	beryl_tfree(name);
+	
+	struct i_val kv_obj = BERYL_NULL;
+	if(!err) {
+		kv_obj = beryl_new_object(&beryl_sqlkv_object_class);
+		if(BERYL_TYPEOF(kv_obj) == TYPE_NULL)
+			err = SQLITE_NOMEM;
+	}
+	
+	if(err) {
+		sqlite3_finalize(get);
+		sqlite3_finalize(put);
+		sqlite3_finalize(del);
+		sqlite3_finalize(range);
+		sqlite3_finalize(data_version);
+		sqlite3_finalize(count);
+		sqlite3_finalize(scan);
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to create key/value store");
+	}
+	
+	struct beryl_sqlkv_object *kv_obj_val = (struct beryl_sqlkv_object *) beryl_as_object(kv_obj);
+	kv_obj_val->db = beryl_retain(args[0]);
+	kv_obj_val->get = get;
+	kv_obj_val->put = put;
+	kv_obj_val->del = del;
+	kv_obj_val->range = range;
+	kv_obj_val->use_bloom = use_bloom;
+	kv_obj_val->bloom_valid = false; // Built on the first lookup
+	kv_obj_val->data_version = data_version;
+	kv_obj_val->count = count;
+	kv_obj_val->scan = scan;
+	
+	return kv_obj;
+}
+
+struct beryl_sqlqueue_object {
+	struct beryl_object header;
+	struct i_val db; // Retained database object
+	sqlite3_stmt *push, *requeue, *claim, *ack, *nack;
+	sqlite3_stmt *begin, *commit, *rollback;
+};
+
+static void beryl_sqlqueue_object_free(struct beryl_object *obj) {
+	struct beryl_sqlqueue_object *queue_obj = (struct beryl_sqlqueue_object *) obj;
+	sqlite3_finalize(queue_obj->push);
+	sqlite3_finalize(queue_obj->requeue);
+	sqlite3_finalize(queue_obj->claim);
+	sqlite3_finalize(queue_obj->ack);
+	sqlite3_finalize(queue_obj->nack);
+	sqlite3_finalize(queue_obj->begin);
+	sqlite3_finalize(queue_obj->commit);
+	sqlite3_finalize(queue_obj->rollback);
+	beryl_release(queue_obj->db);
+}
+
+static int step_once(sqlite3_stmt *stmt) {
+	int err = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	return err == SQLITE_DONE ? SQLITE_OK : err;
+}
+
+// Takes the write lock up front (BEGIN IMMEDIATE), so that concurrent claimers queue on the busy
+// handler instead of failing when upgrading a read transaction. Inside an already open transaction
+// nothing is done; *began tells whether queue_end must commit.
+static int queue_begin(struct beryl_sqlqueue_object *queue_obj, bool *began) {
+	*began = sqlite3_get_autocommit(sqlite3_db_handle(queue_obj->begin));
+	if(!*began)
+		return SQLITE_OK;
+	return step_once(queue_obj->begin);
+}
+
+static int queue_end(struct beryl_sqlqueue_object *queue_obj, bool began, int err) {
+	if(!began)
+		return err;
+	if(err == SQLITE_OK)
+		err = step_once(queue_obj->commit);
+	if(err != SQLITE_OK)
+		step_once(queue_obj->rollback);
+	return err;
+}
+
+static struct i_val queue_error(int err) {
+	if(err == SQLITE_BUSY)
+		return BERYL_ERR("Database is busy (timeout)");
+	blame_sql_error(err);
+	return BERYL_ERR("SQL error");
+}
+
+static int queue_push_one(struct beryl_sqlqueue_object *queue_obj, const struct i_val *payload) {
+	int err = bind_i_val_as_sql_param(queue_obj->push, 1, payload);
+	if(err)
+		return err;
+	return step_once(queue_obj->push);
+}
+
+static struct i_val queue_push(struct beryl_sqlqueue_object *queue_obj, const struct i_val *payload) {
+	int err = queue_push_one(queue_obj, payload);
+	if(err)
+		return queue_error(err);
+	return BERYL_NUMBER(sqlite3_last_insert_rowid(sqlite3_db_handle(queue_obj->push)));
+}
+
+static struct i_val queue_push_many(struct beryl_sqlqueue_object *queue_obj, struct i_val payloads) {
+	if(BERYL_TYPEOF(payloads) != TYPE_ARRAY) {
+		beryl_blame_arg(payloads);
+		return BERYL_ERR("Expected array of payloads for :push-many");
+	}
+	
+	const struct i_val *items = beryl_get_raw_array(payloads);
+	i_size n = BERYL_LENOF(payloads);
+	
+	bool began;
+	int err = queue_begin(queue_obj, &began);
+	for(i_size i = 0; i < n && !err; i++)
+		err = queue_push_one(queue_obj, &items[i]);
+	err = queue_end(queue_obj, began, err);
+	
+	if(err)
+		return queue_error(err);
+	return BERYL_NUMBER(n);
+}
+
+static struct i_val queue_claim(struct beryl_sqlqueue_object *queue_obj, struct i_val n_val, struct i_val lease_val) {
+	if(BERYL_TYPEOF(n_val) != TYPE_NUMBER || beryl_as_num(n_val) < 1 || beryl_as_num(n_val) > INT_MAX) {
+		beryl_blame_arg(n_val);
+		return BERYL_ERR("Expected positive number of jobs for :claim");
+	}
+	if(BERYL_TYPEOF(lease_val) != TYPE_NUMBER || beryl_as_num(lease_val) < 0 || beryl_as_num(lease_val) > INT_MAX) {
+		beryl_blame_arg(lease_val);
+		return BERYL_ERR("Expected lease time in seconds for :claim");
+	}
+	
+	struct i_val column_names[] = { BERYL_CONST_STR("id"), BERYL_CONST_STR("payload"), BERYL_CONST_STR("attempts") };
+	struct i_val jobs = beryl_new_array(0, NULL, beryl_as_num(n_val) < 64 ? beryl_as_num(n_val) : 64, false);
+	if(BERYL_TYPEOF(jobs) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	sqlite3_int64 now = time(NULL);
+	
+	bool began;
+	int err = queue_begin(queue_obj, &began);
+	if(!err) {
+		sqlite3_bind_int64(queue_obj->requeue, 1, now);
+		err = step_once(queue_obj->requeue);
+	}
+	
+	struct i_val row = BERYL_NULL;
+	if(!err) {
+		sqlite3_stmt *claim = queue_obj->claim;
+		sqlite3_bind_int64(claim, 1, now);
+		sqlite3_bind_int64(claim, 2, now + (sqlite3_int64) beryl_as_num(lease_val));
+		sqlite3_bind_int(claim, 3, beryl_as_num(n_val));
+		while( (err = sqlite3_step(claim)) == SQLITE_ROW ) {
+			row = create_table_from_row(claim, 3, column_names);
+			if(BERYL_TYPEOF(row) != TYPE_ERR && !beryl_array_push(&jobs, row)) {
+				beryl_release(row);
+				row = BERYL_ERR("Out of memory");
+			}
+			if(BERYL_TYPEOF(row) == TYPE_ERR) {
+				err = SQLITE_ABORT; // Rolled back below, so the jobs stay unclaimed
+				break;
+			}
+		}
+		sqlite3_reset(claim);
+		if(err == SQLITE_DONE)
+			err = SQLITE_OK;
+	}
+	err = queue_end(queue_obj, began, err);
+	
+	if(err) {
+		beryl_release(jobs);
+		if(BERYL_TYPEOF(row) == TYPE_ERR)
+			return row;
+		return queue_error(err);
+	}
+	return jobs;
+}
+
+// Runs :ack or :nack. The attempts count returned by :claim identifies the lease, as every claim bumps it. Returns 1,
+// or 0 if the job is no longer leased under that claim (its lease ran out, and it may have been claimed again since).
+static struct i_val queue_finish(sqlite3_stmt *stmt, struct i_val id, struct i_val attempts, sqlite3_int64 retry_at) {
+	sqlite3_int64 id_num, attempts_num;
+	if(BERYL_TYPEOF(id) != TYPE_NUMBER || !num_to_int64(beryl_as_num(id), &id_num)) {
+		beryl_blame_arg(id);
+		return BERYL_ERR("Expected job id (an integer)");
+	}
+	if(BERYL_TYPEOF(attempts) != TYPE_NUMBER || !num_to_int64(beryl_as_num(attempts), &attempts_num)) {
+		beryl_blame_arg(attempts);
+		return BERYL_ERR("Expected the job's attempts count from :claim (an integer)");
+	}
+	
+	sqlite3_bind_int64(stmt, 1, id_num);
+	sqlite3_bind_int64(stmt, 3, attempts_num);
+	if(retry_at >= 0)
+		sqlite3_bind_int64(stmt, 2, retry_at);
+	int err = step_once(stmt);
+	if(err)
+		return queue_error(err);
+	return BERYL_NUMBER(sqlite3_changes(sqlite3_db_handle(stmt)));
+}
+
+static struct i_val beryl_sqlqueue_object_call(struct beryl_object *obj, const struct i_val *args, i_size n_args) {
+	struct beryl_sqlqueue_object *queue_obj = (struct beryl_sqlqueue_object *) obj;
+	
+	struct beryl_sqldb_object *db_obj = (struct beryl_sqldb_object *) beryl_as_object(queue_obj->db);
+	if(db_obj->db == NULL)
+		return BERYL_ERR("Database has been closed");
+	note_db_use(db_obj);
+	
+	struct i_val local = check_local_write(db_obj);
+	if(BERYL_TYPEOF(local) == TYPE_ERR)
+		return local;
+	
+	// Queue changes are committed right away, so that other workers see them; a pending batch goes first
+	struct i_val flushed = commit_batch_first(db_obj);
+	if(BERYL_TYPEOF(flushed) == TYPE_ERR)
+		return flushed;
+	
+	if(is_option(args[0], "push") && n_args == 2)
+		return queue_push(queue_obj, &args[1]);
+	else if(is_option(args[0], "push-many") && n_args == 2)
+		return queue_push_many(queue_obj, args[1]);
+	else if(is_option(args[0], "claim") && n_args == 3)
+		return queue_claim(queue_obj, args[1], args[2]);
+	else if(is_option(args[0], "ack") && n_args == 3)
+		return queue_finish(queue_obj->ack, args[1], args[2], -1);
+	else if(is_option(args[0], "nack") && (n_args == 3 || n_args == 4)) {
+		sqlite3_int64 delay = 0;
+		if(n_args == 4) {
+			if(BERYL_TYPEOF(args[3]) != TYPE_NUMBER || beryl_as_num(args[3]) < 0 || beryl_as_num(args[3]) > INT_MAX) {
+				beryl_blame_arg(args[3]);
+				return BERYL_ERR("Expected retry delay in seconds for :nack");
+			}
+			delay = beryl_as_num(args[3]);
+		}
+		return queue_finish(queue_obj->nack, args[1], args[2], time(NULL) + delay);
+	}
+	
+	beryl_blame_arg(args[0]);
+	return BERYL_ERR("Expected :push payload, :push-many payloads, :claim n lease, :ack id attempts or :nack id attempts [delay]");
+}
+
+struct beryl_object_class beryl_sqlqueue_object_class = {
+	beryl_sqlqueue_object_free,
+	beryl_sqlqueue_object_call,
+	sizeof(struct beryl_sqlqueue_object),
+	"sqlqueue",
+	sizeof("sqlqueue") - 1
+};
+
+// Jobs are rows with state 0 (ready) or 1 (leased). For ready jobs lease_until is the earliest
+// time they may be claimed, for leased ones the time the lease runs out. Both claim steps are
+// range scans over the (state, lease_until) index. attempts is bumped by every claim, so together
+// with the id it names one lease, which :ack and :nack must match.
+static struct i_val queue_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'queue'");
+	if(BERYL_TYPEOF(args[1]) != TYPE_STR) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected table name (a string) as second argument for 'queue'");
+	}
+	
+	char *name = beryl_str_to_cstr(args[1]);
+	if(name == NULL)
+		return BERYL_ERR("Out of memory");
+	
+	char *create_sql = sqlite3_mprintf(
+		"CREATE TABLE IF NOT EXISTS \"%w\" (id INTEGER PRIMARY KEY, payload, state INTEGER NOT NULL DEFAULT 0, lease_until INTEGER NOT NULL DEFAULT 0, attempts INTEGER NOT NULL DEFAULT 0);"
+		"CREATE INDEX IF NOT EXISTS \"%w_state\" ON \"%w\" (state, lease_until)",
+		name, name, name
+	);
+	int err = create_sql ? sqlite3_exec(db_obj->db, create_sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+	sqlite3_free(create_sql);
+	
+	sqlite3_stmt *push = NULL, *requeue = NULL, *claim = NULL, *ack = NULL, *nack = NULL;
+	sqlite3_stmt *begin = NULL, *commit = NULL, *rollback = NULL;
+	if(!err)
+		err = prepare_printf(db_obj->db, &push, "INSERT INTO \"%w\" (payload) VALUES (?1)", name);
+	if(!err)
+		err = prepare_printf(db_obj->db, &requeue, "UPDATE \"%w\" SET state = 0 WHERE state = 1 AND lease_until <= ?1", name);
+	if(!err)
+		err = prepare_printf(db_obj->db, &claim,
+			"UPDATE \"%w\" SET state = 1, lease_until = ?2, attempts = attempts + 1 "
+			"WHERE id IN (SELECT id FROM \"%w\" WHERE state = 0 AND lease_until <= ?1 ORDER BY lease_until LIMIT ?3) "
+			"RETURNING id, payload, attempts", name);
+	if(!err)
+		err = prepare_printf(db_obj->db, &ack, "DELETE FROM \"%w\" WHERE id = ?1 AND state = 1 AND attempts = ?3", name);
+	if(!err)
+		err = prepare_printf(db_obj->db, &nack, "UPDATE \"%w\" SET state = 0, lease_until = ?2 WHERE id = ?1 AND state = 1 AND attempts = ?3", name);
+	beryl_tfree(name);
+	
+	if(!err)
+		err = sqlite3_prepare_v3(db_obj->db, "BEGIN IMMEDIATE", -1, SQLITE_PREPARE_PERSISTENT, &begin, NULL);
+	if(!err)
+		err = sqlite3_prepare_v3(db_obj->db, "COMMIT", -1, SQLITE_PREPARE_PERSISTENT, &commit, NULL);
+	if(!err)
+		err = sqlite3_prepare_v3(db_obj->db, "ROLLBACK", -1, SQLITE_PREPARE_PERSISTENT, &rollback, NULL);
+	
+	struct i_val queue_obj = BERYL_NULL;
+	if(!err) {
+		queue_obj = beryl_new_object(&beryl_sqlqueue_object_class);
+		if(BERYL_TYPEOF(queue_obj) == TYPE_NULL)
+			err = SQLITE_NOMEM;
+	}
+	
+	if(err) {
+		sqlite3_finalize(push);
+		sqlite3_finalize(requeue);
+		sqlite3_finalize(claim);
+		sqlite3_finalize(ack);
+		sqlite3_finalize(nack);
+		sqlite3_finalize(begin);
+		sqlite3_finalize(commit);
+		sqlite3_finalize(rollback);
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to create queue");
+	}
+	
+	struct beryl_sqlqueue_object *queue_obj_val = (struct beryl_sqlqueue_object *) beryl_as_object(queue_obj);
+	queue_obj_val->db = beryl_retain(args[0]);
+	queue_obj_val->push = push;
+	queue_obj_val->requeue = requeue;
+	queue_obj_val->claim = claim;
+	queue_obj_val->ack = ack;
+	queue_obj_val->nack = nack;
+	queue_obj_val->begin = begin;
+	queue_obj_val->commit = commit;
+	queue_obj_val->rollback = rollback;
+	
+	return queue_obj;
+}
+
+static struct i_val materialize_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'materialize'");
+	for(int i = 1; i <= 2; i++) {
+		if(BERYL_TYPEOF(args[i]) != TYPE_STR) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected SQL query and file path (strings) for 'materialize'");
+		}
+	}
+	note_db_use(db_obj);
+	
+	sqlite3_stmt *stmt;
+	int err = sqlite3_prepare_v2(db_obj->db, beryl_get_raw_str(&args[1]), BERYL_LENOF(args[1]), &stmt, NULL);
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("SQL compiler error");
+	}
+	if(stmt == NULL)
+		return BERYL_ERR("Expected an SQL statement");
+	
+	for(i_size i = 3; i < n_args && !err; i++)
+		err = bind_i_val_as_sql_param(stmt, i - 2, &args[i]);
+	if(err) {
+		sqlite3_finalize(stmt);
+		blame_sql_error(err);
+		return BERYL_ERR("SQL parameter error");
+	}
+	
+	char *path = beryl_str_to_cstr(args[2]);
+	if(path == NULL) {
+		sqlite3_finalize(stmt);
+		return BERYL_ERR("Out of memory");
+	}
+	
+	uint64_t n_rows;
+	err = result_cache_write(stmt, path, &n_rows);
+	sqlite3_finalize(stmt);
+	beryl_tfree(path);
+	
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to materialize result");
+	}
+	return BERYL_NUMBER(n_rows);
+}
+
+struct beryl_sqlresult_object {
+	struct beryl_object header;
+	struct result_cache cache;
+	struct i_val *column_names;
+};
+
+static void beryl_sqlresult_object_free(struct beryl_object *obj) {
+	struct beryl_sqlresult_object *res_obj = (struct beryl_sqlresult_object *) obj;
+	for(uint32_t i = 0; res_obj->column_names != NULL && i < res_obj->cache.n_columns; i++)
+		beryl_release(res_obj->column_names[i]);
+	free(res_obj->column_names);
+	result_cache_close(&res_obj->cache);
+}
+
+static struct i_val result_value_to_i_val(const struct result_value *val) {
+	switch(val->type) {
+		case SQLITE_INTEGER:
+			return BERYL_NUMBER(val->i);
+		case SQLITE_FLOAT:
+			return BERYL_NUMBER(val->f);
+		case SQLITE_TEXT:
+		case SQLITE_BLOB: {
+			if(val->len > I_SIZE_MAX)
+				return BERYL_ERR("Text/blob too large");
+			struct i_val str = beryl_new_string(val->len, val->data);
+			if(BERYL_TYPEOF(str) == TYPE_NULL)
+				return BERYL_ERR("Out of memory");
+			return str;
+		}
+		default:
+			return BERYL_NULL;
+	}
+}
+
+static struct i_val result_get(const struct result_cache *cache, uint64_t row, uint32_t column) {
+	struct result_value val;
+	int err = result_cache_value(cache, row, column, &val);
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to read cached result");
+	}
+	return result_value_to_i_val(&val);
+}
+
+static struct i_val result_row(struct beryl_sqlresult_object *res_obj, uint64_t row) {
+	struct i_val table = beryl_new_table(res_obj->cache.n_columns, true);
+	if(BERYL_TYPEOF(table) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	for(uint32_t i = 0; i < res_obj->cache.n_columns; i++) {
+		struct i_val val = result_get(&res_obj->cache, row, i);
+		if(BERYL_TYPEOF(val) == TYPE_ERR) {
+			beryl_release(table);
+			return val;
+		}
+		beryl_table_insert(&table, res_obj->column_names[i], val, false);
+	}
+	return table;
+}
+
+static struct i_val result_rows(struct beryl_sqlresult_object *res_obj) {
+	if(res_obj->cache.n_rows > I_SIZE_MAX)
+		return BERYL_ERR("Too many rows");
+	
+	struct i_val rows = beryl_new_array(0, NULL, res_obj->cache.n_rows, false);
+	if(BERYL_TYPEOF(rows) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	for(uint64_t i = 0; i < res_obj->cache.n_rows; i++) {
+		struct i_val row = result_row(res_obj, i);
+		if(BERYL_TYPEOF(row) != TYPE_ERR && !beryl_array_push(&rows, row)) {
+			beryl_release(row);
+			row = BERYL_ERR("Out of memory");
+		}
+		if(BERYL_TYPEOF(row) == TYPE_ERR) {
+			beryl_release(rows);
+			return row;
+		}
+	}
+	return rows;
+}
+
+// Returns false (and blames the argument) if it is not a valid row index
+static bool get_row_index(const struct beryl_sqlresult_object *res_obj, struct i_val val, uint64_t *row) {
+	if(BERYL_TYPEOF(val) != TYPE_NUMBER || !beryl_is_integer(val) || beryl_as_num(val) < 0 || beryl_as_num(val) >= res_obj->cache.n_rows) {
+		beryl_blame_arg(val);
+		return false;
+	}
+	*row = beryl_as_num(val);
+	return true;
+}
+
+static bool get_column_index(const struct beryl_sqlresult_object *res_obj, struct i_val val, uint32_t *column) {
+	for(uint32_t i = 0; i < res_obj->cache.n_columns; i++) {
+		if(strs_equal(val, res_obj->column_names[i])) {
+			*column = i;
+			return true;
+		}
+	}
+	beryl_blame_arg(val);
+	return false;
+}
+
+static struct i_val beryl_sqlresult_object_call(struct beryl_object *obj, const struct i_val *args, i_size n_args) {
+	struct beryl_sqlresult_object *res_obj = (struct beryl_sqlresult_object *) obj;
+	uint64_t row;
+	uint32_t column;
+	
+	if(is_option(args[0], "count") && n_args == 1)
+		return BERYL_NUMBER(res_obj->cache.n_rows);
+	else if(is_option(args[0], "columns") && n_args == 1) {
+		struct i_val names = beryl_new_array(0, NULL, res_obj->cache.n_columns, false);
+		if(BERYL_TYPEOF(names) == TYPE_NULL)
+			return BERYL_ERR("Out of memory");
+		for(uint32_t i = 0; i < res_obj->cache.n_columns; i++) {
+			if(!beryl_array_push(&names, beryl_retain(res_obj->column_names[i]))) {
+				beryl_release(res_obj->column_names[i]);
+				beryl_release(names);
+				return BERYL_ERR("Out of memory");
+			}
+		}
+		return names;
+	} else if(is_option(args[0], "row") && n_args == 2) {
+		if(!get_row_index(res_obj, args[1], &row))
+			return BERYL_ERR("Row index out of range");
+		return result_row(res_obj, row);
+	} else if(is_option(args[0], "get") && n_args == 3) {
+		if(!get_row_index(res_obj, args[1], &row))
+			return BERYL_ERR("Row index out of range");
+		if(!get_column_index(res_obj, args[2], &column))
+			return BERYL_ERR("Unknown column");
+		return result_get(&res_obj->cache, row, column);
+	} else if(is_option(args[0], "rows") && n_args == 1)
+		return result_rows(res_obj);
+	
+	beryl_blame_arg(args[0]);
+	return BERYL_ERR("Expected :count, :columns, :row index, :get index column or :rows");
+}
+
+struct beryl_object_class beryl_sqlresult_object_class = {
+	beryl_sqlresult_object_free,
+	beryl_sqlresult_object_call,
+	sizeof(struct beryl_sqlresult_object),
+	"sqlresult",
+	sizeof("sqlresult") - 1
+};
+
+static struct i_val load_result_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	if(BERYL_TYPEOF(args[0]) != TYPE_STR) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected file path (a string) as argument for 'load-result'");
+	}
+	
+	char *path = beryl_str_to_cstr(args[0]);
+	if(path == NULL)
+		return BERYL_ERR("Out of memory");
+	
+	struct result_cache cache;
+	int err = result_cache_open(&cache, path);
+	beryl_tfree(path);
+	if(err) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR(err == SQLITE_CORRUPT ? "Not a result cache file" : "Unable to open result cache file");
+	}
+	
+	struct i_val *column_names = calloc(cache.n_columns ? cache.n_columns : 1, sizeof(struct i_val));
+	struct i_val res_obj = BERYL_NULL;
+	if(column_names != NULL)
+		res_obj = beryl_new_object(&beryl_sqlresult_object_class);
+	if(BERYL_TYPEOF(res_obj) == TYPE_NULL) {
+		free(column_names);
+		result_cache_close(&cache);
+		return BERYL_ERR("Out of memory");
+	}
+	
+	struct beryl_sqlresult_object *res_obj_val = (struct beryl_sqlresult_object *) beryl_as_object(res_obj);
+	res_obj_val->cache = cache;
+	res_obj_val->column_names = column_names;
+	for(uint32_t i = 0; i < cache.n_columns; i++) {
+		const char *name;
+		uint64_t len;
+		err = result_cache_column_name(&cache, i, &name, &len);
+		column_names[i] = err || len > I_SIZE_MAX ? BERYL_NULL : beryl_new_string(len, name);
+		if(BERYL_TYPEOF(column_names[i]) == TYPE_NULL) {
+			beryl_release(res_obj); // Frees the names created so far, the rest are null
+			return err ? BERYL_ERR("Not a result cache file") : BERYL_ERR("Out of memory");
+		}
+	}
+	
+	return res_obj;
+}
+
+// Orders values like SQLite does (null < numbers < text < blobs), for presorting rows by key
+static int compare_i_vals(const struct i_val *a, const struct i_val *b) {
+	int rank_a = BERYL_TYPEOF(*a) == TYPE_NULL ? 0 : BERYL_TYPEOF(*a) == TYPE_NUMBER ? 1 : BERYL_TYPEOF(*a) == TYPE_STR ? 2 : 3;
+	int rank_b = BERYL_TYPEOF(*b) == TYPE_NULL ? 0 : BERYL_TYPEOF(*b) == TYPE_NUMBER ? 1 : BERYL_TYPEOF(*b) == TYPE_STR ? 2 : 3;
+	if(rank_a != rank_b)
+		return rank_a - rank_b;
+	
+	if(rank_a == 1) {
+		i_float x = beryl_as_num(*a), y = beryl_as_num(*b);
+		return (x > y) - (x < y);
+	} else if(rank_a == 2) {
+		i_size len_a = BERYL_LENOF(*a), len_b = BERYL_LENOF(*b);
+		int res = memcmp(beryl_get_raw_str(a), beryl_get_raw_str(b), len_a < len_b ? len_a : len_b);
+		return res != 0 ? res : (len_a > len_b) - (len_a < len_b);
+	}
+	return 0;
+}
+
+struct sort_entry {
+	const struct i_val *keys;
+	i_size n_keys;
+	i_size row;
+};
+
+static int compare_sort_entries(const void *a, const void *b) {
+	const struct sort_entry *x = a, *y = b;
+	for(i_size i = 0; i < x->n_keys; i++) {
+		int res = compare_i_vals(&x->keys[i], &y->keys[i]);
+		if(res != 0)
+			return res;
+	}
+	return (x->row > y->row) - (x->row < y->row); // Keeps the sort stable
+}
+
+// Collects the keys of a row table, which become the column names of the insert; fails if any key is not a string
+static struct i_val *get_row_keys(struct i_val row, i_size *n_keys) {
+	*n_keys = BERYL_LENOF(row);
+	struct i_val *keys = beryl_talloc(sizeof(struct i_val) * (*n_keys ? *n_keys : 1));
+	if(keys == NULL)
+		return NULL;
+	
+	i_size iter = 0, n = 0;
+	struct i_val key, val;
+	while(n < *n_keys && beryl_iter_table(row, &iter, &key, &val)) {
+		if(BERYL_TYPEOF(key) != TYPE_STR) {
+			beryl_blame_arg(key);
+			beryl_tfree(keys);
+			return NULL;
+		}
+		keys[n++] = key;
+	}
+	*n_keys = n;
+	return keys;
+}
+
+// Finds key among the names; rows built the same way iterate their keys in the same order, so the
+// iteration position is tried first
+static i_size find_key(struct i_val key, const struct i_val *names, i_size n_names, i_size hint) {
+	if(hint < n_names && strs_equal(key, names[hint]))
+		return hint;
+	for(i_size i = 0; i < n_names; i++) {
+		if(strs_equal(key, names[i]))
+			return i;
+	}
+	return n_names;
+}
+
+// Binds the values of a row table to the parameters numbered after the given column names.
+// Returns SQLITE_MISMATCH if the row does not have exactly those keys.
+static int bind_row(sqlite3_stmt *stmt, struct i_val row, const struct i_val *names, i_size n_names) {
+	if(BERYL_TYPEOF(row) != TYPE_TABLE || BERYL_LENOF(row) != n_names)
+		return SQLITE_MISMATCH;
+	
+	i_size iter = 0, pos = 0;
+	struct i_val key, val;
+	while(beryl_iter_table(row, &iter, &key, &val)) {
+		i_size column = find_key(key, names, n_names, pos++);
+		if(column == n_names)
+			return SQLITE_MISMATCH;
+		int err = bind_i_val_as_sql_param(stmt, column + 1, &val);
+		if(err)
+			return err;
+	}
+	return SQLITE_OK;
+}
+
+enum conflict_mode { CONFLICT_ABORT, CONFLICT_IGNORE, CONFLICT_REPLACE, CONFLICT_UPDATE };
+
+struct conflict_clause {
+	enum conflict_mode mode;
+	const struct i_val *keys; // CONFLICT_UPDATE: the conflict target columns
+	i_size n_keys;
+};
+
+// INSERT INTO "table" ("a", "b", ...) VALUES (?1, ?2, ...) plus the conflict handling (which may be NULL); free with sqlite3_free
+static char *build_insert_sql(sqlite3 *db, const char *table, const struct i_val *names, i_size n_names, const struct conflict_clause *conflict) {
+	enum conflict_mode mode = conflict ? conflict->mode : CONFLICT_ABORT;
+	
+	sqlite3_str *str = sqlite3_str_new(db);
+	sqlite3_str_appendall(str, mode == CONFLICT_IGNORE ? "INSERT OR IGNORE" : mode == CONFLICT_REPLACE ? "INSERT OR REPLACE" : "INSERT");
+	sqlite3_str_appendf(str, " INTO \"%w\" (", table);
+	for(i_size i = 0; i < n_names; i++)
+		sqlite3_str_appendf(str, i == 0 ? "\"%.*w\"" : ", \"%.*w\"", (int) BERYL_LENOF(names[i]), beryl_get_raw_str(&names[i]));
+	sqlite3_str_appendall(str, ") VALUES (");
+	for(i_size i = 0; i < n_names; i++)
+		sqlite3_str_appendf(str, i == 0 ? "?%u" : ", ?%u", (unsigned) i + 1);
+	sqlite3_str_appendchar(str, 1, ')');
+	
+	if(mode == CONFLICT_UPDATE) {
+		sqlite3_str_appendall(str, " ON CONFLICT (");
+		for(i_size i = 0; i < conflict->n_keys; i++)
+			sqlite3_str_appendf(str, i == 0 ? "\"%.*w\"" : ", \"%.*w\"", (int) BERYL_LENOF(conflict->keys[i]), beryl_get_raw_str(&conflict->keys[i]));
+		sqlite3_str_appendall(str, ") DO ");
+		
+		i_size n_set = 0;
+		for(i_size i = 0; i < n_names; i++) {
+			bool is_key = false;
+			for(i_size j = 0; j < conflict->n_keys; j++)
+				is_key = is_key || strs_equal(names[i], conflict->keys[j]);
+			if(is_key)
+				continue;
+			int len = BERYL_LENOF(names[i]);
+			const char *name = beryl_get_raw_str(&names[i]);
+			sqlite3_str_appendf(str, n_set++ == 0 ? "UPDATE SET \"%.*w\" = excluded.\"%.*w\"" : ", \"%.*w\" = excluded.\"%.*w\"", len, name, len, name);
+		}
+		if(n_set == 0)
+			sqlite3_str_appendall(str, "NOTHING");
+	}
+	return sqlite3_str_finish(str);
+}
+
+// Returns the load order of the rows: sorted by primary key when all its columns are among the names,
+// otherwise as given. NULL if out of memory.
+static i_size *bulk_load_order(sqlite3 *db, const char *table, const struct i_val *rows, i_size n_rows, const struct i_val *names, i_size n_names, bool presorted) {
+	i_size *order = malloc(sizeof(i_size) * n_rows);
+	if(order == NULL)
+		return NULL;
+	for(i_size i = 0; i < n_rows; i++)
+		order[i] = i;
+	
+	char **pk_names;
+	int n_pk;
+	if(presorted || bulk_load_primary_key(db, table, &pk_names, &n_pk) != SQLITE_OK)
+		return order;
+	
+	i_size *pk_columns = malloc(sizeof(i_size) * (n_pk ? n_pk : 1));
+	bool sortable = n_pk != 0 && pk_columns != NULL;
+	for(int i = 0; i < n_pk && sortable; i++) {
+		pk_columns[i] = n_names;
+		for(i_size j = 0; j < n_names; j++) {
+			if(BERYL_LENOF(names[j]) == strlen(pk_names[i]) && memcmp(beryl_get_raw_str(&names[j]), pk_names[i], BERYL_LENOF(names[j])) == 0)
+				pk_columns[i] = j;
+		}
+		sortable = pk_columns[i] != n_names;
+	}
+	bulk_load_free_names(pk_names, n_pk);
+	
+	struct i_val *keys = sortable ? malloc(sizeof(struct i_val) * n_rows * n_pk) : NULL;
+	struct sort_entry *entries = keys ? malloc(sizeof(struct sort_entry) * n_rows) : NULL;
+	if(entries != NULL) {
+		for(i_size i = 0; i < n_rows; i++) {
+			struct i_val *row_keys = &keys[(size_t) i * n_pk];
+			for(int j = 0; j < n_pk; j++)
+				row_keys[j] = BERYL_NULL;
+			
+			i_size iter = 0, pos = 0;
+			struct i_val key, val;
+			while(BERYL_TYPEOF(rows[i]) == TYPE_TABLE && beryl_iter_table(rows[i], &iter, &key, &val)) {
+				i_size column = find_key(key, names, n_names, pos++);
+				for(int j = 0; j < n_pk; j++) {
+					if(pk_columns[j] == column)
+						row_keys[j] = val;
+				}
+			}
+			entries[i] = (struct sort_entry) { row_keys, n_pk, i };
+		}
+		
+		qsort(entries, n_rows, sizeof(struct sort_entry), compare_sort_entries);
+		for(i_size i = 0; i < n_rows; i++)
+			order[i] = entries[i].row;
+	}
+	
+	free(entries);
+	free(keys);
+	free(pk_columns);
+	return order;
+}
+
+static struct i_val bulk_load_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'bulk-load'");
+	if(BERYL_TYPEOF(args[1]) != TYPE_STR) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected table name (a string) as second argument for 'bulk-load'");
+	}
+	if(BERYL_TYPEOF(args[2]) != TYPE_ARRAY) {
+		beryl_blame_arg(args[2]);
+		return BERYL_ERR("Expected array of rows (tables) as third argument for 'bulk-load'");
+	}
+	
+	bool drop_indexes = false, presorted = false;
+	for(i_size i = 3; i < n_args; i++) {
+		if(is_option(args[i], "drop-indexes"))
+			drop_indexes = true;
+		else if(is_option(args[i], "presorted"))
+			presorted = true;
+		else {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown option for 'bulk-load'");
+		}
+	}
+	note_db_use(db_obj);
+	struct i_val local = check_local_write(db_obj);
+	if(BERYL_TYPEOF(local) == TYPE_ERR)
+		return local;
+	
+	const struct i_val *rows = beryl_get_raw_array(args[2]);
+	i_size n_rows = BERYL_LENOF(args[2]);
+	if(n_rows == 0)
+		return BERYL_NUMBER(0);
+	if(BERYL_TYPEOF(rows[0]) != TYPE_TABLE) {
+		beryl_blame_arg(rows[0]);
+		return BERYL_ERR("Expected rows to be tables");
+	}
+	
+	i_size n_names;
+	struct i_val *names = get_row_keys(rows[0], &n_names);
+	if(names == NULL)
+		return BERYL_ERR("Expected row keys to be column names (strings)");
+	char *table = beryl_str_to_cstr(args[1]);
+	char *sql = table ? build_insert_sql(db_obj->db, table, names, n_names, NULL) : NULL;
+	i_size *order = table ? bulk_load_order(db_obj->db, table, rows, n_rows, names, n_names, presorted) : NULL;
+	
+	struct i_val res = BERYL_NULL;
+	sqlite3_stmt *stmt = NULL;
+	int err = sql && order ? SQLITE_OK : SQLITE_NOMEM;
+	if(!err)
+		err = sqlite3_prepare_v2(db_obj->db, sql, -1, &stmt, NULL);
+	if(err) {
+		blame_sql_error(err);
+		res = BERYL_ERR("Unable to prepare insert");
+	}
+	
+	struct bulk_load bl;
+	if(!err) {
+		res = commit_batch_first(db_obj);
+		if(BERYL_TYPEOF(res) == TYPE_ERR)
+			err = SQLITE_ABORT;
+	}
+	if(!err) {
+		err = bulk_load_begin(&bl, db_obj->db, table, drop_indexes);
+		if(err == SQLITE_MISUSE)
+			res = BERYL_ERR("'bulk-load' cannot be used inside a transaction");
+		else if(err) {
+			blame_sql_error(err);
+			res = BERYL_ERR("Unable to start bulk load");
+		}
+	}
+	
+	if(!err) {
+		for(i_size i = 0; i < n_rows && !err; i++) {
+			err = bind_row(stmt, rows[order[i]], names, n_names);
+			if(err == SQLITE_MISMATCH) {
+				beryl_blame_arg(rows[order[i]]);
+				res = BERYL_ERR("Rows must all have the same keys");
+				break;
+			}
+			if(!err)
+				err = sqlite3_step(stmt);
+			if(err == SQLITE_DONE)
+				err = SQLITE_OK;
+			sqlite3_reset(stmt);
+		}
+		
+		int end_err = bulk_load_end(&bl, err == SQLITE_OK);
+		if(!err && end_err)
+			err = end_err;
+		if(err && BERYL_TYPEOF(res) != TYPE_ERR) {
+			blame_sql_error(err);
+			res = BERYL_ERR("Bulk load failed (rolled back)");
+		}
+	}
+	
+	sqlite3_finalize(stmt);
+	sqlite3_free(sql);
+	free(order);
+	beryl_tfree(table);
+	beryl_tfree(names);
+	
+	if(err)
+		return res;
+	return BERYL_NUMBER(n_rows);
+}
+
+static struct i_val insert_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'insert'");
+	if(BERYL_TYPEOF(args[1]) != TYPE_STR) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected table name (a string) as second argument for 'insert'");
+	}
+	
+	const struct i_val *rows;
+	i_size n_rows;
+	if(BERYL_TYPEOF(args[2]) == TYPE_TABLE) {
+		rows = &args[2];
+		n_rows = 1;
+	} else if(BERYL_TYPEOF(args[2]) == TYPE_ARRAY) {
+		rows = beryl_get_raw_array(args[2]);
+		n_rows = BERYL_LENOF(args[2]);
+	} else {
+		beryl_blame_arg(args[2]);
+		return BERYL_ERR("Expected a row (table) or an array of rows as third argument for 'insert'");
+	}
+	
+	struct conflict_clause conflict = { CONFLICT_ABORT, NULL, 0 };
+	for(i_size i = 3; i < n_args; i++) {
+		if(!is_option(args[i], "on-conflict") || i + 1 == n_args) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown option for 'insert'");
+		}
+		i++;
+		if(is_option(args[i], "ignore"))
+			conflict.mode = CONFLICT_IGNORE;
+		else if(is_option(args[i], "replace"))
+			conflict.mode = CONFLICT_REPLACE;
+		else if(is_option(args[i], "update") && i + 1 < n_args) {
+			i++;
+			conflict.mode = CONFLICT_UPDATE;
+			if(BERYL_TYPEOF(args[i]) == TYPE_STR) {
+				conflict.keys = &args[i];
+				conflict.n_keys = 1;
+			} else if(BERYL_TYPEOF(args[i]) == TYPE_ARRAY && BERYL_LENOF(args[i]) != 0) {
+				conflict.keys = beryl_get_raw_array(args[i]);
+				conflict.n_keys = BERYL_LENOF(args[i]);
+			}
+			for(i_size j = 0; j < conflict.n_keys; j++) {
+				if(BERYL_TYPEOF(conflict.keys[j]) != TYPE_STR)
+					conflict.n_keys = 0;
+			}
+			if(conflict.n_keys == 0) {
+				beryl_blame_arg(args[i]);
+				return BERYL_ERR("Expected key column name(s) after :on-conflict :update");
+			}
+		} else {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected :ignore, :replace or :update key-columns after :on-conflict");
+		}
+	}
+	note_db_use(db_obj);
+	struct i_val local = check_local_write(db_obj);
+	if(BERYL_TYPEOF(local) == TYPE_ERR)
+		return local;
+	
+	char *table = beryl_str_to_cstr(args[1]);
+	if(table == NULL)
+		return BERYL_ERR("Out of memory");
+	
+	// Several rows are inserted all or nothing; the savepoint also saves a commit per row outside of transactions
+	bool use_savepoint = n_rows > 1;
+	if(use_savepoint && db_obj->batch != NULL)
+		group_commit_hold(db_obj->batch);
+	int err = use_savepoint ? sqlite3_exec(db_obj->db, "SAVEPOINT beryl_insert", NULL, NULL, NULL) : SQLITE_OK;
+	
+	struct i_val res = BERYL_NULL;
+	struct i_val *names = NULL;
+	i_size n_names = 0;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_int64 changes = 0;
+	for(i_size i = 0; i < n_rows && !err; i++) {
+		if(BERYL_TYPEOF(rows[i]) != TYPE_TABLE) {
+			beryl_blame_arg(rows[i]);
+			res = BERYL_ERR("Expected rows to be tables");
+			err = SQLITE_MISMATCH;
+			break;
+		}
+		
+		// Rows with the same keys as the previous one reuse its statement without building any SQL
+		err = stmt ? bind_row(stmt, rows[i], names, n_names) : SQLITE_MISMATCH;
+		if(err == SQLITE_MISMATCH) {
+			beryl_tfree(names);
+			names = get_row_keys(rows[i], &n_names);
+			if(names == NULL) {
+				res = BERYL_ERR("Expected row keys to be column names (strings)");
+				break;
+			}
+			
+			char *sql = build_insert_sql(db_obj->db, table, names, n_names, &conflict);
+			err = sql ? stmt_cache_get(&db_obj->stmts, db_obj->db, sql, strlen(sql), &stmt) : SQLITE_NOMEM;
+			sqlite3_free(sql);
+			if(!err)
+				err = bind_row(stmt, rows[i], names, n_names);
+		}
+		
+		if(!err)
+			err = sqlite3_step(stmt);
+		if(err == SQLITE_DONE) {
+			err = SQLITE_OK;
+			changes += sqlite3_changes(db_obj->db);
+		}
+		if(stmt != NULL)
+			sqlite3_reset(stmt);
+	}
+	beryl_tfree(names);
+	beryl_tfree(table);
+	
+	if(use_savepoint) {
+		if(err)
+			sqlite3_exec(db_obj->db, "ROLLBACK TO beryl_insert", NULL, NULL, NULL);
+		int release_err = sqlite3_exec(db_obj->db, "RELEASE beryl_insert", NULL, NULL, NULL);
+		if(!err)
+			err = release_err;
+		if(db_obj->batch != NULL)
+			group_commit_unhold(db_obj->batch);
+	}
+	
+	if(err) {
+		if(BERYL_TYPEOF(res) == TYPE_ERR)
+			return res;
+		if(err == SQLITE_BUSY)
+			return BERYL_ERR("Database is busy (timeout)");
+		blame_sql_error(err);
+		return BERYL_ERR("SQL error");
+	}
+	return BERYL_NUMBER(changes);
+}
+
+// Runs one step of a pipeline: its rows, or its number of changes if it returns none
+static struct i_val run_pipeline_step(struct beryl_sqldb_object *db_obj, struct i_val step) {
+	const struct i_val *params = NULL;
+	i_size n_params = 0;
+	if(BERYL_TYPEOF(step) == TYPE_ARRAY && BERYL_LENOF(step) != 0) {
+		params = beryl_get_raw_array(step) + 1;
+		n_params = BERYL_LENOF(step) - 1;
+		step = beryl_get_raw_array(step)[0];
+	}
+	if(BERYL_TYPEOF(step) != TYPE_STR) {
+		beryl_blame_arg(step);
+		return BERYL_ERR("Expected steps to be [sql, params...] arrays");
+	}
+	if(n_params > (i_size) sqlite3_limit(db_obj->db, SQLITE_LIMIT_VARIABLE_NUMBER, -1))
+		return BERYL_ERR("Too many parameters");
+	
+	sqlite3_stmt *stmt;
+	int err = prepare_single_statement(&db_obj->stmts, db_obj->db, beryl_get_raw_str(&step), BERYL_LENOF(step), &stmt);
+	if(err) {
+		beryl_blame_arg(step);
+		if(err == SQLITE_MISUSE)
+			return BERYL_ERR("Expected an SQL statement");
+		if(err == SEVERAL_STATEMENTS)
+			return BERYL_ERR("Expected a single SQL statement per step");
+		blame_sql_error(err);
+		return BERYL_ERR("SQL compiler error");
+	}
+	for(i_size i = 0; i < n_params && !err; i++)
+		err = bind_i_val_as_sql_param(stmt, i + 1, &params[i]);
+	if(err) {
+		done_with_stmt(stmt, true);
+		beryl_blame_arg(step);
+		blame_sql_error(err);
+		return BERYL_ERR("SQL parameter error");
+	}
+	
+	int n_columns = sqlite3_column_count(stmt);
+	struct i_val *column_names = beryl_talloc(sizeof(struct i_val) * (n_columns ? n_columns : 1));
+	struct i_val rows = n_columns ? beryl_new_array(0, NULL, 4, false) : BERYL_NULL;
+	bool ok = column_names != NULL && (n_columns == 0 || BERYL_TYPEOF(rows) != TYPE_NULL);
+	int n_names = 0;
+	for(; ok && n_names < n_columns; n_names++) {
+		column_names[n_names] = cstr_to_beryl_str(sqlite3_column_name(stmt, n_names));
+		ok = BERYL_TYPEOF(column_names[n_names]) != TYPE_NULL;
+	}
+	
+	struct i_val res = ok ? BERYL_NULL : BERYL_ERR("Out of memory");
+	while(ok && (err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		struct i_val row = create_table_from_row(stmt, n_columns, column_names);
+		if(BERYL_TYPEOF(row) == TYPE_ERR)
+			res = row;
+		else if(!beryl_array_push(&rows, row))
+			res = BERYL_ERR("Out of memory");
+		ok = BERYL_TYPEOF(res) != TYPE_ERR;
+	}
+	if(ok && err != SQLITE_DONE) {
+		ok = false;
+		if(err == SQLITE_BUSY)
+			res = BERYL_ERR("Database is busy (timeout)");
+		else {
+			beryl_blame_arg(step);
+			blame_sql_error(err);
+			res = BERYL_ERR("SQL error");
+		}
+	}
+	done_with_stmt(stmt, true);
+	
+	for(int i = 0; i < n_names; i++)
+		beryl_release(column_names[i]);
+	if(column_names != NULL)
+		beryl_tfree(column_names);
+	if(!ok) {
+		beryl_release(rows);
+		return res;
+	}
+	return n_columns ? rows : BERYL_NUMBER(sqlite3_changes(db_obj->db));
+}
+
+// sql :pipeline db steps runs an array of [sql, params...] steps in order, all or nothing, and returns an array
+// with the result of each: its rows, or its number of changes if it returns none
+static struct i_val pipeline_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'pipeline'");
+	if(BERYL_TYPEOF(args[1]) != TYPE_ARRAY) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected array of [sql, params...] steps as second argument for 'pipeline'");
+	}
+	note_db_use(db_obj);
+	struct i_val local = check_local_write(db_obj);
+	if(BERYL_TYPEOF(local) == TYPE_ERR)
+		return local;
+	
+	i_size n_steps = BERYL_LENOF(args[1]);
+	const struct i_val *steps = beryl_get_raw_array(args[1]);
+	struct i_val results = beryl_new_array(0, NULL, n_steps, false);
+	if(BERYL_TYPEOF(results) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	// A savepoint rather than BEGIN, so that pipelines also run inside transactions (and group commit batches).
+	// Outside of them it is the one transaction the steps commit in.
+	if(db_obj->batch != NULL)
+		group_commit_hold(db_obj->batch);
+	int err = sqlite3_exec(db_obj->db, "SAVEPOINT beryl_pipeline", NULL, NULL, NULL);
+	if(err) {
+		if(db_obj->batch != NULL)
+			group_commit_unhold(db_obj->batch);
+		beryl_release(results);
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to start pipeline transaction");
+	}
+	
+	struct i_val res = BERYL_NULL;
+	for(i_size i = 0; i < n_steps; i++) {
+		res = run_pipeline_step(db_obj, steps[i]);
+		if(BERYL_TYPEOF(res) == TYPE_ERR)
+			break;
+		if(!beryl_array_push(&results, res)) {
+			beryl_release(res);
+			res = BERYL_ERR("Out of memory");
+			break;
+		}
+	}
+	
+	if(BERYL_TYPEOF(res) == TYPE_ERR)
+		sqlite3_exec(db_obj->db, "ROLLBACK TO beryl_pipeline", NULL, NULL, NULL);
+	err = sqlite3_exec(db_obj->db, "RELEASE beryl_pipeline", NULL, NULL, NULL);
+	if(BERYL_TYPEOF(res) != TYPE_ERR && err) {
+		// A failed commit leaves the transaction open; all or nothing still holds
+		sqlite3_exec(db_obj->db, "ROLLBACK TO beryl_pipeline", NULL, NULL, NULL);
+		sqlite3_exec(db_obj->db, "RELEASE beryl_pipeline", NULL, NULL, NULL);
+		blame_sql_error(err);
+		res = BERYL_ERR(err == SQLITE_BUSY ? "Database is busy (timeout)" : "Unable to commit pipeline");
+	}
+	if(db_obj->batch != NULL)
+		group_commit_unhold(db_obj->batch);
+	if(BERYL_TYPEOF(res) == TYPE_ERR) {
+		beryl_release(results);
+		return res;
+	}
+	return results;
+}
+
+// sql :release-memory db frees the unused page cache and the cached statements of the connection (and its readers),
+// sql :release-memory :all whatever SQLite can free in the whole process; both return the number of bytes freed
+static struct i_val release_memory_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	if(is_option(args[0], "all")) {
+		// Only frees anything if SQLite was built with SQLITE_ENABLE_MEMORY_MANAGEMENT
+		return BERYL_NUMBER(sqlite3_release_memory(INT_MAX));
+	}
+	
+	if(beryl_object_class_type(args[0]) == &beryl_sqldb_object_class) {
+		struct beryl_sqldb_object *db_obj = (struct beryl_sqldb_object *) beryl_as_object(args[0]);
+		if(db_obj->pending != NULL) // Opened with :lazy and not used yet, so holding nothing
+			return BERYL_NUMBER(0);
+	}
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object or :all as argument for 'release-memory'");
+	return BERYL_NUMBER(release_db_memory(db_obj));
+}
+
+// sql :batch db [:size n] [:interval ms] enables (or reconfigures) group commit, sql :batch db :off disables it
+static struct i_val batch_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'batch'");
+	
+	if(n_args == 2 && is_option(args[1], "off")) {
+		int err = end_batching(db_obj);
+		if(err) {
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to commit pending batched writes");
+		}
+		return BERYL_NULL;
+	}
+	
+	int max_writes = db_obj->batch ? db_obj->batch->max_writes : 1000;
+	int64_t interval_ms = db_obj->batch ? db_obj->batch->interval_ms : 100;
+	for(i_size i = 1; i < n_args; i += 2) {
+		if(i + 1 == n_args || BERYL_TYPEOF(args[i + 1]) != TYPE_NUMBER || beryl_as_num(args[i + 1]) < 1 || beryl_as_num(args[i + 1]) > INT_MAX) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected a positive number as option value");
+		}
+		
+		if(is_option(args[i], "size"))
+			max_writes = beryl_as_num(args[i + 1]);
+		else if(is_option(args[i], "interval"))
+			interval_ms = beryl_as_num(args[i + 1]);
+		else {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown option for 'batch'");
+		}
+	}
+	
+	if(db_obj->batch == NULL) {
+		db_obj->batch = malloc(sizeof(struct group_commit));
+		if(db_obj->batch == NULL)
+			return BERYL_ERR("Out of memory");
+		int err = group_commit_init(db_obj->batch, db_obj->db, max_writes, interval_ms);
+		if(err) {
+			free(db_obj->batch);
+			db_obj->batch = NULL;
+			blame_sql_error(err);
+			return BERYL_ERR("Unable to start the group commit timer");
+		}
+	} else
+		group_commit_set_limits(db_obj->batch, max_writes, interval_ms);
+	return BERYL_NULL;
+}
+
+static struct i_val flush_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as argument for 'flush'");
+	if(db_obj->batch == NULL)
+		return BERYL_NUMBER(0);
+	
+	int n_committed;
+	int err = group_commit_flush(db_obj->batch, &n_committed);
+	if(err == SQLITE_ABORT)
+		return BERYL_ERR("Batched writes were lost (rolled back by SQLite)");
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to commit batch");
+	}
+	return BERYL_NUMBER(n_committed);
+}
+
+// sql :writer db hands the connection's writes to the writer thread of its database file, sql :writer db :off stops that
+static struct i_val writer_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'writer'");
+	
+	if(n_args == 2 && is_option(args[1], "off")) {
+		stop_writer(db_obj);
+		return BERYL_NULL;
+	} else if(n_args != 1) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Unknown option for 'writer'");
+	}
+	
+	if(db_obj->writer != NULL)
+		return BERYL_NULL;
+	int err = writer_acquire(&db_obj->writer, db_obj->db, setup_connection, db_obj);
+	if(err == SQLITE_MISUSE)
+		return BERYL_ERR("'writer' requires a database file (not an in-memory database)");
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to start writer thread");
+	}
+	return BERYL_NULL;
+}
+
+struct beryl_sqlcursor_object {
+	struct beryl_object header;
+	struct prefetch_cursor *cur; // NULL once closed
+	struct i_val *column_names;
+	int n_columns;
+};
+
+static void cursor_close(struct beryl_sqlcursor_object *cur_obj) {
+	if(cur_obj->cur != NULL)
+		prefetch_stop(cur_obj->cur);
+	cur_obj->cur = NULL;
+}
+
+static void beryl_sqlcursor_object_free(struct beryl_object *obj) {
+	struct beryl_sqlcursor_object *cur_obj = (struct beryl_sqlcursor_object *) obj;
+	cursor_close(cur_obj);
+	for(int i = 0; cur_obj->column_names != NULL && i < cur_obj->n_columns; i++)
+		beryl_release(cur_obj->column_names[i]);
+	free(cur_obj->column_names);
+}
+
+static struct i_val native_value_to_i_val(const struct native_value *val) {
+	switch(val->type) {
+		case SQLITE_INTEGER:
+		case SQLITE_FLOAT:
+			return BERYL_NUMBER(val->f);
+		case SQLITE_TEXT:
+		case SQLITE_BLOB: {
+			if(val->len > I_SIZE_MAX)
+				return BERYL_ERR("Text/blob too large");
+			struct i_val str = beryl_new_string(val->len, val->data);
+			if(BERYL_TYPEOF(str) == TYPE_NULL)
+				return BERYL_ERR("Out of memory");
+			return str;
+		}
+		default:
+			return BERYL_NULL;
+	}
+}
+
+// The next row as a table, null at the end
+static struct i_val cursor_next(struct beryl_sqlcursor_object *cur_obj) {
+	if(cur_obj->cur == NULL)
+		return BERYL_NULL;
+	
+	const struct native_value *row;
+	int res = prefetch_next(cur_obj->cur, &row);
+	if(res == SQLITE_DONE) {
+		cursor_close(cur_obj);
+		return BERYL_NULL;
+	} else if(res != SQLITE_ROW) {
+		struct i_val msg = cstr_to_beryl_str(prefetch_errmsg(cur_obj->cur));
+		if(BERYL_TYPEOF(msg) != TYPE_NULL) {
+			beryl_blame_arg(msg);
+			beryl_release(msg);
+		}
+		cursor_close(cur_obj);
+		return res == SQLITE_BUSY ? BERYL_ERR("Database is busy (timeout)") : BERYL_ERR("SQL error");
+	}
+	
+	struct i_val table = beryl_new_table(cur_obj->n_columns, true);
+	if(BERYL_TYPEOF(table) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	for(int i = 0; i < cur_obj->n_columns; i++) {
+		struct i_val val = native_value_to_i_val(&row[i]);
+		if(BERYL_TYPEOF(val) == TYPE_ERR) {
+			beryl_release(table);
+			return val;
+		}
+		beryl_table_insert(&table, cur_obj->column_names[i], val, false);
+	}
+	return table;
+}
+
+// Up to n rows as an array, empty at the end
+static struct i_val cursor_next_many(struct beryl_sqlcursor_object *cur_obj, i_size n) {
+	struct i_val rows = beryl_new_array(0, NULL, n, false);
+	if(BERYL_TYPEOF(rows) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	for(i_size i = 0; i < n; i++) {
+		struct i_val row = cursor_next(cur_obj);
+		if(BERYL_TYPEOF(row) == TYPE_NULL)
+			break;
+		if(BERYL_TYPEOF(row) != TYPE_ERR && !beryl_array_push(&rows, row)) {
+			beryl_release(row);
+			row = BERYL_ERR("Out of memory");
+		}
+		if(BERYL_TYPEOF(row) == TYPE_ERR) {
+			beryl_release(rows);
+			return row;
+		}
+	}
+	return rows;
+}
+
+static struct i_val beryl_sqlcursor_object_call(struct beryl_object *obj, const struct i_val *args, i_size n_args) {
+	struct beryl_sqlcursor_object *cur_obj = (struct beryl_sqlcursor_object *) obj;
+	
+	if(is_option(args[0], "next") && n_args == 1)
+		return cursor_next(cur_obj);
+	else if(is_option(args[0], "next") && n_args == 2) {
+		if(BERYL_TYPEOF(args[1]) != TYPE_NUMBER || beryl_as_num(args[1]) < 1 || beryl_as_num(args[1]) > I_SIZE_MAX) {
+			beryl_blame_arg(args[1]);
+			return BERYL_ERR("Expected number of rows (at least 1) after :next");
+		}
+		return cursor_next_many(cur_obj, beryl_as_num(args[1]));
+	} else if(is_option(args[0], "columns") && n_args == 1) {
+		struct i_val names = beryl_new_array(0, NULL, cur_obj->n_columns, false);
+		if(BERYL_TYPEOF(names) == TYPE_NULL)
+			return BERYL_ERR("Out of memory");
+		for(int i = 0; i < cur_obj->n_columns; i++) {
+			if(!beryl_array_push(&names, beryl_retain(cur_obj->column_names[i]))) {
+				beryl_release(cur_obj->column_names[i]);
+				beryl_release(names);
+				return BERYL_ERR("Out of memory");
+			}
+		}
+		return names;
+	} else if(is_option(args[0], "close") && n_args == 1) {
+		cursor_close(cur_obj);
+		return BERYL_NULL;
+	}
+	
+	beryl_blame_arg(args[0]);
+	return BERYL_ERR("Expected :next, :next n, :columns or :close");
+}
+
+struct beryl_object_class beryl_sqlcursor_object_class = {
+	beryl_sqlcursor_object_free,
+	beryl_sqlcursor_object_call,
+	sizeof(struct beryl_sqlcursor_object),
+	"sqlcursor",
+	sizeof("sqlcursor") - 1
+};
+
+// sql :cursor db query [params] [:prefetch n] runs the query on a background thread (with a read-only connection
+// of its own), which steps up to n rows (default 256) ahead of the script
+static struct i_val cursor_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'cursor'");
+	if(BERYL_TYPEOF(args[1]) != TYPE_STR || BERYL_LENOF(args[1]) > INT_MAX) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected SQL query (a string) as second argument for 'cursor'");
+	}
+	
+	const struct i_val *params = NULL;
+	i_size n_params = 0;
+	i_size i = 2;
+	if(i < n_args && BERYL_TYPEOF(args[i]) == TYPE_ARRAY) {
+		params = beryl_get_raw_array(args[i]);
+		n_params = BERYL_LENOF(args[i]);
+		i++;
+	}
+	int capacity = 256;
+	for(; i < n_args; i++) {
+		if(is_option(args[i], "prefetch") && i + 1 < n_args && BERYL_TYPEOF(args[i + 1]) == TYPE_NUMBER
+			&& beryl_as_num(args[i + 1]) >= 1 && beryl_as_num(args[i + 1]) <= 65536) {
+			capacity = beryl_as_num(args[++i]);
+		} else {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown or invalid option for 'cursor'");
+		}
+	}
+	if(n_params > INT_MAX)
+		return BERYL_ERR("Too many parameters");
+	
+	const char *path = sqlite3_db_filename(db_obj->db, "main");
+	if(path == NULL || *path == '\0')
+		return BERYL_ERR("'cursor' requires a database file (not an in-memory database)");
+	note_db_use(db_obj);
+	// Runs on another connection, which only sees batched writes once they are committed
+	struct i_val flushed = commit_batch_first(db_obj);
+	if(BERYL_TYPEOF(flushed) == TYPE_ERR)
+		return flushed;
+	
+	struct native_value *native_params = malloc(sizeof(struct native_value) * (n_params ? n_params : 1));
+	if(native_params == NULL)
+		return BERYL_ERR("Out of memory");
+	i_size n_converted = 0;
+	while(n_converted < n_params && i_val_to_native_value(&params[n_converted], &native_params[n_converted]))
+		n_converted++;
+	if(n_converted != n_params) {
+		for(i_size j = 0; j < n_converted; j++)
+			native_value_free(&native_params[j]);
+		free(native_params);
+		return BERYL_ERR("Out of memory");
+	}
+	
+	sqlite3_vfs *vfs = NULL;
+	sqlite3_file_control(db_obj->db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs);
+	sqlite3 *db;
+	int err = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, vfs ? vfs->zName : NULL);
+	if(!err) {
+		sqlite3_busy_timeout(db, 1000);
+		err = setup_connection(db, db_obj);
+	}
+	
+	struct prefetch_cursor *cur = NULL;
+	if(err) {
+		sqlite3_close(db);
+		for(i_size j = 0; j < n_params; j++)
+			native_value_free(&native_params[j]);
+		free(native_params);
+	} else
+		err = prefetch_start(&cur, db, beryl_get_raw_str(&args[1]), BERYL_LENOF(args[1]), native_params, n_params, capacity);
+	if(err) {
+		blame_sql_error(err);
+		return err == SQLITE_MISUSE ? BERYL_ERR("Expected an SQL statement") : BERYL_ERR("Unable to start cursor");
+	}
+	
+	int n_columns = prefetch_column_count(cur);
+	struct i_val *column_names = calloc(n_columns ? n_columns : 1, sizeof(struct i_val));
+	struct i_val cur_obj = BERYL_NULL;
+	if(column_names != NULL)
+		cur_obj = beryl_new_object(&beryl_sqlcursor_object_class);
+	if(BERYL_TYPEOF(cur_obj) == TYPE_NULL) {
+		free(column_names);
+		prefetch_stop(cur);
+		return BERYL_ERR("Out of memory");
+	}
+	
+	struct beryl_sqlcursor_object *cur_obj_val = (struct beryl_sqlcursor_object *) beryl_as_object(cur_obj);
+	cur_obj_val->cur = cur;
+	cur_obj_val->column_names = column_names;
+	cur_obj_val->n_columns = n_columns;
+	for(int j = 0; j < n_columns; j++) {
+		column_names[j] = cstr_to_beryl_str(prefetch_column_name(cur, j));
+		if(BERYL_TYPEOF(column_names[j]) == TYPE_NULL) {
+			beryl_release(cur_obj); // Frees the names created so far, the rest are null
+			return BERYL_ERR("Out of memory");
+		}
+	}
+	return cur_obj;
+}
+
+static int get_completions(struct beryl_sqldb_object *db_obj) {
+	if(db_obj->completions != NULL)
+		return SQLITE_OK;
+	return completion_queue_create(&db_obj->completions);
+}
+
+// Compiles the statement on the connection (so that errors in the statement itself are reported right away) and
+// copies it and its parameters into a new request with the next id; returns an error value on failure.
+// Writes must not return rows, as the writer thread has nowhere to put them.
+static struct i_val new_async_request(struct beryl_sqldb_object *db_obj, struct i_val sql_val, const struct i_val *params, i_size n_params, bool is_query, struct async_request **out) {
+	*out = NULL;
+	if(n_params > INT_MAX)
+		return BERYL_ERR("Too many parameters");
+	
+	sqlite3_stmt *stmt;
+	int err = prepare_single_statement(&db_obj->stmts, db_obj->db, beryl_get_raw_str(&sql_val), BERYL_LENOF(sql_val), &stmt);
+	if(err == SQLITE_MISUSE)
+		return BERYL_ERR("Expected an SQL statement");
+	if(err == SEVERAL_STATEMENTS) {
+		beryl_blame_arg(sql_val);
+		return BERYL_ERR("Expected a single SQL statement");
+	}
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("SQL compiler error");
+	}
+	if(!is_query && sqlite3_column_count(stmt) != 0)
+		return BERYL_ERR("Statements returning rows (RETURNING) cannot be run by the writer thread");
+	
+	err = get_completions(db_obj);
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to create completion descriptor");
+	}
+	
+	struct async_request *ar = calloc(1, sizeof(struct async_request));
+	if(ar == NULL)
+		return BERYL_ERR("Out of memory");
+	const char *sql = sqlite3_sql(stmt);
+	size_t sql_len = strlen(sql);
+	ar->sql = malloc(sql_len + 1);
+	ar->params = malloc(sizeof(struct native_value) * (n_params ? n_params : 1));
+	bool ok = ar->sql != NULL && ar->params != NULL;
+	for(i_size i = 0; ok && i < n_params; i++) {
+		ok = i_val_to_native_value(&params[i], &ar->params[i]);
+		if(ok)
+			ar->n_params++;
+	}
+	if(!ok) {
+		async_request_free(ar);
+		return BERYL_ERR("Out of memory");
+	}
+	memcpy(ar->sql, sql, sql_len + 1);
+	ar->is_query = is_query;
+	ar->id = db_obj->next_request_id++;
+	*out = ar;
+	return BERYL_NULL;
+}
+
+// sql :submit db statement params... queues a write to the writer thread without waiting for it and returns its id.
+// Its result is collected with 'completions' once the descriptor from 'completion-fd' is readable.
+static struct i_val submit_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'submit'");
+	if(BERYL_TYPEOF(args[1]) != TYPE_STR) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected SQL statement (a string) as second argument for 'submit'");
+	}
+	if(db_obj->writer == NULL)
+		return BERYL_ERR("'submit' requires writer mode (see 'writer')");
+	note_db_use(db_obj);
+	// Runs on another connection, which only sees batched writes once they are committed
+	struct i_val flushed = commit_batch_first(db_obj);
+	if(BERYL_TYPEOF(flushed) == TYPE_ERR)
+		return flushed;
+	
+	struct async_request *ar;
+	struct i_val err = new_async_request(db_obj, args[1], &args[2], n_args - 2, false, &ar);
+	if(ar == NULL)
+		return err;
+	
+	struct write_request *req = &ar->req.write;
+	req->sql = ar->sql;
+	req->sql_len = strlen(ar->sql);
+	req->params = ar->params;
+	req->n_params = ar->n_params;
+	req->notify = db_obj->completions;
+	completion_queue_expect(db_obj->completions);
+	writer_submit(db_obj->writer, req);
+	return BERYL_NUMBER(ar->id);
+}
+
+// sql :completion-fd db gives a descriptor that becomes readable when submitted writes have finished
+static struct i_val completion_fd_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as argument for 'completion-fd'");
+	
+	int err = get_completions(db_obj);
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to create completion descriptor");
+	}
+	return BERYL_NUMBER(completion_queue_fd(db_obj->completions));
+}
+
+static struct i_val query_rows_to_array(const struct query_request *req) {
+	if(req->n_rows > I_SIZE_MAX)
+		return BERYL_ERR("Too many rows");
+	
+	struct i_val *names = calloc(req->n_columns ? req->n_columns : 1, sizeof(struct i_val));
+	struct i_val rows = names ? beryl_new_array(0, NULL, req->n_rows, false) : BERYL_NULL;
+	bool ok = BERYL_TYPEOF(rows) != TYPE_NULL;
+	for(int i = 0; ok && i < req->n_columns; i++) {
+		names[i] = cstr_to_beryl_str(req->column_names[i]);
+		ok = BERYL_TYPEOF(names[i]) != TYPE_NULL;
+	}
+	
+	struct i_val err = BERYL_ERR("Out of memory");
+	for(size_t r = 0; ok && r < req->n_rows; r++) {
+		struct i_val row = beryl_new_table(req->n_columns, true);
+		if(BERYL_TYPEOF(row) == TYPE_NULL)
+			row = BERYL_ERR("Out of memory");
+		for(int i = 0; BERYL_TYPEOF(row) == TYPE_TABLE && i < req->n_columns; i++) {
+			struct i_val val = native_value_to_i_val(&req->values[r * req->n_columns + i]);
+			if(BERYL_TYPEOF(val) == TYPE_ERR) {
+				beryl_release(row);
+				row = val;
+			} else
+				beryl_table_insert(&row, names[i], val, false);
+		}
+		if(BERYL_TYPEOF(row) == TYPE_TABLE && !beryl_array_push(&rows, row)) {
+			beryl_release(row);
+			row = BERYL_ERR("Out of memory");
+		}
+		if(BERYL_TYPEOF(row) == TYPE_ERR) {
+			err = row;
+			ok = false;
+		}
+	}
+	
+	if(!ok && BERYL_TYPEOF(rows) != TYPE_NULL)
+		beryl_release(rows);
+	for(int i = 0; names != NULL && i < req->n_columns; i++)
+		beryl_release(names[i]);
+	free(names);
+	return ok ? rows : err;
+}
+
+static struct i_val completion_to_table(const struct async_request *ar) {
+	struct i_val table = beryl_new_table(4, true);
+	if(BERYL_TYPEOF(table) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	int err = ar->is_query ? ar->req.query.err : ar->req.write.err;
+	const char *err_msg = ar->is_query ? ar->req.query.err_msg : ar->req.write.err_msg;
+	beryl_table_insert(&table, BERYL_CONST_STR("id"), BERYL_NUMBER(ar->id), false);
+	if(err) {
+		struct i_val msg = cstr_to_beryl_str(err_msg);
+		if(BERYL_TYPEOF(msg) == TYPE_NULL) {
+			beryl_release(table);
+			return BERYL_ERR("Out of memory");
+		}
+		beryl_table_insert(&table, BERYL_CONST_STR("error"), msg, false);
+		return table;
+	}
+	
+	if(ar->is_query) {
+		struct i_val rows = query_rows_to_array(&ar->req.query);
+		if(BERYL_TYPEOF(rows) == TYPE_ERR) {
+			beryl_release(table);
+			return rows;
+		}
+		beryl_table_insert(&table, BERYL_CONST_STR("rows"), rows, false);
+	}
+	sqlite3_int64 changes = ar->is_query ? ar->req.query.changes : ar->req.write.changes;
+	sqlite3_int64 rowid = ar->is_query ? ar->req.query.last_insert_rowid : ar->req.write.last_insert_rowid;
+	beryl_table_insert(&table, BERYL_CONST_STR("changes"), BERYL_NUMBER(changes), false);
+	beryl_table_insert(&table, BERYL_CONST_STR("rowid"), BERYL_NUMBER(rowid), false);
+	return table;
+}
+
+// sql :completions db returns the requests that have finished since the last call, without blocking: an array of
+// tables holding the id and either the changes, rowid (and for queries, rows) or the error message
+static struct i_val completions_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as argument for 'completions'");
+	
+	struct i_val res = beryl_new_array(0, NULL, 8, false);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	if(db_obj->completions == NULL)
+		return res;
+	
+	// Everything taken is freed; what cannot be converted is reported as an error after the rest
+	struct writer_node *node = completion_queue_take(db_obj->completions);
+	struct i_val err = BERYL_NULL;
+	while(node != NULL) {
+		struct writer_node *next = node->next;
+		struct async_request *ar = (struct async_request *) node;
+		struct i_val table = BERYL_TYPEOF(err) == TYPE_NULL ? completion_to_table(ar) : BERYL_NULL;
+		if(BERYL_TYPEOF(table) == TYPE_TABLE && !beryl_array_push(&res, table)) {
+			beryl_release(table);
+			table = BERYL_ERR("Out of memory");
+		}
+		if(BERYL_TYPEOF(table) == TYPE_ERR)
+			err = table;
+		async_request_free(ar);
+		node = next;
+	}
+	
+	if(BERYL_TYPEOF(err) == TYPE_ERR) {
+		beryl_release(res);
+		return err;
+	}
+	return res;
+}
+
+// sql :executor db [:threads n] [:interactive n] [:batch n] [:maintenance n] starts a pool of threads that run queries
+// submitted with 'query' by priority; the class options limit how many queries of the class may be queued.
+// sql :executor db :off stops it.
+static struct i_val executor_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'executor'");
+	
+	if(n_args == 2 && is_option(args[1], "off")) {
+		stop_executor(db_obj);
+		return BERYL_NULL;
+	}
+	
+	struct executor_options options = { 4, { 1024, 256, 64 }, { 0 }, 0 };
+	for(i_size i = 1; i < n_args; i++) {
+		if(i + 1 == n_args || BERYL_TYPEOF(args[i + 1]) != TYPE_NUMBER || beryl_as_num(args[i + 1]) < 1 || beryl_as_num(args[i + 1]) > 1000000) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown or invalid option for 'executor'");
+		}
+		int n = beryl_as_num(args[i + 1]);
+		if(is_option(args[i], "threads") && n >= 2 && n <= 64)
+			options.n_threads = n;
+		else if(is_option(args[i], "interactive"))
+			options.queue_limits[EXECUTOR_INTERACTIVE] = n;
+		else if(is_option(args[i], "batch"))
+			options.queue_limits[EXECUTOR_BATCH] = n;
+		else if(is_option(args[i], "maintenance"))
+			options.queue_limits[EXECUTOR_MAINTENANCE] = n;
+		else {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Unknown or invalid option for 'executor'");
+		}
+		i++;
+	}
+	// One thread is kept free of batch and maintenance work (hence at least two threads) and only one runs maintenance,
+	// so interactive queries always find a thread
+	options.max_running[EXECUTOR_INTERACTIVE] = options.n_threads;
+	options.max_running[EXECUTOR_BATCH] = options.n_threads - 1;
+	options.max_running[EXECUTOR_MAINTENANCE] = 1;
+	options.max_background = options.n_threads - 1;
+	
+	if(db_obj->executor != NULL)
+		return BERYL_ERR("The executor is already running (stop it with :off first)");
+	int err = executor_start(&db_obj->executor, db_obj->db, &options, setup_connection, db_obj);
+	if(err == SQLITE_MISUSE)
+		return BERYL_ERR("'executor' requires a database file (not an in-memory database)");
+	if(err) {
+		blame_sql_error(err);
+		return BERYL_ERR("Unable to start executor");
+	}
+	return BERYL_NULL;
+}
+
+// sql :query db :interactive|:batch|:maintenance statement params... queues a statement to the executor and returns
+// its id, or fails if the queue of that class is full. Results are collected with 'completions'.
+static struct i_val query_callback(const struct i_val *args, i_size n_args) {
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as first argument for 'query'");
+	
+	enum executor_class priority;
+	if(is_option(args[1], "interactive"))
+		priority = EXECUTOR_INTERACTIVE;
+	else if(is_option(args[1], "batch"))
+		priority = EXECUTOR_BATCH;
+	else if(is_option(args[1], "maintenance"))
+		priority = EXECUTOR_MAINTENANCE;
+	else {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected :interactive, :batch or :maintenance as second argument for 'query'");
+	}
+	if(BERYL_TYPEOF(args[2]) != TYPE_STR) {
+		beryl_blame_arg(args[2]);
+		return BERYL_ERR("Expected SQL statement (a string) as third argument for 'query'");
+	}
+	if(db_obj->executor == NULL)
+		return BERYL_ERR("'query' requires a running executor (see 'executor')");
+	note_db_use(db_obj);
+	// Runs on another connection, which only sees batched writes once they are committed
+	struct i_val flushed = commit_batch_first(db_obj);
+	if(BERYL_TYPEOF(flushed) == TYPE_ERR)
+		return flushed;
+	
+	struct async_request *ar;
+	struct i_val err = new_async_request(db_obj, args[2], &args[3], n_args - 3, true, &ar);
+	if(ar == NULL)
+		return err;
+	
+	struct query_request *req = &ar->req.query;
+	req->sql = ar->sql;
+	req->sql_len = strlen(ar->sql);
+	req->params = ar->params;
+	req->n_params = ar->n_params;
+	req->priority = priority;
+	req->notify = db_obj->completions;
+	completion_queue_expect(db_obj->completions);
+	if(executor_submit(db_obj->executor, req) == SQLITE_FULL) {
+		completion_queue_unexpect(db_obj->completions);
+		async_request_free(ar);
+		return BERYL_ERR("Query rejected (queue full)");
+	}
+	return BERYL_NUMBER(ar->id);
+}
+
+// sql :warm-status db tells how far the warm-up started with :warm has come: {state: "running"|"done"|"failed"|"off", bytes: n}
+static struct i_val warm_status_callback(const struct i_val *args, i_size n_args) {
+	(void) n_args;
+	struct beryl_sqldb_object *db_obj = get_db_arg(args[0]);
+	if(db_obj == NULL)
+		return BERYL_ERR("Expected open database object as argument for 'warm-status'");
+	
+	uint64_t bytes_read = 0;
+	struct i_val state = BERYL_CONST_STR("off");
+	if(db_obj->warmer != NULL) {
+		switch(warmer_state(db_obj->warmer, &bytes_read)) {
+			case WARMER_RUNNING:
+				state = BERYL_CONST_STR("running");
+				break;
+			case WARMER_DONE:
+				state = BERYL_CONST_STR("done");
+				break;
+			case WARMER_FAILED:
+				state = BERYL_CONST_STR("failed");
+				break;
+		}
+	}
+	
+	struct i_val table = beryl_new_table(2, true);
+	if(BERYL_TYPEOF(table) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	beryl_table_insert(&table, BERYL_CONST_STR("state"), state, false);
+	beryl_table_insert(&table, BERYL_CONST_STR("bytes"), BERYL_NUMBER(bytes_read), false);
+	return table;
+}
+
 static bool loaded = false;
 
 static struct i_val lib_val;
@@ -318,10 +4113,35 @@ static struct i_val lib_val;
 
 static void init_lib() {
 	#define FN(name, arity, fn) { arity, false, name, sizeof(name) - 1, fn }
+	// A negative arity -n means "at least n - 1 arguments"
 	static struct beryl_external_fn fns[] = {
-		FN("open", 1, open_callback),
+		FN("open", -2, open_callback),
 		FN("close", 1, close_callback),
-		FN("get-last-insert-rowid", 1, get_last_insert_rowid_callback)
+		FN("get-last-insert-rowid", 1, get_last_insert_rowid_callback),
+		FN("blob-to-numbers", 2, blob_to_numbers_callback),
+		FN("numbers-to-blob", 2, numbers_to_blob_callback),
+		FN("diff", 4, diff_callback),
+		FN("chunked", -3, chunked_callback),
+		FN("partitions", -5, partitions_callback),
+		FN("ttl", -4, ttl_callback),
+		FN("kv", -3, kv_callback),
+		FN("queue", 2, queue_callback),
+		FN("materialize", -4, materialize_callback),
+		FN("load-result", 1, load_result_callback),
+		FN("bulk-load", -4, bulk_load_callback),
+		FN("insert", -4, insert_callback),
+		FN("pipeline", 2, pipeline_callback),
+		FN("batch", -2, batch_callback),
+		FN("flush", 1, flush_callback),
+		FN("writer", -2, writer_callback),
+		FN("cursor", -3, cursor_callback),
+		FN("submit", -3, submit_callback),
+		FN("completion-fd", 1, completion_fd_callback),
+		FN("completions", 1, completions_callback),
+		FN("executor", -2, executor_callback),
+		FN("query", -4, query_callback),
+		FN("warm-status", 1, warm_status_callback),
+		FN("release-memory", 1, release_memory_callback)
 		//FN("format", 1, format_callback)
 	};
 	
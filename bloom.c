@@ -0,0 +1,49 @@
+#include "bloom.h"
+
+#include <stdlib.h>
+
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_PROBES 7
+#define BLOOM_MIN_KEYS 1024
+
+bool bloom_init(struct bloom *bloom, uint64_t expected_keys) {
+	if(expected_keys < BLOOM_MIN_KEYS)
+		expected_keys = BLOOM_MIN_KEYS;
+	expected_keys *= 2; // Leaves room for keys added before the next rebuild
+
+	bloom->n_bits = (expected_keys * BLOOM_BITS_PER_KEY + 63) / 64 * 64;
+	bloom->bits = calloc(bloom->n_bits / 64, sizeof(uint64_t));
+	bloom->n_probes = BLOOM_PROBES;
+	bloom->n_added = 0;
+	bloom->capacity = expected_keys;
+	return bloom->bits != NULL;
+}
+
+void bloom_free(struct bloom *bloom) {
+	free(bloom->bits);
+	bloom->bits = NULL;
+}
+
+// Kirsch-Mitzenmacher: probe i is h1 + i * h2
+void bloom_add(struct bloom *bloom, uint64_t hash) {
+	uint64_t h1 = hash & 0xFFFFFFFF, h2 = (hash >> 32) | 1;
+	for(int i = 0; i < bloom->n_probes; i++) {
+		uint64_t bit = (h1 + i * h2) % bloom->n_bits;
+		bloom->bits[bit / 64] |= (uint64_t) 1 << (bit % 64);
+	}
+	bloom->n_added++;
+}
+
+bool bloom_may_contain(const struct bloom *bloom, uint64_t hash) {
+	uint64_t h1 = hash & 0xFFFFFFFF, h2 = (hash >> 32) | 1;
+	for(int i = 0; i < bloom->n_probes; i++) {
+		uint64_t bit = (h1 + i * h2) % bloom->n_bits;
+		if(!(bloom->bits[bit / 64] & ((uint64_t) 1 << (bit % 64))))
+			return false;
+	}
+	return true;
+}
+
+bool bloom_is_saturated(const struct bloom *bloom) {
+	return bloom->n_added > bloom->capacity;
+}
@@ -0,0 +1,25 @@
+#ifndef BLOOM_H_INCLUDED
+#define BLOOM_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A fixed-size Bloom filter over 64-bit hashes (k probes derived by double hashing)
+struct bloom {
+	uint64_t *bits;
+	uint64_t n_bits;
+	int n_probes;
+	uint64_t n_added, capacity;
+};
+
+// Sized for the expected number of keys at ~1% false positives; returns false if out of memory
+bool bloom_init(struct bloom *bloom, uint64_t expected_keys);
+void bloom_free(struct bloom *bloom);
+
+void bloom_add(struct bloom *bloom, uint64_t hash);
+bool bloom_may_contain(const struct bloom *bloom, uint64_t hash);
+
+// True once more keys have been added than the filter was sized for
+bool bloom_is_saturated(const struct bloom *bloom);
+
+#endif
@@ -0,0 +1,192 @@
+#include "bulk_load.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int exec_printf(sqlite3 *db, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	char *sql = sqlite3_vmprintf(fmt, args);
+	va_end(args);
+	if(sql == NULL)
+		return SQLITE_NOMEM;
+
+	int err = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+	return err;
+}
+
+// Runs a PRAGMA query and copies the first column of its row (free with sqlite3_free)
+static int query_pragma(sqlite3 *db, const char *sql, char **out) {
+	*out = NULL;
+	sqlite3_stmt *stmt;
+	int err = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	if(err)
+		return err;
+	err = sqlite3_step(stmt);
+	if(err == SQLITE_ROW) {
+		*out = sqlite3_mprintf("%s", (const char *) sqlite3_column_text(stmt, 0));
+		err = *out ? SQLITE_OK : SQLITE_NOMEM;
+	}
+	sqlite3_finalize(stmt);
+	return err == SQLITE_DONE ? SQLITE_ERROR : err;
+}
+
+static void restore_settings(struct bulk_load *bl) {
+	if(bl->journal_mode != NULL)
+		exec_printf(bl->db, "PRAGMA main.journal_mode = %s", bl->journal_mode);
+	exec_printf(bl->db, "PRAGMA main.synchronous = %d", bl->synchronous);
+}
+
+static void free_state(struct bulk_load *bl) {
+	for(int i = 0; i < bl->n_indexes; i++)
+		sqlite3_free(bl->index_sql[i]);
+	sqlite3_free(bl->index_sql);
+	sqlite3_free(bl->journal_mode);
+	memset(bl, 0, sizeof(struct bulk_load));
+}
+
+// Saves the CREATE statements of the table's explicit indexes (not those backing UNIQUE or PRIMARY KEY constraints)
+// and drops them
+static int drop_indexes(struct bulk_load *bl, const char *table) {
+	sqlite3_stmt *stmt;
+	int err = sqlite3_prepare_v2(bl->db, "SELECT name, sql FROM main.sqlite_master WHERE type = 'index' AND tbl_name = ?1 AND sql IS NOT NULL", -1, &stmt, NULL);
+	if(err)
+		return err;
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+
+	char **names = NULL;
+	int cap = 0;
+	while( (err = sqlite3_step(stmt)) == SQLITE_ROW ) {
+		if(bl->n_indexes == cap) {
+			cap = cap ? cap * 2 : 4;
+			char **new_sql = sqlite3_realloc64(bl->index_sql, sizeof(char *) * cap);
+			char **new_names = sqlite3_realloc64(names, sizeof(char *) * cap);
+			if(new_sql != NULL)
+				bl->index_sql = new_sql;
+			if(new_names != NULL)
+				names = new_names;
+			if(new_sql == NULL || new_names == NULL) {
+				err = SQLITE_NOMEM;
+				break;
+			}
+		}
+		names[bl->n_indexes] = sqlite3_mprintf("%s", (const char *) sqlite3_column_text(stmt, 0));
+		bl->index_sql[bl->n_indexes] = sqlite3_mprintf("%s", (const char *) sqlite3_column_text(stmt, 1));
+		bl->n_indexes++;
+		if(names[bl->n_indexes - 1] == NULL || bl->index_sql[bl->n_indexes - 1] == NULL) {
+			err = SQLITE_NOMEM;
+			break;
+		}
+	}
+	sqlite3_finalize(stmt);
+	if(err == SQLITE_DONE)
+		err = SQLITE_OK;
+
+	for(int i = 0; i < bl->n_indexes && err == SQLITE_OK; i++)
+		err = exec_printf(bl->db, "DROP INDEX main.\"%w\"", names[i]);
+
+	for(int i = 0; i < bl->n_indexes; i++)
+		sqlite3_free(names[i]);
+	sqlite3_free(names);
+	return err;
+}
+
+int bulk_load_begin(struct bulk_load *bl, sqlite3 *db, const char *table, bool drop) {
+	memset(bl, 0, sizeof(struct bulk_load));
+	bl->db = db;
+	if(!sqlite3_get_autocommit(db))
+		return SQLITE_MISUSE;
+
+	char *synchronous;
+	int err = query_pragma(db, "PRAGMA main.synchronous", &synchronous);
+	if(err)
+		return err;
+	bl->synchronous = atoi(synchronous);
+	sqlite3_free(synchronous);
+
+	// Leaving WAL mode needs exclusive access, which fails while any other connection is open, so WAL databases
+	// keep their journal mode; in WAL mode, synchronous=OFF already saves most of the syncing
+	err = query_pragma(db, "PRAGMA main.journal_mode", &bl->journal_mode);
+	if(!err && sqlite3_stricmp(bl->journal_mode, "wal") == 0) {
+		sqlite3_free(bl->journal_mode);
+		bl->journal_mode = NULL;
+	}
+	if(!err)
+		err = sqlite3_exec(db, "PRAGMA main.synchronous = OFF", NULL, NULL, NULL);
+	if(!err && bl->journal_mode != NULL)
+		err = sqlite3_exec(db, "PRAGMA main.journal_mode = MEMORY", NULL, NULL, NULL);
+	if(!err)
+		err = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+	if(err) {
+		restore_settings(bl);
+		free_state(bl);
+		return err;
+	}
+
+	if(drop)
+		err = drop_indexes(bl, table);
+	if(err)
+		bulk_load_end(bl, false);
+	return err;
+}
+
+int bulk_load_end(struct bulk_load *bl, bool commit) {
+	int err = SQLITE_OK;
+	for(int i = 0; i < bl->n_indexes && commit && err == SQLITE_OK; i++)
+		err = sqlite3_exec(bl->db, bl->index_sql[i], NULL, NULL, NULL);
+	if(commit && err == SQLITE_OK)
+		err = sqlite3_exec(bl->db, "COMMIT", NULL, NULL, NULL);
+	if(!commit || err != SQLITE_OK)
+		sqlite3_exec(bl->db, "ROLLBACK", NULL, NULL, NULL);
+
+	restore_settings(bl);
+	free_state(bl);
+	return err;
+}
+
+int bulk_load_primary_key(sqlite3 *db, const char *table, char ***names, int *n_names) {
+	*names = NULL;
+	*n_names = 0;
+
+	sqlite3_stmt *stmt;
+	int err = sqlite3_prepare_v2(db, "SELECT name FROM pragma_table_info(?1) WHERE pk > 0 ORDER BY pk", -1, &stmt, NULL);
+	if(err)
+		return err;
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+
+	int cap = 0;
+	while( (err = sqlite3_step(stmt)) == SQLITE_ROW ) {
+		if(*n_names == cap) {
+			cap = cap ? cap * 2 : 4;
+			char **new_names = sqlite3_realloc64(*names, sizeof(char *) * cap);
+			if(new_names == NULL) {
+				err = SQLITE_NOMEM;
+				break;
+			}
+			*names = new_names;
+		}
+		char *name = sqlite3_mprintf("%s", (const char *) sqlite3_column_text(stmt, 0));
+		if(name == NULL) {
+			err = SQLITE_NOMEM;
+			break;
+		}
+		(*names)[(*n_names)++] = name;
+	}
+	sqlite3_finalize(stmt);
+
+	if(err != SQLITE_DONE) {
+		bulk_load_free_names(*names, *n_names);
+		*names = NULL;
+		*n_names = 0;
+		return err;
+	}
+	return SQLITE_OK;
+}
+
+void bulk_load_free_names(char **names, int n_names) {
+	for(int i = 0; i < n_names; i++)
+		sqlite3_free(names[i]);
+	sqlite3_free(names);
+}
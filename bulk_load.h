@@ -0,0 +1,33 @@
+#ifndef BULK_LOAD_H_INCLUDED
+#define BULK_LOAD_H_INCLUDED
+
+#include <sqlite3.h>
+
+#include <stdbool.h>
+
+// Connection settings and schema changes around a bulk load into one table:
+// synchronous=OFF and (unless the database is in WAL mode) journal_mode=MEMORY for the duration, one
+// transaction for the whole load and (optionally) the table's secondary indexes dropped before and rebuilt
+// after, which is much faster than updating them row by row. The indexes are dropped and rebuilt inside the load's transaction,
+// so a failed load leaves them (and the table) as they were.
+struct bulk_load {
+	sqlite3 *db;
+	char **index_sql;
+	int n_indexes;
+	int synchronous;
+	char *journal_mode;
+};
+
+// Must be called outside of a transaction (the journal mode cannot be changed within one)
+int bulk_load_begin(struct bulk_load *bl, sqlite3 *db, const char *table, bool drop_indexes);
+
+// Rebuilds the indexes and commits, or rolls back if commit is false or that fails.
+// The previous settings are restored either way.
+int bulk_load_end(struct bulk_load *bl, bool commit);
+
+// The table's primary key columns in key order; free with bulk_load_free_names.
+// Tables without a declared primary key give no columns.
+int bulk_load_primary_key(sqlite3 *db, const char *table, char ***names, int *n_names);
+void bulk_load_free_names(char **names, int n_names);
+
+#endif
@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "completion.h"
+
+#include <sqlite3.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+struct completion_queue {
+	int fd;
+	pthread_mutex_t mutex; // Protects everything below
+	pthread_cond_t idle;
+	struct writer_node *head, *tail;
+	uint64_t expected, finished;
+};
+
+int completion_queue_create(struct completion_queue **out) {
+	*out = NULL;
+	struct completion_queue *q = calloc(1, sizeof(struct completion_queue));
+	if(q == NULL)
+		return SQLITE_NOMEM;
+	q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(q->fd < 0) {
+		free(q);
+		return SQLITE_CANTOPEN;
+	}
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->idle, NULL);
+	*out = q;
+	return SQLITE_OK;
+}
+
+void completion_queue_free(struct completion_queue *q) {
+	pthread_cond_destroy(&q->idle);
+	pthread_mutex_destroy(&q->mutex);
+	close(q->fd);
+	free(q);
+}
+
+int completion_queue_fd(const struct completion_queue *q) {
+	return q->fd;
+}
+
+void completion_queue_expect(struct completion_queue *q) {
+	pthread_mutex_lock(&q->mutex);
+	q->expected++;
+	pthread_mutex_unlock(&q->mutex);
+}
+
+void completion_queue_unexpect(struct completion_queue *q) {
+	pthread_mutex_lock(&q->mutex);
+	if(--q->expected == q->finished)
+		pthread_cond_broadcast(&q->idle);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+void completion_queue_push(struct completion_queue *q, struct writer_node *node) {
+	node->next = NULL;
+	pthread_mutex_lock(&q->mutex);
+	if(q->tail != NULL)
+		q->tail->next = node;
+	else
+		q->head = node;
+	q->tail = node;
+	if(++q->finished == q->expected)
+		pthread_cond_broadcast(&q->idle);
+
+	// Written while holding the mutex, so that a take that finds the list empty also finds the counter cleared
+	uint64_t one = 1;
+	ssize_t res = write(q->fd, &one, sizeof(one)); // Can only fail if the counter would overflow, which leaves it readable anyway
+	(void) res;
+	pthread_mutex_unlock(&q->mutex);
+}
+
+struct writer_node *completion_queue_take(struct completion_queue *q) {
+	pthread_mutex_lock(&q->mutex);
+	struct writer_node *head = q->head;
+	q->head = NULL;
+	q->tail = NULL;
+	uint64_t count;
+	ssize_t res = read(q->fd, &count, sizeof(count)); // EAGAIN when nothing finished since the last take
+	(void) res;
+	pthread_mutex_unlock(&q->mutex);
+	return head;
+}
+
+void completion_queue_wait_idle(struct completion_queue *q) {
+	pthread_mutex_lock(&q->mutex);
+	while(q->finished != q->expected)
+		pthread_cond_wait(&q->idle, &q->mutex);
+	pthread_mutex_unlock(&q->mutex);
+}
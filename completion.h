@@ -0,0 +1,29 @@
+#ifndef COMPLETION_H_INCLUDED
+#define COMPLETION_H_INCLUDED
+
+#include "writer.h" // struct writer_node
+
+// Where worker threads put finished asynchronous requests for their owner to collect.
+// The queue's eventfd becomes readable whenever something has finished, so an event loop can
+// poll it alongside its other descriptors instead of blocking on a call. Linux only.
+struct completion_queue;
+
+int completion_queue_create(struct completion_queue **out);
+void completion_queue_free(struct completion_queue *q); // Must be idle (see completion_queue_wait_idle)
+
+int completion_queue_fd(const struct completion_queue *q);
+
+// Counts a request that is about to be submitted, before the worker can finish it
+void completion_queue_expect(struct completion_queue *q);
+void completion_queue_unexpect(struct completion_queue *q); // For a request that could not be submitted after all
+
+// Called by worker threads; the node must not be touched by the worker afterwards
+void completion_queue_push(struct completion_queue *q, struct writer_node *node);
+
+// Takes everything that has finished (in order of completion, linked through next) and clears the eventfd
+struct writer_node *completion_queue_take(struct completion_queue *q);
+
+// Waits until every expected request has been pushed
+void completion_queue_wait_idle(struct completion_queue *q);
+
+#endif
@@ -0,0 +1,278 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "executor.h"
+#include "stmt_cache.h"
+#include "completion.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EXECUTOR_BUSY_TIMEOUT_MS 5000
+
+struct request_queue {
+	struct writer_node *head, *tail;
+	int length;
+};
+
+struct executor_thread {
+	struct executor *ex;
+	pthread_t thread;
+	sqlite3 *db;
+	struct stmt_cache stmts;
+};
+
+struct executor {
+	pthread_mutex_t mutex; // Protects the queues, running and stop
+	pthread_cond_t cond;
+	struct request_queue queues[EXECUTOR_N_CLASSES];
+	int running[EXECUTOR_N_CLASSES];
+	bool stop;
+
+	struct executor_options options;
+	struct executor_thread *threads;
+	int n_started;
+};
+
+void query_request_free_results(struct query_request *req) {
+	for(int i = 0; req->column_names != NULL && i < req->n_columns; i++)
+		sqlite3_free(req->column_names[i]);
+	free(req->column_names);
+	for(size_t i = 0; req->values != NULL && i < req->n_rows * req->n_columns; i++)
+		native_value_free(&req->values[i]);
+	free(req->values);
+	req->column_names = NULL;
+	req->values = NULL;
+	req->n_rows = 0;
+}
+
+static void queue_push(struct request_queue *q, struct writer_node *node) {
+	node->next = NULL;
+	if(q->tail != NULL)
+		q->tail->next = node;
+	else
+		q->head = node;
+	q->tail = node;
+	q->length++;
+}
+
+static struct writer_node *queue_pop(struct request_queue *q) {
+	struct writer_node *node = q->head;
+	if(node == NULL)
+		return NULL;
+	q->head = node->next;
+	if(q->head == NULL)
+		q->tail = NULL;
+	q->length--;
+	return node;
+}
+
+// The first request of the highest class with work and a thread to spare, if any
+static struct query_request *pick_request(struct executor *ex) {
+	int background = ex->running[EXECUTOR_BATCH] + ex->running[EXECUTOR_MAINTENANCE];
+	for(int c = 0; c < EXECUTOR_N_CLASSES; c++) {
+		if(c != EXECUTOR_INTERACTIVE && background >= ex->options.max_background)
+			break;
+		if(ex->queues[c].head != NULL && ex->running[c] < ex->options.max_running[c])
+			return (struct query_request *) queue_pop(&ex->queues[c]);
+	}
+	return NULL;
+}
+
+static int collect_row(struct query_request *req, sqlite3_stmt *stmt, size_t *cap) {
+	if(req->n_rows == *cap) {
+		size_t new_cap = *cap ? *cap * 2 : 16;
+		struct native_value *new_values = realloc(req->values, sizeof(struct native_value) * new_cap * req->n_columns);
+		if(new_values == NULL)
+			return SQLITE_NOMEM;
+		req->values = new_values;
+		*cap = new_cap;
+	}
+	struct native_value *row = &req->values[req->n_rows * req->n_columns];
+	for(int i = 0; i < req->n_columns; i++) {
+		if(!native_value_from_column(stmt, i, &row[i])) {
+			for(int j = 0; j < i; j++)
+				native_value_free(&row[j]);
+			return SQLITE_NOMEM;
+		}
+	}
+	req->n_rows++;
+	return SQLITE_OK;
+}
+
+static void run_query(struct executor_thread *t, struct query_request *req) {
+	sqlite3_stmt *stmt = NULL;
+	int err = stmt_cache_get(&t->stmts, t->db, req->sql, req->sql_len, &stmt);
+	for(int i = 0; i < req->n_params && !err; i++)
+		err = native_value_bind(stmt, i + 1, &req->params[i]);
+
+	if(!err) {
+		req->n_columns = sqlite3_column_count(stmt);
+		if(req->n_columns != 0) {
+			req->column_names = calloc(req->n_columns, sizeof(char *));
+			err = req->column_names ? SQLITE_OK : SQLITE_NOMEM;
+		}
+		for(int i = 0; i < req->n_columns && !err; i++) {
+			req->column_names[i] = sqlite3_mprintf("%s", sqlite3_column_name(stmt, i));
+			err = req->column_names[i] ? SQLITE_OK : SQLITE_NOMEM;
+		}
+	}
+
+	size_t cap = 0;
+	if(!err) {
+		while( (err = sqlite3_step(stmt)) == SQLITE_ROW ) {
+			if(req->n_columns != 0 && (err = collect_row(req, stmt, &cap)) != SQLITE_OK)
+				break;
+		}
+		if(err == SQLITE_DONE)
+			err = SQLITE_OK;
+	}
+
+	req->err = err;
+	if(err) {
+		snprintf(req->err_msg, sizeof(req->err_msg), "%s", err == sqlite3_errcode(t->db) ? sqlite3_errmsg(t->db) : sqlite3_errstr(err));
+		query_request_free_results(req);
+	} else {
+		req->changes = sqlite3_changes64(t->db);
+		req->last_insert_rowid = sqlite3_last_insert_rowid(t->db);
+	}
+	if(stmt != NULL)
+		sqlite3_reset(stmt);
+}
+
+static void *executor_main(void *arg) {
+	struct executor_thread *t = arg;
+	struct executor *ex = t->ex;
+
+	pthread_mutex_lock(&ex->mutex);
+	for(;;) {
+		struct query_request *req;
+		while( (req = pick_request(ex)) == NULL && !ex->stop )
+			pthread_cond_wait(&ex->cond, &ex->mutex);
+		if(req == NULL)
+			break;
+
+		ex->running[req->priority]++;
+		pthread_mutex_unlock(&ex->mutex);
+		run_query(t, req);
+		struct completion_queue *notify = req->notify;
+		enum executor_class priority = req->priority;
+		completion_queue_push(notify, &req->node);
+		pthread_mutex_lock(&ex->mutex);
+		ex->running[priority]--;
+		pthread_cond_signal(&ex->cond); // A class that was at its limit may run again, on another thread
+	}
+	pthread_mutex_unlock(&ex->mutex);
+	return NULL;
+}
+
+static void free_executor(struct executor *ex) {
+	for(int i = 0; i < ex->n_started; i++) {
+		stmt_cache_free(&ex->threads[i].stmts);
+		sqlite3_close(ex->threads[i].db);
+	}
+	free(ex->threads);
+	pthread_cond_destroy(&ex->cond);
+	pthread_mutex_destroy(&ex->mutex);
+	free(ex);
+}
+
+static void stop_threads(struct executor *ex) {
+	pthread_mutex_lock(&ex->mutex);
+	ex->stop = true;
+	struct writer_node *aborted = NULL;
+	for(int c = 0; c < EXECUTOR_N_CLASSES; c++) {
+		struct writer_node *node;
+		while( (node = queue_pop(&ex->queues[c])) != NULL ) {
+			node->next = aborted;
+			aborted = node;
+		}
+	}
+	pthread_cond_broadcast(&ex->cond);
+	pthread_mutex_unlock(&ex->mutex);
+
+	while(aborted != NULL) {
+		struct query_request *req = (struct query_request *) aborted;
+		aborted = aborted->next;
+		req->err = SQLITE_ABORT;
+		snprintf(req->err_msg, sizeof(req->err_msg), "Executor stopped before the query ran");
+		completion_queue_push(req->notify, &req->node);
+	}
+
+	for(int i = 0; i < ex->n_started; i++)
+		pthread_join(ex->threads[i].thread, NULL);
+}
+
+int executor_start(struct executor **out, sqlite3 *db, const struct executor_options *options, int (*setup)(sqlite3 *db, void *ctx), void *setup_ctx) {
+	*out = NULL;
+	const char *path = sqlite3_db_filename(db, "main");
+	if(path == NULL || *path == '\0') // In-memory and temporary databases cannot be shared with another connection
+		return SQLITE_MISUSE;
+	sqlite3_vfs *vfs = NULL;
+	sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs);
+
+	struct executor *ex = calloc(1, sizeof(struct executor));
+	if(ex == NULL)
+		return SQLITE_NOMEM;
+	ex->threads = calloc(options->n_threads, sizeof(struct executor_thread));
+	if(ex->threads == NULL) {
+		free(ex);
+		return SQLITE_NOMEM;
+	}
+	ex->options = *options;
+	pthread_mutex_init(&ex->mutex, NULL);
+	pthread_cond_init(&ex->cond, NULL);
+
+	int err = SQLITE_OK;
+	for(int i = 0; i < options->n_threads && !err; i++) {
+		struct executor_thread *t = &ex->threads[i];
+		t->ex = ex;
+		err = sqlite3_open_v2(path, &t->db, SQLITE_OPEN_READWRITE, vfs ? vfs->zName : NULL);
+		if(!err) {
+			sqlite3_busy_timeout(t->db, EXECUTOR_BUSY_TIMEOUT_MS);
+			if(setup != NULL)
+				err = setup(t->db, setup_ctx);
+		}
+		if(err) {
+			sqlite3_close(t->db);
+			break;
+		}
+		stmt_cache_init(&t->stmts, 32);
+
+		if(pthread_create(&t->thread, NULL, executor_main, t) != 0) {
+			stmt_cache_free(&t->stmts);
+			sqlite3_close(t->db);
+			err = SQLITE_ERROR;
+			break;
+		}
+		ex->n_started++;
+	}
+
+	if(err) {
+		stop_threads(ex);
+		free_executor(ex);
+		return err;
+	}
+	*out = ex;
+	return SQLITE_OK;
+}
+
+int executor_submit(struct executor *ex, struct query_request *req) {
+	pthread_mutex_lock(&ex->mutex);
+	struct request_queue *q = &ex->queues[req->priority];
+	if(q->length >= ex->options.queue_limits[req->priority]) {
+		pthread_mutex_unlock(&ex->mutex);
+		return SQLITE_FULL;
+	}
+	queue_push(q, &req->node);
+	pthread_cond_signal(&ex->cond);
+	pthread_mutex_unlock(&ex->mutex);
+	return SQLITE_OK;
+}
+
+void executor_stop(struct executor *ex) {
+	stop_threads(ex);
+	free_executor(ex);
+}
@@ -0,0 +1,63 @@
+#ifndef EXECUTOR_H_INCLUDED
+#define EXECUTOR_H_INCLUDED
+
+#include "writer.h" // struct native_value, struct writer_node
+
+#include <sqlite3.h>
+
+#include <stddef.h>
+
+// A fixed pool of threads, each with a connection of its own to the database file, running queries
+// from one queue per priority class. Threads always take the highest class that has work, and the lower
+// classes may only occupy some of the threads, so that maintenance work cannot crowd out interactive queries.
+// Each queue has a limit; submitting to a full queue is rejected rather than letting latency grow.
+enum executor_class {
+	EXECUTOR_INTERACTIVE,
+	EXECUTOR_BATCH,
+	EXECUTOR_MAINTENANCE,
+	EXECUTOR_N_CLASSES
+};
+
+struct executor_options {
+	int n_threads;
+	int queue_limits[EXECUTOR_N_CLASSES]; // Queued (not yet running) queries per class
+	int max_running[EXECUTOR_N_CLASSES]; // Threads a class may occupy at once
+	int max_background; // Threads batch and maintenance queries may occupy together
+};
+
+struct query_request {
+	struct writer_node node; // Must come first
+	const char *sql; // Only the first statement is run
+	int sql_len;
+	const struct native_value *params;
+	int n_params;
+	enum executor_class priority;
+	struct completion_queue *notify; // The request is pushed here when finished
+
+	// Results, valid once pushed to notify; free with query_request_free_results
+	int err; // SQLITE_ABORT if the executor was stopped before the query ran
+	char err_msg[256];
+	sqlite3_int64 changes, last_insert_rowid;
+	int n_columns;
+	char **column_names;
+	struct native_value *values; // n_rows rows of n_columns values
+	size_t n_rows;
+};
+
+void query_request_free_results(struct query_request *req);
+
+struct executor;
+
+// Opens the pool's connections to the same file (and VFS) as db and calls setup(conn, setup_ctx) (if not NULL)
+// on each of them.
+// Returns SQLITE_MISUSE for in-memory and temporary databases.
+int executor_start(struct executor **out, sqlite3 *db, const struct executor_options *options, int (*setup)(sqlite3 *db, void *ctx), void *setup_ctx);
+
+// Queues the request, which must stay valid until it has been pushed to req->notify.
+// Returns SQLITE_FULL, without queueing, if the queue of the request's class is full.
+int executor_submit(struct executor *ex, struct query_request *req);
+
+// Lets running queries finish, fails the queued ones with SQLITE_ABORT, joins the threads and frees the executor
+void executor_stop(struct executor *ex);
+
+#endif
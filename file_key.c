@@ -0,0 +1,60 @@
+#define _XOPEN_SOURCE 700 // realpath
+
+#include "file_key.h"
+
+#include <sqlite3.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// A file that does not exist yet is resolved through its directory, so that it gets the same key as
+// once it has been created
+static char *resolve_missing(const char *path) {
+	const char *slash = strrchr(path, '/');
+	const char *name = slash ? slash + 1 : path;
+	char *dir = slash == NULL ? sqlite3_mprintf(".") : slash == path ? sqlite3_mprintf("/") : sqlite3_mprintf("%.*s", (int) (slash - path), path);
+	if(dir == NULL)
+		return NULL;
+	char *real_dir = realpath(dir, NULL);
+	sqlite3_free(dir);
+	if(real_dir == NULL || *name == '\0') {
+		free(real_dir);
+		return NULL;
+	}
+	char *resolved = sqlite3_mprintf("%s%s%s", real_dir, strcmp(real_dir, "/") == 0 ? "" : "/", name);
+	free(real_dir);
+	return resolved;
+}
+
+char *file_key(const char *path, const char *vfs) {
+	char *real = realpath(path, NULL);
+	char *key;
+	if(real != NULL) {
+		key = sqlite3_mprintf("%s|%s", real, vfs ? vfs : "");
+		free(real);
+	} else {
+		char *resolved = resolve_missing(path);
+		key = sqlite3_mprintf("%s|%s", resolved ? resolved : path, vfs ? vfs : "");
+		sqlite3_free(resolved);
+	}
+	return key;
+}
+
+bool file_path_usable(const char *path) {
+	struct stat st;
+	if(stat(path, &st) == 0)
+		return true;
+	
+	const char *slash = strrchr(path, '/');
+	if(slash == NULL)
+		return true; // The working directory
+	if(slash == path)
+		return stat("/", &st) == 0;
+	char *dir = sqlite3_mprintf("%.*s", (int) (slash - path), path);
+	if(dir == NULL)
+		return true; // Left for the open itself to fail
+	bool usable = stat(dir, &st) == 0 && S_ISDIR(st.st_mode);
+	sqlite3_free(dir);
+	return usable;
+}
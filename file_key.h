@@ -0,0 +1,15 @@
+#ifndef FILE_KEY_H_INCLUDED
+#define FILE_KEY_H_INCLUDED
+
+#include <stdbool.h>
+
+// Identifies a database file within the process: "<real path>|<vfs>", so that different spellings of
+// the same path (relative, through symlinks) give the same key. A file that does not exist yet is resolved through
+// its directory; paths that do not resolve at all are used as given.
+// Free with sqlite3_free; NULL if out of memory.
+char *file_key(const char *path, const char *vfs);
+
+// Whether opening path could work without touching it: the file exists, or the directory it would be created in does
+bool file_path_usable(const char *path);
+
+#endif
@@ -0,0 +1,267 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "group_commit.h"
+
+#include <time.h>
+
+static int64_t monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Both are no-ops on connections without a mutex
+static void lock_db(struct group_commit *gc) {
+	sqlite3_mutex_enter(sqlite3_db_mutex(gc->db));
+}
+
+static void unlock_db(struct group_commit *gc) {
+	sqlite3_mutex_leave(sqlite3_db_mutex(gc->db));
+}
+
+static int commit_batch(struct group_commit *gc, int *n_committed);
+
+static bool statements_running(sqlite3 *db) {
+	for(sqlite3_stmt *stmt = sqlite3_next_stmt(db, NULL); stmt != NULL; stmt = sqlite3_next_stmt(db, stmt)) {
+		if(sqlite3_stmt_busy(stmt))
+			return true;
+	}
+	return false;
+}
+
+// How long until the open batch is due, or -1 if there is none; a batch that is overdue (as the connection
+// was in use, or the commit failed) is tried again after another interval. Called with the connection's mutex held.
+static int64_t timer_wait_ms(struct group_commit *gc) {
+	if(!gc->open)
+		return -1;
+	int64_t elapsed_ms = monotonic_ms() - gc->opened_ms;
+	return elapsed_ms < gc->interval_ms ? gc->interval_ms - elapsed_ms : gc->interval_ms;
+}
+
+// The timer mutex is never held while waiting for the connection's, so group_commit_free never waits on a commit
+// Makes the timer look at the batch again
+static void wake_timer(struct group_commit *gc) {
+	if(!gc->has_timer)
+		return;
+	pthread_mutex_lock(&gc->timer_mutex);
+	gc->wake = true;
+	pthread_cond_signal(&gc->timer_cond);
+	pthread_mutex_unlock(&gc->timer_mutex);
+}
+
+static void *timer_main(void *arg) {
+	struct group_commit *gc = arg;
+
+	lock_db(gc);
+	int64_t wait_ms = timer_wait_ms(gc);
+	unlock_db(gc);
+
+	pthread_mutex_lock(&gc->timer_mutex);
+	while(!gc->stop) {
+		if(wait_ms < 0) { // Until a batch is opened
+			while(!gc->stop && !gc->wake)
+				pthread_cond_wait(&gc->timer_cond, &gc->timer_mutex);
+		} else {
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += wait_ms / 1000;
+			deadline.tv_nsec += (long) (wait_ms % 1000) * 1000000;
+			if(deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			while(!gc->stop && !gc->wake && pthread_cond_timedwait(&gc->timer_cond, &gc->timer_mutex, &deadline) == 0)
+				;
+		}
+		if(gc->stop)
+			break;
+		gc->wake = false; // Before looking at the batch, so that changes made after that are not missed
+		pthread_mutex_unlock(&gc->timer_mutex);
+
+		lock_db(gc);
+		if(gc->holds == 0 && !statements_running(gc->db))
+			group_commit_tick(gc); // A failed commit (most likely SQLITE_BUSY) is retried on the next round
+		wait_ms = timer_wait_ms(gc);
+		unlock_db(gc);
+
+		pthread_mutex_lock(&gc->timer_mutex);
+	}
+	pthread_mutex_unlock(&gc->timer_mutex);
+
+	return NULL;
+}
+
+int group_commit_init(struct group_commit *gc, sqlite3 *db, int max_writes, int64_t interval_ms) {
+	gc->db = db;
+	gc->max_writes = max_writes;
+	gc->interval_ms = interval_ms;
+	gc->open = false;
+	gc->pending = 0;
+	gc->opened_ms = 0;
+	gc->lost = 0;
+	gc->holds = 0;
+	gc->has_timer = false;
+	gc->stop = false;
+	gc->wake = false;
+	if(sqlite3_db_mutex(db) == NULL)
+		return SQLITE_OK;
+
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&gc->timer_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	pthread_mutex_init(&gc->timer_mutex, NULL);
+
+	if(pthread_create(&gc->timer, NULL, timer_main, gc) != 0) {
+		pthread_cond_destroy(&gc->timer_cond);
+		pthread_mutex_destroy(&gc->timer_mutex);
+		return SQLITE_ERROR;
+	}
+	gc->has_timer = true;
+	return SQLITE_OK;
+}
+
+void group_commit_free(struct group_commit *gc) {
+	if(!gc->has_timer)
+		return;
+	pthread_mutex_lock(&gc->timer_mutex);
+	gc->stop = true;
+	pthread_cond_signal(&gc->timer_cond);
+	pthread_mutex_unlock(&gc->timer_mutex);
+	pthread_join(gc->timer, NULL);
+
+	pthread_cond_destroy(&gc->timer_cond);
+	pthread_mutex_destroy(&gc->timer_mutex);
+	gc->has_timer = false;
+}
+
+void group_commit_set_limits(struct group_commit *gc, int max_writes, int64_t interval_ms) {
+	lock_db(gc);
+	gc->max_writes = max_writes;
+	gc->interval_ms = interval_ms;
+	wake_timer(gc); // To wait for the new interval
+	unlock_db(gc);
+}
+
+void group_commit_hold(struct group_commit *gc) {
+	lock_db(gc);
+	gc->holds++;
+	unlock_db(gc);
+}
+
+void group_commit_unhold(struct group_commit *gc) {
+	lock_db(gc);
+	gc->holds--;
+	unlock_db(gc);
+}
+
+// SQLite rolls back the whole transaction on some errors; the batch is then gone
+static void check_rolled_back(struct group_commit *gc) {
+	if(gc->open && sqlite3_get_autocommit(gc->db)) {
+		gc->lost += gc->pending;
+		gc->pending = 0;
+		gc->open = false;
+	}
+}
+
+static int before_write(struct group_commit *gc, bool *batched) {
+	*batched = false;
+	check_rolled_back(gc);
+
+	int err = group_commit_tick(gc);
+	if(err)
+		return err;
+
+	if(!gc->open) {
+		if(!sqlite3_get_autocommit(gc->db))
+			return SQLITE_OK; // The user's own transaction
+
+		err = sqlite3_exec(gc->db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+		if(err)
+			return err;
+		gc->open = true;
+		gc->opened_ms = monotonic_ms();
+		wake_timer(gc);
+	}
+
+	err = sqlite3_exec(gc->db, "SAVEPOINT beryl_batch_write", NULL, NULL, NULL);
+	if(err)
+		return err;
+	*batched = true;
+	gc->holds++; // Until group_commit_after_write
+	return SQLITE_OK;
+}
+
+int group_commit_before_write(struct group_commit *gc, bool *batched) {
+	lock_db(gc);
+	int err = before_write(gc, batched);
+	unlock_db(gc);
+	return err;
+}
+
+static int after_write(struct group_commit *gc, bool ok) {
+	gc->holds--;
+	check_rolled_back(gc);
+	if(!gc->open)
+		return ok ? SQLITE_OK : SQLITE_ABORT;
+
+	if(!ok)
+		sqlite3_exec(gc->db, "ROLLBACK TO beryl_batch_write", NULL, NULL, NULL);
+	int err = sqlite3_exec(gc->db, "RELEASE beryl_batch_write", NULL, NULL, NULL);
+	if(err)
+		return err;
+
+	if(ok)
+		gc->pending++;
+	// A failed commit (most likely SQLITE_BUSY) keeps the batch open; it is retried on the next write or flush
+	int n_committed;
+	if(gc->pending >= gc->max_writes)
+		commit_batch(gc, &n_committed);
+	return SQLITE_OK;
+}
+
+int group_commit_after_write(struct group_commit *gc, bool ok) {
+	lock_db(gc);
+	int err = after_write(gc, ok);
+	unlock_db(gc);
+	return err;
+}
+
+static int commit_batch(struct group_commit *gc, int *n_committed) {
+	*n_committed = 0;
+	check_rolled_back(gc);
+	if(!gc->open)
+		return SQLITE_OK;
+
+	int err = sqlite3_exec(gc->db, "COMMIT", NULL, NULL, NULL);
+	if(err) {
+		// Nothing is lost yet (a busy COMMIT can be retried), unless SQLite gave up on the transaction
+		check_rolled_back(gc);
+		return err;
+	}
+	*n_committed = gc->pending;
+	gc->pending = 0;
+	gc->open = false;
+	return SQLITE_OK;
+}
+
+int group_commit_flush(struct group_commit *gc, int *n_committed) {
+	lock_db(gc);
+	int err = commit_batch(gc, n_committed);
+	if(!err && gc->lost != 0) {
+		gc->lost = 0;
+		err = SQLITE_ABORT;
+	}
+	unlock_db(gc);
+	return err;
+}
+
+int group_commit_tick(struct group_commit *gc) {
+	lock_db(gc);
+	int err = SQLITE_OK, n_committed;
+	if(gc->open && monotonic_ms() - gc->opened_ms >= gc->interval_ms)
+		err = commit_batch(gc, &n_committed);
+	unlock_db(gc);
+	return err;
+}
@@ -0,0 +1,64 @@
+#ifndef GROUP_COMMIT_H_INCLUDED
+#define GROUP_COMMIT_H_INCLUDED
+
+#include <sqlite3.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Group commit: consecutive writes share one transaction, which is committed once it holds max_writes
+// writes or has been open for interval_ms, or when flushed. Every write runs in a savepoint of its own,
+// so a failing write is undone without affecting the others and reports its error right away;
+// the writes of a batch become durable together when it is committed.
+// Writes made while the user has a transaction of their own open are left alone.
+//
+// A timer thread commits a batch that has been open for the interval even while the connection is not used,
+// so an idle script does not hold the write lock. It commits on the connection itself, under the connection's
+// mutex, which requires the connection to be serialized (the default unless SQLite is built with
+// SQLITE_THREADSAFE=2 or the connection opened with SQLITE_OPEN_NOMUTEX); without the mutex there is no timer, and batches are only committed by later writes, group_commit_tick or a flush. The timer leaves
+// the batch alone while statements of the connection are running or the batch is held.
+struct group_commit {
+	sqlite3 *db;
+	int max_writes;
+	int64_t interval_ms;
+
+	// All of the above and below is protected by the connection's mutex
+	bool open; // Whether the current transaction is the batch's
+	int pending;
+	int64_t opened_ms;
+	int lost; // Writes discarded because SQLite rolled the batch back (e.g. on SQLITE_FULL), reported by the next flush
+	int holds; // While nonzero, the timer does not commit (a write or a series of statements is in progress)
+
+	bool has_timer;
+	pthread_t timer;
+	pthread_mutex_t timer_mutex; // Protects stop and wake
+	pthread_cond_t timer_cond;
+	bool stop;
+	bool wake; // Set when a batch is opened or the interval changes
+};
+
+// Starts the timer thread if the connection is serialized; returns an SQLite error code
+int group_commit_init(struct group_commit *gc, sqlite3 *db, int max_writes, int64_t interval_ms);
+// Stops the timer thread; the batch is left as it is
+void group_commit_free(struct group_commit *gc);
+
+void group_commit_set_limits(struct group_commit *gc, int max_writes, int64_t interval_ms);
+
+// Keeps the timer from committing the batch in the middle of statements that have to end up in the same
+// transaction (such as a savepoint and its release); calls nest
+void group_commit_hold(struct group_commit *gc);
+void group_commit_unhold(struct group_commit *gc);
+
+// Called before a write; *batched tells whether it is part of a batch (and so needs group_commit_after_write)
+int group_commit_before_write(struct group_commit *gc, bool *batched);
+int group_commit_after_write(struct group_commit *gc, bool ok);
+
+// Commits the current batch; *n_committed receives the number of writes made durable.
+// Returns SQLITE_ABORT if writes were lost since the last flush.
+int group_commit_flush(struct group_commit *gc, int *n_committed);
+
+// Commits the batch if it has been open for longer than the interval
+int group_commit_tick(struct group_commit *gc);
+
+#endif
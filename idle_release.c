@@ -0,0 +1,151 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "idle_release.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct idle_watch {
+	struct idle_watch *next;
+	sqlite3 **dbs;
+	int n_dbs;
+	int64_t idle_ms;
+	int64_t last_use_ms; // Accessed atomically, as it is updated on every use
+	int64_t released_use_ms; // last_use_ms when last released; only used by the thread
+};
+
+struct sweeper {
+	pthread_t thread;
+	pthread_cond_t cond;
+	bool stop;
+};
+
+// Protects watches and the sweepers' stop flags
+static pthread_mutex_t watches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct idle_watch *watches = NULL;
+static struct sweeper *sweeper = NULL; // Running while there are watches
+
+static int64_t monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// A connection that is in use (its mutex is held) is skipped; it is not idle anyway
+static void release_db(sqlite3 *db) {
+	sqlite3_mutex *mutex = sqlite3_db_mutex(db);
+	if(mutex == NULL || sqlite3_mutex_try(mutex) != SQLITE_OK)
+		return;
+	sqlite3_db_release_memory(db);
+	sqlite3_mutex_leave(mutex);
+}
+
+static void sweep(int64_t now) {
+	for(struct idle_watch *watch = watches; watch != NULL; watch = watch->next) {
+		int64_t last_use = __atomic_load_n(&watch->last_use_ms, __ATOMIC_RELAXED);
+		if(last_use == watch->released_use_ms || now - last_use < watch->idle_ms)
+			continue;
+		for(int i = 0; i < watch->n_dbs; i++)
+			release_db(watch->dbs[i]);
+		watch->released_use_ms = last_use;
+	}
+}
+
+static void *sweeper_main(void *arg) {
+	struct sweeper *sw = arg;
+	pthread_mutex_lock(&watches_mutex);
+	while(!sw->stop) {
+		sweep(monotonic_ms());
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += 1;
+		pthread_cond_timedwait(&sw->cond, &watches_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&watches_mutex);
+	return NULL;
+}
+
+static struct sweeper *start_sweeper(void) {
+	struct sweeper *sw = calloc(1, sizeof(struct sweeper));
+	if(sw == NULL)
+		return NULL;
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sw->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	if(pthread_create(&sw->thread, NULL, sweeper_main, sw) != 0) {
+		pthread_cond_destroy(&sw->cond);
+		free(sw);
+		return NULL;
+	}
+	return sw;
+}
+
+int idle_watch_start(struct idle_watch **out, sqlite3 *const *dbs, int n_dbs, int idle_s) {
+	*out = NULL;
+	struct idle_watch *watch = calloc(1, sizeof(struct idle_watch));
+	if(watch == NULL)
+		return SQLITE_NOMEM;
+	watch->dbs = malloc(sizeof(sqlite3 *) * (n_dbs ? n_dbs : 1));
+	if(watch->dbs == NULL) {
+		free(watch);
+		return SQLITE_NOMEM;
+	}
+	memcpy(watch->dbs, dbs, sizeof(sqlite3 *) * n_dbs);
+	watch->n_dbs = n_dbs;
+	watch->idle_ms = (int64_t) idle_s * 1000;
+	watch->last_use_ms = monotonic_ms();
+	watch->released_use_ms = -1;
+
+	pthread_mutex_lock(&watches_mutex);
+	if(sweeper == NULL && (sweeper = start_sweeper()) == NULL) {
+		pthread_mutex_unlock(&watches_mutex);
+		free(watch->dbs);
+		free(watch);
+		return SQLITE_ERROR;
+	}
+	watch->next = watches;
+	watches = watch;
+	pthread_mutex_unlock(&watches_mutex);
+
+	*out = watch;
+	return SQLITE_OK;
+}
+
+void idle_watch_touch(struct idle_watch *watch) {
+	__atomic_store_n(&watch->last_use_ms, monotonic_ms(), __ATOMIC_RELAXED);
+}
+
+void idle_watch_stop(struct idle_watch *watch) {
+	struct sweeper *stopped = NULL;
+	pthread_mutex_lock(&watches_mutex);
+	for(struct idle_watch **link = &watches; *link != NULL; link = &(*link)->next) {
+		if(*link == watch) {
+			*link = watch->next;
+			break;
+		}
+	}
+	// The last watch takes the thread down with it; a later watch starts a new one
+	if(watches == NULL) {
+		stopped = sweeper;
+		sweeper = NULL;
+		stopped->stop = true;
+		pthread_cond_signal(&stopped->cond);
+	}
+	pthread_mutex_unlock(&watches_mutex);
+
+	if(stopped != NULL) {
+		pthread_join(stopped->thread, NULL);
+		pthread_cond_destroy(&stopped->cond);
+		free(stopped);
+	}
+	free(watch->dbs);
+	free(watch);
+}
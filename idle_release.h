@@ -0,0 +1,24 @@
+#ifndef IDLE_RELEASE_H_INCLUDED
+#define IDLE_RELEASE_H_INCLUDED
+
+#include <sqlite3.h>
+
+// Frees the unused page cache (sqlite3_db_release_memory) of connections that have not been used for a while,
+// from one background thread shared by the whole process, so that memory is given back even while nothing runs.
+// The thread is started with the first watch and stopped with the last one. It only touches serialized
+// connections (those with a mutex, see sqlite3_db_mutex), as it runs alongside the thread that owns them;
+// others are left to their owner.
+struct idle_watch;
+
+// Watches a group of connections (such as a connection and its readers) that are released together once none
+// of them has been used for idle_s seconds. The array is copied; the connections must stay open until
+// idle_watch_stop.
+int idle_watch_start(struct idle_watch **out, sqlite3 *const *dbs, int n_dbs, int idle_s);
+
+// Called on every use of the connections
+void idle_watch_touch(struct idle_watch *watch);
+
+// Stops watching and frees the watch; once it returns, the thread no longer uses the connections
+void idle_watch_stop(struct idle_watch *watch);
+
+#endif
@@ -0,0 +1,286 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "partitions.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+
+static char *copy_str(const char *str) {
+	size_t len = strlen(str) + 1;
+	char *copy = malloc(len);
+	if(copy != NULL)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+int partition_set_init(struct partition_set *ps, const char *dir, const char *name, const char *create_sql, sqlite3_int64 bucket_seconds, int n_attach) {
+	memset(ps, 0, sizeof(struct partition_set));
+	ps->dir = copy_str(dir);
+	ps->name = copy_str(name);
+	ps->create_sql = copy_str(create_sql);
+	ps->attached = malloc(sizeof(sqlite3_int64) * n_attach);
+	ps->bucket_seconds = bucket_seconds;
+	ps->n_attach = n_attach;
+
+	if(ps->dir == NULL || ps->name == NULL || ps->create_sql == NULL || ps->attached == NULL) {
+		partition_set_free(ps);
+		return SQLITE_NOMEM;
+	}
+	return SQLITE_OK;
+}
+
+void partition_set_free(struct partition_set *ps) {
+	free(ps->dir);
+	free(ps->name);
+	free(ps->create_sql);
+	free(ps->attached);
+	memset(ps, 0, sizeof(struct partition_set));
+}
+
+// Rounds towards negative infinity, so that times before the epoch still get consistent buckets
+static sqlite3_int64 bucket_of(const struct partition_set *ps, sqlite3_int64 time) {
+	if(time >= 0)
+		return time / ps->bucket_seconds;
+	return -((-time + ps->bucket_seconds - 1) / ps->bucket_seconds);
+}
+
+static char *partition_path(const struct partition_set *ps, sqlite3_int64 bucket) {
+	return sqlite3_mprintf("%s/%s-%lld.sqlite", ps->dir, ps->name, bucket);
+}
+
+static char *partition_schema(const struct partition_set *ps, sqlite3_int64 bucket) {
+	return sqlite3_mprintf("%s_%lld", ps->name, bucket);
+}
+
+static int compare_buckets(const void *a, const void *b) {
+	sqlite3_int64 x = *(const sqlite3_int64 *) a, y = *(const sqlite3_int64 *) b;
+	return (x > y) - (x < y);
+}
+
+int partition_set_list(struct partition_set *ps, sqlite3_int64 **buckets, int *n_buckets) {
+	*buckets = NULL;
+	*n_buckets = 0;
+
+	DIR *dir = opendir(ps->dir);
+	if(dir == NULL)
+		return SQLITE_CANTOPEN;
+
+	size_t name_len = strlen(ps->name);
+	int cap = 0;
+	int err = SQLITE_OK;
+	struct dirent *entry;
+	while( (entry = readdir(dir)) != NULL ) {
+		const char *file = entry->d_name;
+		if(strncmp(file, ps->name, name_len) != 0 || file[name_len] != '-')
+			continue;
+
+		char *end;
+		sqlite3_int64 bucket = strtoll(file + name_len + 1, &end, 10);
+		if(end == file + name_len + 1 || strcmp(end, ".sqlite") != 0)
+			continue;
+
+		if(*n_buckets == cap) {
+			cap = cap ? cap * 2 : 16;
+			sqlite3_int64 *new_buckets = sqlite3_realloc64(*buckets, sizeof(sqlite3_int64) * cap);
+			if(new_buckets == NULL) {
+				err = SQLITE_NOMEM;
+				break;
+			}
+			*buckets = new_buckets;
+		}
+		(*buckets)[(*n_buckets)++] = bucket;
+	}
+	closedir(dir);
+
+	if(err != SQLITE_OK) {
+		sqlite3_free(*buckets);
+		*buckets = NULL;
+		*n_buckets = 0;
+		return err;
+	}
+	if(*n_buckets > 1)
+		qsort(*buckets, *n_buckets, sizeof(sqlite3_int64), compare_buckets);
+	return SQLITE_OK;
+}
+
+static int create_partition(const struct partition_set *ps, sqlite3_int64 bucket) {
+	char *path = partition_path(ps, bucket);
+	if(path == NULL)
+		return SQLITE_NOMEM;
+	if(access(path, F_OK) == 0) {
+		sqlite3_free(path);
+		return SQLITE_OK;
+	}
+
+	// Created through a connection of its own, so that the schema SQL can use unqualified names
+	sqlite3 *db;
+	int err = sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	if(err == SQLITE_OK)
+		err = sqlite3_exec(db, ps->create_sql, NULL, NULL, NULL);
+	sqlite3_close(db);
+
+	if(err != SQLITE_OK)
+		unlink(path);
+	sqlite3_free(path);
+	return err;
+}
+
+static int exec_printf(sqlite3 *db, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	char *sql = sqlite3_vmprintf(fmt, args);
+	va_end(args);
+	if(sql == NULL)
+		return SQLITE_NOMEM;
+
+	int err = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+	return err;
+}
+
+static int attach_partition(struct partition_set *ps, sqlite3 *db, sqlite3_int64 bucket) {
+	char *path = partition_path(ps, bucket);
+	char *schema = partition_schema(ps, bucket);
+	int err = SQLITE_NOMEM;
+	if(path != NULL && schema != NULL)
+		err = exec_printf(db, "ATTACH DATABASE %Q AS \"%w\"", path, schema);
+	sqlite3_free(path);
+	sqlite3_free(schema);
+
+	if(err == SQLITE_OK)
+		ps->attached[ps->n_attached++] = bucket;
+	return err;
+}
+
+static int ensure_attached(struct partition_set *ps, sqlite3 *db, sqlite3_int64 bucket) {
+	for(int i = 0; i < ps->n_attached; i++) {
+		if(ps->attached[i] == bucket)
+			return SQLITE_OK;
+	}
+	return attach_partition(ps, db, bucket);
+}
+
+static int detach_partition(struct partition_set *ps, sqlite3 *db, int i) {
+	char *schema = partition_schema(ps, ps->attached[i]);
+	if(schema == NULL)
+		return SQLITE_NOMEM;
+	int err = exec_printf(db, "DETACH DATABASE \"%w\"", schema);
+	sqlite3_free(schema);
+
+	if(err == SQLITE_OK)
+		ps->attached[i] = ps->attached[--ps->n_attached];
+	return err;
+}
+
+static int recreate_view(struct partition_set *ps, sqlite3 *db) {
+	int err = exec_printf(db, "DROP VIEW IF EXISTS temp.\"%w\"", ps->name);
+	if(err != SQLITE_OK || ps->n_attached == 0)
+		return err;
+
+	qsort(ps->attached, ps->n_attached, sizeof(sqlite3_int64), compare_buckets);
+
+	sqlite3_str *str = sqlite3_str_new(db);
+	sqlite3_str_appendf(str, "CREATE TEMP VIEW \"%w\" AS ", ps->name);
+	for(int i = 0; i < ps->n_attached; i++) {
+		if(i != 0)
+			sqlite3_str_appendall(str, " UNION ALL ");
+		sqlite3_str_appendf(str, "SELECT * FROM \"%w_%lld\".\"%w\"", ps->name, ps->attached[i], ps->name);
+	}
+
+	char *sql = sqlite3_str_finish(str);
+	if(sql == NULL)
+		return SQLITE_NOMEM;
+	err = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+	return err;
+}
+
+int partition_set_rotate(struct partition_set *ps, sqlite3 *db, sqlite3_int64 now, char **schema) {
+	*schema = NULL;
+	sqlite3_int64 current = bucket_of(ps, now);
+
+	int err = create_partition(ps, current);
+	if(err != SQLITE_OK)
+		return err;
+
+	sqlite3_int64 *buckets;
+	int n_buckets;
+	err = partition_set_list(ps, &buckets, &n_buckets);
+	if(err != SQLITE_OK)
+		return err;
+
+	// The newest partitions, but always including the current one (partitions for later times may exist, e.g. after
+	// the clock was set back), which then takes the place of the oldest
+	int first_wanted = n_buckets > ps->n_attach ? n_buckets - ps->n_attach : 0;
+	bool current_wanted = false;
+	for(int i = first_wanted; i < n_buckets; i++)
+		current_wanted = current_wanted || buckets[i] == current;
+	if(!current_wanted)
+		first_wanted++;
+
+	for(int i = ps->n_attached - 1; i >= 0 && err == SQLITE_OK; i--) {
+		bool wanted = ps->attached[i] == current;
+		for(int j = first_wanted; j < n_buckets; j++)
+			wanted = wanted || ps->attached[i] == buckets[j];
+		if(!wanted)
+			err = detach_partition(ps, db, i);
+	}
+
+	if(err == SQLITE_OK && !current_wanted)
+		err = ensure_attached(ps, db, current);
+	for(int i = first_wanted; i < n_buckets && err == SQLITE_OK; i++)
+		err = ensure_attached(ps, db, buckets[i]);
+	sqlite3_free(buckets);
+
+	if(err == SQLITE_OK)
+		err = recreate_view(ps, db);
+	if(err == SQLITE_OK) {
+		*schema = partition_schema(ps, current);
+		if(*schema == NULL)
+			err = SQLITE_NOMEM;
+	}
+	return err;
+}
+
+static void delete_partition_files(const struct partition_set *ps, sqlite3_int64 bucket) {
+	static const char *suffixes[] = { "", "-journal", "-wal", "-shm" };
+	for(size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		char *path = sqlite3_mprintf("%s/%s-%lld.sqlite%s", ps->dir, ps->name, bucket, suffixes[i]);
+		if(path != NULL)
+			unlink(path);
+		sqlite3_free(path);
+	}
+}
+
+int partition_set_drop_before(struct partition_set *ps, sqlite3 *db, sqlite3_int64 time, int *n_dropped) {
+	*n_dropped = 0;
+	sqlite3_int64 cutoff = bucket_of(ps, time);
+
+	sqlite3_int64 *buckets;
+	int n_buckets;
+	int err = partition_set_list(ps, &buckets, &n_buckets);
+	if(err != SQLITE_OK)
+		return err;
+
+	for(int i = 0; i < n_buckets && buckets[i] < cutoff && err == SQLITE_OK; i++) {
+		for(int j = 0; j < ps->n_attached; j++) {
+			if(ps->attached[j] == buckets[i]) {
+				err = detach_partition(ps, db, j);
+				break;
+			}
+		}
+		if(err == SQLITE_OK) {
+			delete_partition_files(ps, buckets[i]);
+			(*n_dropped)++;
+		}
+	}
+	sqlite3_free(buckets);
+
+	if(err == SQLITE_OK && *n_dropped != 0)
+		err = recreate_view(ps, db);
+	return err;
+}
@@ -0,0 +1,35 @@
+#ifndef PARTITIONS_H_INCLUDED
+#define PARTITIONS_H_INCLUDED
+
+#include <sqlite3.h>
+
+#include <stddef.h>
+
+// A table split into one database file per time bucket:
+//   <dir>/<name>-<bucket>.sqlite    where bucket = floor(time / bucket_seconds)
+// The newest n_attach partitions (always including the current one) are attached to the connection as schemas named <name>_<bucket>,
+// and a TEMP view <name> unions them all. Dropping old data is a DETACH and a file deletion.
+struct partition_set {
+	char *dir, *name, *create_sql;
+	sqlite3_int64 bucket_seconds;
+	int n_attach;
+
+	sqlite3_int64 *attached;
+	int n_attached;
+};
+
+// All strings are copied; returns SQLITE_NOMEM on failure
+int partition_set_init(struct partition_set *ps, const char *dir, const char *name, const char *create_sql, sqlite3_int64 bucket_seconds, int n_attach);
+void partition_set_free(struct partition_set *ps);
+
+// Creates the partition for the given time if needed, attaches the newest partitions (detaching older ones)
+// and recreates the view. *schema receives the schema name of the partition for the given time (free with sqlite3_free).
+int partition_set_rotate(struct partition_set *ps, sqlite3 *db, sqlite3_int64 now, char **schema);
+
+// Detaches and deletes all partitions older than the bucket of the given time; *n_dropped receives their count
+int partition_set_drop_before(struct partition_set *ps, sqlite3 *db, sqlite3_int64 time, int *n_dropped);
+
+// Lists the buckets that have a partition file, in ascending order (free *buckets with sqlite3_free)
+int partition_set_list(struct partition_set *ps, sqlite3_int64 **buckets, int *n_buckets);
+
+#endif
@@ -0,0 +1,210 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "prefetch.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct prefetch_cursor {
+	pthread_t thread;
+	pthread_mutex_t mutex; // Protects everything below but the statement, which only the thread uses once started
+	pthread_cond_t not_full, not_empty;
+
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	struct native_value *params; // Bound without copying, so kept until the cursor is freed
+	int n_params;
+	int n_columns;
+	char **column_names;
+
+	// capacity rows of n_columns values each. Rows [tail, head) are ready; while held is set, the caller
+	// is using row tail, which the thread leaves alone until it is released.
+	struct native_value *rows;
+	size_t capacity, head, tail;
+	bool held;
+
+	int status; // SQLITE_ROW while the query runs, then SQLITE_DONE or its error
+	char err_msg[256];
+	bool stop;
+};
+
+static struct native_value *get_row(struct prefetch_cursor *cur, size_t i) {
+	return &cur->rows[(i % cur->capacity) * cur->n_columns];
+}
+
+static void free_row(struct prefetch_cursor *cur, size_t i) {
+	struct native_value *row = get_row(cur, i);
+	for(int j = 0; j < cur->n_columns; j++)
+		native_value_free(&row[j]);
+}
+
+static int decode_row(struct prefetch_cursor *cur, struct native_value *row) {
+	for(int i = 0; i < cur->n_columns; i++) {
+		if(!native_value_from_column(cur->stmt, i, &row[i])) {
+			for(int j = 0; j < i; j++)
+				native_value_free(&row[j]);
+			return SQLITE_NOMEM;
+		}
+	}
+	return SQLITE_OK;
+}
+
+static void *prefetch_main(void *arg) {
+	struct prefetch_cursor *cur = arg;
+
+	pthread_mutex_lock(&cur->mutex);
+	for(;;) {
+		while(!cur->stop && cur->head - cur->tail == cur->capacity)
+			pthread_cond_wait(&cur->not_full, &cur->mutex);
+		if(cur->stop)
+			break;
+
+		// Slot head is free and only written here, so the row is decoded without holding the lock
+		struct native_value *row = get_row(cur, cur->head);
+		pthread_mutex_unlock(&cur->mutex);
+		int res = sqlite3_step(cur->stmt);
+		if(res == SQLITE_ROW)
+			res = decode_row(cur, row);
+		else if(res != SQLITE_DONE)
+			snprintf(cur->err_msg, sizeof(cur->err_msg), "%s", sqlite3_errmsg(cur->db));
+		pthread_mutex_lock(&cur->mutex);
+
+		if(res != SQLITE_OK) {
+			if(res == SQLITE_NOMEM)
+				snprintf(cur->err_msg, sizeof(cur->err_msg), "%s", sqlite3_errstr(res));
+			cur->status = res;
+			pthread_cond_signal(&cur->not_empty);
+			break;
+		}
+		cur->head++;
+		pthread_cond_signal(&cur->not_empty);
+	}
+	pthread_mutex_unlock(&cur->mutex);
+
+	sqlite3_reset(cur->stmt); // Ends the read transaction right away rather than when the cursor is freed
+	return NULL;
+}
+
+static void free_cursor(struct prefetch_cursor *cur) {
+	for(int i = 0; cur->column_names != NULL && i < cur->n_columns; i++)
+		sqlite3_free(cur->column_names[i]);
+	free(cur->column_names);
+	free(cur->rows);
+	sqlite3_finalize(cur->stmt);
+	sqlite3_close(cur->db);
+	for(int i = 0; i < cur->n_params; i++)
+		native_value_free(&cur->params[i]);
+	free(cur->params);
+	free(cur);
+}
+
+int prefetch_start(struct prefetch_cursor **out, sqlite3 *db, const char *sql, int sql_len, struct native_value *params, int n_params, int capacity) {
+	*out = NULL;
+	struct prefetch_cursor *cur = calloc(1, sizeof(struct prefetch_cursor));
+	if(cur == NULL) {
+		sqlite3_close(db);
+		for(int i = 0; i < n_params; i++)
+			native_value_free(&params[i]);
+		free(params);
+		return SQLITE_NOMEM;
+	}
+	cur->db = db;
+	cur->params = params;
+	cur->n_params = n_params;
+	cur->capacity = capacity;
+	cur->status = SQLITE_ROW;
+
+	int err = sqlite3_prepare_v2(db, sql, sql_len, &cur->stmt, NULL);
+	if(!err && cur->stmt == NULL)
+		err = SQLITE_MISUSE;
+	for(int i = 0; i < n_params && !err; i++)
+		err = native_value_bind(cur->stmt, i + 1, &params[i]);
+	if(err) {
+		free_cursor(cur);
+		return err;
+	}
+
+	// Copied, as the names returned by SQLite may change once the statement is stepped
+	cur->n_columns = sqlite3_column_count(cur->stmt);
+	cur->column_names = calloc(cur->n_columns ? cur->n_columns : 1, sizeof(char *));
+	cur->rows = malloc(sizeof(struct native_value) * capacity * (cur->n_columns ? cur->n_columns : 1));
+	if(cur->column_names == NULL || cur->rows == NULL)
+		err = SQLITE_NOMEM;
+	for(int i = 0; i < cur->n_columns && !err; i++) {
+		cur->column_names[i] = sqlite3_mprintf("%s", sqlite3_column_name(cur->stmt, i));
+		if(cur->column_names[i] == NULL)
+			err = SQLITE_NOMEM;
+	}
+	if(err) {
+		free_cursor(cur);
+		return err;
+	}
+
+	pthread_mutex_init(&cur->mutex, NULL);
+	pthread_cond_init(&cur->not_full, NULL);
+	pthread_cond_init(&cur->not_empty, NULL);
+	if(pthread_create(&cur->thread, NULL, prefetch_main, cur) != 0) {
+		pthread_cond_destroy(&cur->not_empty);
+		pthread_cond_destroy(&cur->not_full);
+		pthread_mutex_destroy(&cur->mutex);
+		free_cursor(cur);
+		return SQLITE_ERROR;
+	}
+	*out = cur;
+	return SQLITE_OK;
+}
+
+int prefetch_column_count(const struct prefetch_cursor *cur) {
+	return cur->n_columns;
+}
+
+const char *prefetch_column_name(const struct prefetch_cursor *cur, int column) {
+	return column >= 0 && column < cur->n_columns ? cur->column_names[column] : NULL;
+}
+
+int prefetch_next(struct prefetch_cursor *cur, const struct native_value **row) {
+	*row = NULL;
+	if(cur->held)
+		free_row(cur, cur->tail); // The thread never touches a held row, so this needs no lock
+
+	pthread_mutex_lock(&cur->mutex);
+	if(cur->held) {
+		cur->held = false;
+		cur->tail++;
+		pthread_cond_signal(&cur->not_full);
+	}
+	while(cur->head == cur->tail && cur->status == SQLITE_ROW)
+		pthread_cond_wait(&cur->not_empty, &cur->mutex);
+
+	int res = cur->status;
+	if(cur->head != cur->tail) {
+		cur->held = true;
+		*row = get_row(cur, cur->tail);
+		res = SQLITE_ROW;
+	}
+	pthread_mutex_unlock(&cur->mutex);
+	return res;
+}
+
+const char *prefetch_errmsg(const struct prefetch_cursor *cur) {
+	return cur->err_msg;
+}
+
+void prefetch_stop(struct prefetch_cursor *cur) {
+	pthread_mutex_lock(&cur->mutex);
+	cur->stop = true;
+	pthread_cond_signal(&cur->not_full);
+	pthread_mutex_unlock(&cur->mutex);
+	sqlite3_interrupt(cur->db); // In case the thread is in the middle of a long step
+	pthread_join(cur->thread, NULL);
+
+	for(size_t i = cur->tail; i < cur->head; i++) // Includes a held row
+		free_row(cur, i);
+	pthread_cond_destroy(&cur->not_empty);
+	pthread_cond_destroy(&cur->not_full);
+	pthread_mutex_destroy(&cur->mutex);
+	free_cursor(cur);
+}
@@ -0,0 +1,29 @@
+#ifndef PREFETCH_H_INCLUDED
+#define PREFETCH_H_INCLUDED
+
+#include "writer.h" // struct native_value
+
+#include <sqlite3.h>
+
+// A query stepped by a background thread of its own, which decodes rows into a bounded ring buffer
+// while the caller is still busy with earlier ones, so that SQLite's B-tree work overlaps with whatever
+// the caller does per row. The thread stops stepping when the buffer is full.
+struct prefetch_cursor;
+
+// Prepares the query's first statement on db and starts the thread; the cursor takes ownership of db
+// (a connection of its own, used by nothing else) and of params, even if it fails.
+// Returns SQLITE_MISUSE if the SQL holds no statement.
+int prefetch_start(struct prefetch_cursor **out, sqlite3 *db, const char *sql, int sql_len, struct native_value *params, int n_params, int capacity);
+
+int prefetch_column_count(const struct prefetch_cursor *cur);
+const char *prefetch_column_name(const struct prefetch_cursor *cur, int column);
+
+// Waits for the next row. Returns SQLITE_ROW with row pointing to its columns (valid until the next call),
+// SQLITE_DONE at the end or the error that ended the query (see prefetch_errmsg).
+int prefetch_next(struct prefetch_cursor *cur, const struct native_value **row);
+const char *prefetch_errmsg(const struct prefetch_cursor *cur);
+
+// Interrupts and joins the thread and frees the cursor along with its connection
+void prefetch_stop(struct prefetch_cursor *cur);
+
+#endif
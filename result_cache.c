@@ -0,0 +1,318 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "result_cache.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RESULT_CACHE_MAGIC "BRYLRES1"
+#define RESULT_CACHE_BYTE_ORDER 0x01020304u
+
+struct file_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t n_columns;
+	uint64_t n_rows;
+	uint64_t heap_offset, heap_size;
+	uint64_t file_size;
+};
+
+struct column_entry {
+	uint64_t name; // Heap offset
+	uint64_t types_offset, slots_offset;
+};
+
+struct buffer {
+	unsigned char *data;
+	uint64_t len, cap;
+};
+
+static bool buffer_append(struct buffer *buf, const void *data, uint64_t len) {
+	if(buf->len + len > buf->cap) {
+		uint64_t new_cap = buf->cap ? buf->cap : 256;
+		while(new_cap < buf->len + len)
+			new_cap *= 2;
+		unsigned char *new_data = realloc(buf->data, new_cap);
+		if(new_data == NULL)
+			return false;
+		buf->data = new_data;
+		buf->cap = new_cap;
+	}
+	if(len != 0)
+		memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return true;
+}
+
+static uint64_t pad8(uint64_t n) {
+	return (n + 7) & ~(uint64_t) 7;
+}
+
+// Appends a length-prefixed, 8 byte aligned entry to the heap and returns its offset
+static bool heap_append(struct buffer *heap, const void *data, uint64_t len, uint64_t *offset) {
+	static const unsigned char zeros[8] = { 0 };
+	*offset = heap->len;
+	return buffer_append(heap, &len, sizeof(len))
+		&& buffer_append(heap, data, len)
+		&& buffer_append(heap, zeros, pad8(len) - len);
+}
+
+struct column_buffers {
+	struct buffer types, slots;
+};
+
+static int append_row(sqlite3_stmt *stmt, struct column_buffers *columns, int n_columns, struct buffer *heap) {
+	for(int i = 0; i < n_columns; i++) {
+		unsigned char type = sqlite3_column_type(stmt, i);
+		uint64_t slot = 0;
+		switch(type) {
+			case SQLITE_INTEGER: {
+				sqlite3_int64 val = sqlite3_column_int64(stmt, i);
+				memcpy(&slot, &val, sizeof(slot));
+				break;
+			}
+			case SQLITE_FLOAT: {
+				double val = sqlite3_column_double(stmt, i);
+				memcpy(&slot, &val, sizeof(slot));
+				break;
+			}
+			case SQLITE_TEXT:
+			case SQLITE_BLOB: {
+				const void *data = sqlite3_column_blob(stmt, i);
+				if(!heap_append(heap, data, sqlite3_column_bytes(stmt, i), &slot))
+					return SQLITE_NOMEM;
+				break;
+			}
+		}
+		if(!buffer_append(&columns[i].types, &type, 1) || !buffer_append(&columns[i].slots, &slot, sizeof(slot)))
+			return SQLITE_NOMEM;
+	}
+	return SQLITE_OK;
+}
+
+static bool write_padded(FILE *f, const void *data, uint64_t len) {
+	static const unsigned char zeros[8] = { 0 };
+	if(len == 0)
+		return true;
+	return fwrite(data, 1, len, f) == len && fwrite(zeros, 1, pad8(len) - len, f) == pad8(len) - len;
+}
+
+static int write_file(const char *path, struct column_buffers *columns, int n_columns, const struct buffer *heap, const uint64_t *names, uint64_t n_rows) {
+	struct file_header header;
+	memcpy(header.magic, RESULT_CACHE_MAGIC, sizeof(header.magic));
+	header.byte_order = RESULT_CACHE_BYTE_ORDER;
+	header.n_columns = n_columns;
+	header.n_rows = n_rows;
+
+	uint64_t offset = sizeof(struct file_header) + sizeof(struct column_entry) * n_columns;
+	struct column_entry *entries = malloc(sizeof(struct column_entry) * (n_columns ? n_columns : 1));
+	if(entries == NULL)
+		return SQLITE_NOMEM;
+	for(int i = 0; i < n_columns; i++) {
+		entries[i].name = names[i];
+		entries[i].types_offset = offset;
+		offset += pad8(n_rows);
+		entries[i].slots_offset = offset;
+		offset += n_rows * sizeof(uint64_t);
+	}
+	header.heap_offset = offset;
+	header.heap_size = heap->len;
+	header.file_size = offset + heap->len;
+
+	FILE *f = fopen(path, "wb");
+	if(f == NULL) {
+		free(entries);
+		return SQLITE_CANTOPEN;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(entries, sizeof(struct column_entry), n_columns, f) == (size_t) n_columns;
+	for(int i = 0; i < n_columns && ok; i++)
+		ok = write_padded(f, columns[i].types.data, n_rows) && write_padded(f, columns[i].slots.data, n_rows * sizeof(uint64_t));
+	if(ok)
+		ok = write_padded(f, heap->data, heap->len);
+
+	free(entries);
+	if(fclose(f) != 0)
+		ok = false;
+	return ok ? SQLITE_OK : SQLITE_IOERR;
+}
+
+int result_cache_write(sqlite3_stmt *stmt, const char *path, uint64_t *n_rows) {
+	*n_rows = 0;
+	int n_columns = sqlite3_column_count(stmt);
+
+	struct column_buffers *columns = calloc(n_columns ? n_columns : 1, sizeof(struct column_buffers));
+	uint64_t *names = calloc(n_columns ? n_columns : 1, sizeof(uint64_t));
+	struct buffer heap = { NULL, 0, 0 };
+	int err = columns && names ? SQLITE_OK : SQLITE_NOMEM;
+
+	for(int i = 0; i < n_columns && !err; i++) {
+		const char *name = sqlite3_column_name(stmt, i);
+		if(name == NULL || !heap_append(&heap, name, strlen(name), &names[i]))
+			err = SQLITE_NOMEM;
+	}
+
+	if(!err) {
+		int res;
+		while( (res = sqlite3_step(stmt)) == SQLITE_ROW ) {
+			err = append_row(stmt, columns, n_columns, &heap);
+			if(err)
+				break;
+			(*n_rows)++;
+		}
+		if(!err && res != SQLITE_DONE)
+			err = res;
+	}
+	sqlite3_reset(stmt);
+
+	char *tmp_path = NULL;
+	if(!err) {
+		tmp_path = sqlite3_mprintf("%s.tmp-%d", path, (int) getpid());
+		err = tmp_path ? write_file(tmp_path, columns, n_columns, &heap, names, *n_rows) : SQLITE_NOMEM;
+		if(!err && rename(tmp_path, path) != 0)
+			err = SQLITE_IOERR;
+		if(err)
+			unlink(tmp_path);
+	}
+	sqlite3_free(tmp_path);
+
+	for(int i = 0; columns != NULL && i < n_columns; i++) {
+		free(columns[i].types.data);
+		free(columns[i].slots.data);
+	}
+	free(columns);
+	free(names);
+	free(heap.data);
+	return err;
+}
+
+static const struct file_header *get_header(const struct result_cache *cache) {
+	return (const struct file_header *) cache->map;
+}
+
+static struct column_entry get_column(const struct result_cache *cache, uint32_t column) {
+	struct column_entry entry;
+	memcpy(&entry, cache->map + sizeof(struct file_header) + sizeof(struct column_entry) * column, sizeof(entry));
+	return entry;
+}
+
+// Checks that [offset, offset + len) lies within the mapping, without overflowing
+static bool in_bounds(const struct result_cache *cache, uint64_t offset, uint64_t len) {
+	return offset <= cache->size && len <= cache->size - offset;
+}
+
+static bool is_valid(const struct result_cache *cache) {
+	if(cache->size < sizeof(struct file_header))
+		return false;
+	const struct file_header *header = get_header(cache);
+	if(memcmp(header->magic, RESULT_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->byte_order != RESULT_CACHE_BYTE_ORDER)
+		return false;
+	if(header->file_size != cache->size || !in_bounds(cache, header->heap_offset, header->heap_size))
+		return false;
+	if(header->n_rows > cache->size || !in_bounds(cache, sizeof(struct file_header), (uint64_t) sizeof(struct column_entry) * header->n_columns))
+		return false;
+
+	for(uint32_t i = 0; i < header->n_columns; i++) {
+		struct column_entry entry = get_column(cache, i);
+		if(!in_bounds(cache, entry.types_offset, header->n_rows) || !in_bounds(cache, entry.slots_offset, header->n_rows * sizeof(uint64_t)))
+			return false;
+		if(entry.slots_offset % sizeof(uint64_t) != 0)
+			return false;
+	}
+	return true;
+}
+
+int result_cache_open(struct result_cache *cache, const char *path) {
+	memset(cache, 0, sizeof(struct result_cache));
+
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return SQLITE_CANTOPEN;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		return SQLITE_CANTOPEN;
+	}
+	if(st.st_size == 0) {
+		close(fd);
+		return SQLITE_CORRUPT;
+	}
+
+	// Shared, read-only pages: every process loading the same cache uses the same page cache memory
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return SQLITE_CANTOPEN;
+
+	cache->map = map;
+	cache->size = st.st_size;
+	if(!is_valid(cache)) {
+		result_cache_close(cache);
+		return SQLITE_CORRUPT;
+	}
+	cache->n_columns = get_header(cache)->n_columns;
+	cache->n_rows = get_header(cache)->n_rows;
+	return SQLITE_OK;
+}
+
+void result_cache_close(struct result_cache *cache) {
+	if(cache->map != NULL)
+		munmap((void *) cache->map, cache->size);
+	memset(cache, 0, sizeof(struct result_cache));
+}
+
+static int heap_entry(const struct result_cache *cache, uint64_t offset, const void **data, uint64_t *len) {
+	const struct file_header *header = get_header(cache);
+	if(offset > header->heap_size || header->heap_size - offset < sizeof(uint64_t))
+		return SQLITE_CORRUPT;
+
+	const unsigned char *entry = cache->map + header->heap_offset + offset;
+	memcpy(len, entry, sizeof(uint64_t));
+	if(*len > header->heap_size - offset - sizeof(uint64_t))
+		return SQLITE_CORRUPT;
+	*data = entry + sizeof(uint64_t);
+	return SQLITE_OK;
+}
+
+int result_cache_column_name(const struct result_cache *cache, uint32_t column, const char **name, uint64_t *len) {
+	if(column >= cache->n_columns)
+		return SQLITE_RANGE;
+	const void *data = NULL;
+	int err = heap_entry(cache, get_column(cache, column).name, &data, len);
+	*name = data;
+	return err;
+}
+
+int result_cache_value(const struct result_cache *cache, uint64_t row, uint32_t column, struct result_value *out) {
+	if(row >= cache->n_rows || column >= cache->n_columns)
+		return SQLITE_RANGE;
+
+	struct column_entry entry = get_column(cache, column);
+	uint64_t slot;
+	memcpy(&slot, cache->map + entry.slots_offset + row * sizeof(uint64_t), sizeof(slot));
+
+	memset(out, 0, sizeof(struct result_value));
+	out->type = cache->map[entry.types_offset + row];
+	switch(out->type) {
+		case SQLITE_NULL:
+			return SQLITE_OK;
+		case SQLITE_INTEGER:
+			memcpy(&out->i, &slot, sizeof(slot));
+			return SQLITE_OK;
+		case SQLITE_FLOAT:
+			memcpy(&out->f, &slot, sizeof(slot));
+			return SQLITE_OK;
+		case SQLITE_TEXT:
+		case SQLITE_BLOB:
+			return heap_entry(cache, slot, &out->data, &out->len);
+		default:
+			return SQLITE_CORRUPT;
+	}
+}
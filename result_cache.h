@@ -0,0 +1,40 @@
+#ifndef RESULT_CACHE_H_INCLUDED
+#define RESULT_CACHE_H_INCLUDED
+
+#include <sqlite3.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Query results stored as a column-oriented binary file that is read through mmap.
+// Every column is an array of one type byte per row followed by an array of 8 byte slots per row
+// (the integer, the double, or the offset of a length-prefixed text/blob in the file's heap),
+// so any value is found with a few loads and no parsing. Files use the writer's byte order.
+
+struct result_cache {
+	const unsigned char *map;
+	size_t size;
+	uint32_t n_columns;
+	uint64_t n_rows;
+};
+
+struct result_value {
+	int type; // SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT or SQLITE_BLOB
+	sqlite3_int64 i;
+	double f;
+	const void *data; // Text and blobs; points into the mapping
+	uint64_t len;
+};
+
+// Steps stmt to completion and writes its rows to path (through a temporary file that is renamed into place,
+// so existing readers keep their mapping of the old file). *n_rows receives the row count.
+int result_cache_write(sqlite3_stmt *stmt, const char *path, uint64_t *n_rows);
+
+// Maps the file; returns SQLITE_CANTOPEN if it cannot be opened and SQLITE_CORRUPT if it is not a valid cache file
+int result_cache_open(struct result_cache *cache, const char *path);
+void result_cache_close(struct result_cache *cache);
+
+int result_cache_column_name(const struct result_cache *cache, uint32_t column, const char **name, uint64_t *len);
+int result_cache_value(const struct result_cache *cache, uint64_t row, uint32_t column, struct result_value *out);
+
+#endif
@@ -0,0 +1,177 @@
+#include "row_hash.h"
+
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+	uint64_t v = 0;
+	for(int i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t h;
+
+	if(len >= 32) {
+		uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+		uint64_t v2 = seed + PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME64_1;
+		do {
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		} while(end - p >= 32);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge_round(h, v1);
+		h = xxh64_merge_round(h, v2);
+		h = xxh64_merge_round(h, v3);
+		h = xxh64_merge_round(h, v4);
+	} else
+		h = seed + PRIME64_5;
+
+	h += len;
+
+	for(; end - p >= 8; p += 8) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if(end - p >= 4) {
+		h ^= read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for(; p < end; p++) {
+		h ^= *p * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+// Each value is serialized as a type tag followed by its contents (length prefixed for text/blobs),
+// so that e.g. ('ab', 'c') and ('a', 'bc') hash differently
+static void row_hash_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	unsigned char stack_buf[256];
+	stack_buf[0] = 0;
+	unsigned char *buf = stack_buf;
+	size_t cap = sizeof(stack_buf), len = 0;
+
+	for(int i = 0; i < argc; i++) {
+		int type = sqlite3_value_type(argv[i]);
+		const void *content = NULL;
+		size_t content_len = 0;
+		unsigned char fixed[8];
+
+		switch(type) {
+			case SQLITE_INTEGER: {
+				sqlite3_int64 v = sqlite3_value_int64(argv[i]);
+				memcpy(fixed, &v, 8);
+				content = fixed, content_len = 8;
+			} break;
+			case SQLITE_FLOAT: {
+				double v = sqlite3_value_double(argv[i]);
+				memcpy(fixed, &v, 8);
+				content = fixed, content_len = 8;
+			} break;
+			case SQLITE_TEXT:
+				content = sqlite3_value_text(argv[i]);
+				content_len = sqlite3_value_bytes(argv[i]);
+				break;
+			case SQLITE_BLOB:
+				content = sqlite3_value_blob(argv[i]);
+				content_len = sqlite3_value_bytes(argv[i]);
+				break;
+			default:
+				break;
+		}
+
+		size_t needed = len + 1 + 4 + content_len;
+		if(needed > cap) {
+			while(cap < needed)
+				cap *= 2;
+			unsigned char *new_buf = sqlite3_malloc64(cap);
+			if(new_buf == NULL) {
+				if(buf != stack_buf)
+					sqlite3_free(buf);
+				sqlite3_result_error_nomem(ctx);
+				return;
+			}
+			memcpy(new_buf, buf, len);
+			if(buf != stack_buf)
+				sqlite3_free(buf);
+			buf = new_buf;
+		}
+
+		buf[len++] = type;
+		if(type == SQLITE_TEXT || type == SQLITE_BLOB) {
+			for(int b = 0; b < 4; b++)
+				buf[len++] = (content_len >> (b * 8)) & 0xFF;
+		}
+		if(content_len != 0)
+			memcpy(buf + len, content, content_len);
+		len += content_len;
+	}
+
+	sqlite3_result_int64(ctx, (sqlite3_int64) xxh64(buf, len, 0));
+	if(buf != stack_buf)
+		sqlite3_free(buf);
+}
+
+static void row_hash_sum_step(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	(void) argc;
+	uint64_t *sum = sqlite3_aggregate_context(ctx, sizeof(uint64_t));
+	if(sum == NULL) {
+		sqlite3_result_error_nomem(ctx);
+		return;
+	}
+	*sum += (uint64_t) sqlite3_value_int64(argv[0]);
+}
+
+static void row_hash_sum_final(sqlite3_context *ctx) {
+	uint64_t *sum = sqlite3_aggregate_context(ctx, 0);
+	sqlite3_result_int64(ctx, sum == NULL ? 0 : (sqlite3_int64) *sum);
+}
+
+int register_row_hash_functions(sqlite3 *db) {
+	const int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS;
+	int err = sqlite3_create_function(db, "row_hash", -1, flags, NULL, row_hash_func, NULL, NULL);
+	if(err)
+		return err;
+	return sqlite3_create_function(db, "row_hash_sum", 1, flags, NULL, NULL, row_hash_sum_step, row_hash_sum_final);
+}
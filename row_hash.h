@@ -0,0 +1,17 @@
+#ifndef ROW_HASH_H_INCLUDED
+#define ROW_HASH_H_INCLUDED
+
+#include <sqlite3.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64 (https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md)
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+// Registers:
+//   row_hash(...)      64-bit hash of all its arguments (types included); NULLs hash as well
+//   row_hash_sum(h)    Aggregate; order-independent wrapping sum of hashes, for comparing sets of rows
+int register_row_hash_functions(sqlite3 *db);
+
+#endif
@@ -0,0 +1,98 @@
+#include "stmt_cache.h"
+#include "row_hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void stmt_cache_init(struct stmt_cache *cache, int capacity) {
+	memset(cache, 0, sizeof(struct stmt_cache));
+	cache->capacity = capacity;
+}
+
+static void free_entry(struct stmt_cache_entry *entry) {
+	sqlite3_finalize(entry->stmt);
+	free(entry->sql);
+}
+
+void stmt_cache_free(struct stmt_cache *cache) {
+	for(int i = 0; i < cache->n_entries; i++)
+		free_entry(&cache->entries[i]);
+	free(cache->entries);
+	stmt_cache_init(cache, cache->capacity);
+}
+
+// Returns a free slot, evicting the least recently used entry if the cache is full; NULL if out of memory
+static struct stmt_cache_entry *new_entry(struct stmt_cache *cache) {
+	if(cache->entries == NULL) {
+		cache->entries = malloc(sizeof(struct stmt_cache_entry) * cache->capacity);
+		if(cache->entries == NULL)
+			return NULL;
+	}
+	if(cache->n_entries < cache->capacity)
+		return &cache->entries[cache->n_entries++];
+
+	struct stmt_cache_entry *oldest = &cache->entries[0];
+	for(int i = 1; i < cache->n_entries; i++) {
+		if(cache->entries[i].last_use < oldest->last_use)
+			oldest = &cache->entries[i];
+	}
+	free_entry(oldest);
+	return oldest;
+}
+
+int stmt_cache_prepare(struct stmt_cache *cache, sqlite3 *db, const char *sql, size_t sql_len, struct stmt_cache_entry **out) {
+	*out = NULL;
+	uint64_t hash = xxh64(sql, sql_len, 0);
+	for(int i = 0; i < cache->n_entries; i++) {
+		struct stmt_cache_entry *entry = &cache->entries[i];
+		if(entry->hash == hash && entry->sql_len == sql_len && memcmp(entry->sql, sql, sql_len) == 0) {
+			entry->last_use = ++cache->clock;
+			if(entry->stmt != NULL) {
+				sqlite3_reset(entry->stmt);
+				sqlite3_clear_bindings(entry->stmt);
+			}
+			*out = entry;
+			return SQLITE_OK;
+		}
+	}
+
+	if(sql_len > INT32_MAX)
+		return SQLITE_TOOBIG;
+	char *sql_copy = malloc(sql_len ? sql_len : 1);
+	if(sql_copy == NULL)
+		return SQLITE_NOMEM;
+	memcpy(sql_copy, sql, sql_len);
+
+	sqlite3_stmt *new_stmt;
+	const char *tail;
+	int err = sqlite3_prepare_v3(db, sql_copy, sql_len, SQLITE_PREPARE_PERSISTENT, &new_stmt, &tail);
+	if(err) {
+		free(sql_copy);
+		return err;
+	}
+
+	struct stmt_cache_entry *entry = new_entry(cache);
+	if(entry == NULL) {
+		sqlite3_finalize(new_stmt);
+		free(sql_copy);
+		return SQLITE_NOMEM;
+	}
+	*entry = (struct stmt_cache_entry) {
+		sql_copy, sql_len, hash, new_stmt,
+		tail - sql_copy,
+		new_stmt == NULL || sqlite3_stmt_readonly(new_stmt),
+		0,
+		++cache->clock
+	};
+	*out = entry;
+	return SQLITE_OK;
+}
+
+int stmt_cache_get(struct stmt_cache *cache, sqlite3 *db, const char *sql, size_t sql_len, sqlite3_stmt **stmt) {
+	struct stmt_cache_entry *entry;
+	int err = stmt_cache_prepare(cache, db, sql, sql_len, &entry);
+	*stmt = err ? NULL : entry->stmt;
+	if(!err && *stmt == NULL)
+		return SQLITE_MISUSE;
+	return err;
+}
@@ -0,0 +1,39 @@
+#ifndef STMT_CACHE_H_INCLUDED
+#define STMT_CACHE_H_INCLUDED
+
+#include <sqlite3.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <stdbool.h>
+
+// A small least-recently-used cache of prepared statements, keyed by their SQL text.
+// Statements are handed out reset and with their bindings cleared; a statement stays valid
+// until the next stmt_cache_get/stmt_cache_prepare (which may evict it) or stmt_cache_free.
+struct stmt_cache_entry {
+	char *sql;
+	size_t sql_len;
+	uint64_t hash;
+	sqlite3_stmt *stmt; // NULL if the text holds no statement (only whitespace or comments)
+	size_t used_len; // Length of the first statement in sql; the rest is left for the next one
+	bool readonly; // sqlite3_stmt_readonly, classified once when prepared
+	int flags; // Free for the owner of the cache to use; 0 when prepared
+	uint64_t last_use;
+};
+
+struct stmt_cache {
+	struct stmt_cache_entry *entries;
+	int n_entries, capacity;
+	uint64_t clock;
+};
+
+void stmt_cache_init(struct stmt_cache *cache, int capacity);
+void stmt_cache_free(struct stmt_cache *cache);
+
+int stmt_cache_get(struct stmt_cache *cache, sqlite3 *db, const char *sql, size_t sql_len, sqlite3_stmt **stmt);
+
+// Like stmt_cache_get, for text that may hold several statements: only the first one is prepared
+int stmt_cache_prepare(struct stmt_cache *cache, sqlite3 *db, const char *sql, size_t sql_len, struct stmt_cache_entry **entry);
+
+#endif
@@ -0,0 +1,270 @@
+#include "table_diff.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIFF_LEAF_ROWS 256 // Ranges with at most this many rows on both sides are compared row by row
+
+struct diff_side {
+	sqlite3_stmt *bounds, *range_hash, *range_rows;
+};
+
+struct key_range {
+	sqlite3_int64 lo, hi;
+};
+
+static bool key_list_push(struct key_list *list, sqlite3_int64 key) {
+	if(list->len == list->cap) {
+		size_t new_cap = list->cap ? list->cap * 2 : 16;
+		sqlite3_int64 *new_keys = realloc(list->keys, new_cap * sizeof(sqlite3_int64));
+		if(new_keys == NULL)
+			return false;
+		list->keys = new_keys;
+		list->cap = new_cap;
+	}
+	list->keys[list->len++] = key;
+	return true;
+}
+
+// "t" -> "t", "aux.t" -> "aux"."t"; the result must be freed with sqlite3_free
+static char *quote_table_name(const char *name) {
+	const char *dot = strchr(name, '.');
+	if(dot == NULL)
+		return sqlite3_mprintf("\"%w\"", name);
+	return sqlite3_mprintf("\"%.*w\".\"%w\"", (int) (dot - name), name, dot + 1);
+}
+
+// Builds "row_hash("a", "b", ...)" from the columns of the given table
+static char *build_hash_expr(sqlite3 *db, const char *table) {
+	const char *dot = strchr(table, '.');
+	sqlite3_stmt *stmt;
+	if(sqlite3_prepare_v2(db, "SELECT name FROM pragma_table_info(?1, ?2)", -1, &stmt, NULL) != SQLITE_OK)
+		return NULL;
+	if(dot == NULL)
+		sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+	else {
+		sqlite3_bind_text(stmt, 1, dot + 1, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, table, dot - table, SQLITE_STATIC);
+	}
+
+	sqlite3_str *str = sqlite3_str_new(db);
+	sqlite3_str_appendall(str, "row_hash(");
+	int n_columns = 0;
+	while(sqlite3_step(stmt) == SQLITE_ROW) {
+		if(n_columns++ != 0)
+			sqlite3_str_appendall(str, ", ");
+		sqlite3_str_appendf(str, "\"%w\"", (const char *) sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_str_appendchar(str, 1, ')');
+	sqlite3_finalize(stmt);
+
+	char *expr = sqlite3_str_finish(str);
+	if(n_columns == 0) {
+		sqlite3_free(expr);
+		return NULL;
+	}
+	return expr;
+}
+
+static int prepare_side(sqlite3 *db, const char *table, const char *key, const char *hash_expr, struct diff_side *side) {
+	char *quoted = quote_table_name(table);
+	if(quoted == NULL)
+		return SQLITE_NOMEM;
+
+	char *bounds_sql = sqlite3_mprintf("SELECT min(\"%w\"), max(\"%w\") FROM %s", key, key, quoted);
+	char *hash_sql = sqlite3_mprintf("SELECT count(*), row_hash_sum(%s) FROM %s WHERE \"%w\" BETWEEN ?1 AND ?2", hash_expr, quoted, key);
+	char *rows_sql = sqlite3_mprintf("SELECT \"%w\", %s FROM %s WHERE \"%w\" BETWEEN ?1 AND ?2 ORDER BY 1", key, hash_expr, quoted, key);
+	sqlite3_free(quoted);
+
+	int err = SQLITE_NOMEM;
+	if(bounds_sql != NULL && hash_sql != NULL && rows_sql != NULL) {
+		err = sqlite3_prepare_v2(db, bounds_sql, -1, &side->bounds, NULL);
+		if(err == SQLITE_OK)
+			err = sqlite3_prepare_v2(db, hash_sql, -1, &side->range_hash, NULL);
+		if(err == SQLITE_OK)
+			err = sqlite3_prepare_v2(db, rows_sql, -1, &side->range_rows, NULL);
+	}
+
+	sqlite3_free(bounds_sql);
+	sqlite3_free(hash_sql);
+	sqlite3_free(rows_sql);
+	return err;
+}
+
+static void finalize_side(struct diff_side *side) {
+	sqlite3_finalize(side->bounds);
+	sqlite3_finalize(side->range_hash);
+	sqlite3_finalize(side->range_rows);
+}
+
+static int range_hash(struct diff_side *side, struct key_range range, sqlite3_int64 *count, sqlite3_int64 *hash) {
+	sqlite3_stmt *stmt = side->range_hash;
+	sqlite3_bind_int64(stmt, 1, range.lo);
+	sqlite3_bind_int64(stmt, 2, range.hi);
+	int res = sqlite3_step(stmt);
+	if(res == SQLITE_ROW) {
+		*count = sqlite3_column_int64(stmt, 0);
+		*hash = sqlite3_column_int64(stmt, 1);
+		res = SQLITE_OK;
+	}
+	sqlite3_reset(stmt);
+	return res;
+}
+
+// Walks both sides of a range in key order, like a merge join
+static int compare_rows(struct diff_side *a, struct diff_side *b, struct key_range range, struct table_diff *out) {
+	sqlite3_stmt *sa = a->range_rows, *sb = b->range_rows;
+	sqlite3_bind_int64(sa, 1, range.lo);
+	sqlite3_bind_int64(sa, 2, range.hi);
+	sqlite3_bind_int64(sb, 1, range.lo);
+	sqlite3_bind_int64(sb, 2, range.hi);
+
+	int res_a = sqlite3_step(sa), res_b = sqlite3_step(sb);
+	int err = SQLITE_OK;
+	while(res_a == SQLITE_ROW || res_b == SQLITE_ROW) {
+		bool ok;
+		if(res_b != SQLITE_ROW || (res_a == SQLITE_ROW && sqlite3_column_int64(sa, 0) < sqlite3_column_int64(sb, 0))) {
+			ok = key_list_push(&out->only_a, sqlite3_column_int64(sa, 0));
+			res_a = sqlite3_step(sa);
+		} else if(res_a != SQLITE_ROW || sqlite3_column_int64(sb, 0) < sqlite3_column_int64(sa, 0)) {
+			ok = key_list_push(&out->only_b, sqlite3_column_int64(sb, 0));
+			res_b = sqlite3_step(sb);
+		} else {
+			ok = true;
+			if(sqlite3_column_int64(sa, 1) != sqlite3_column_int64(sb, 1))
+				ok = key_list_push(&out->changed, sqlite3_column_int64(sa, 0));
+			res_a = sqlite3_step(sa);
+			res_b = sqlite3_step(sb);
+		}
+		if(!ok) {
+			err = SQLITE_NOMEM;
+			break;
+		}
+	}
+	if(err == SQLITE_OK && res_a != SQLITE_DONE && res_a != SQLITE_ROW)
+		err = res_a;
+	if(err == SQLITE_OK && res_b != SQLITE_DONE && res_b != SQLITE_ROW)
+		err = res_b;
+
+	sqlite3_reset(sa);
+	sqlite3_reset(sb);
+	return err;
+}
+
+// Widens *range to cover the key range of side; returns SQLITE_DONE if the table is empty
+static int extend_bounds(struct diff_side *side, struct key_range *range, bool *have_range, const char **err_msg) {
+	sqlite3_stmt *stmt = side->bounds;
+	int res = sqlite3_step(stmt);
+	if(res != SQLITE_ROW) {
+		sqlite3_reset(stmt);
+		return res;
+	}
+
+	int err = SQLITE_OK;
+	if(sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+		err = SQLITE_DONE;
+	else if(sqlite3_column_type(stmt, 0) != SQLITE_INTEGER || sqlite3_column_type(stmt, 1) != SQLITE_INTEGER) {
+		*err_msg = "Key column must hold integers";
+		err = SQLITE_MISMATCH;
+	} else {
+		sqlite3_int64 lo = sqlite3_column_int64(stmt, 0), hi = sqlite3_column_int64(stmt, 1);
+		if(!*have_range || lo < range->lo)
+			range->lo = lo;
+		if(!*have_range || hi > range->hi)
+			range->hi = hi;
+		*have_range = true;
+	}
+	sqlite3_reset(stmt);
+	return err;
+}
+
+int table_diff(sqlite3 *db, const char *table_a, const char *table_b, const char *key, struct table_diff *out, const char **err_msg) {
+	memset(out, 0, sizeof(struct table_diff));
+	*err_msg = "SQL error";
+
+	struct diff_side a = { NULL, NULL, NULL }, b = { NULL, NULL, NULL };
+	struct key_range *stack = NULL;
+	size_t stack_len = 0, stack_cap = 0;
+
+	char *hash_expr = build_hash_expr(db, table_a);
+	if(hash_expr == NULL) {
+		*err_msg = "Unable to read the columns of the first table";
+		return SQLITE_ERROR;
+	}
+
+	int err = prepare_side(db, table_a, key, hash_expr, &a);
+	if(err == SQLITE_OK)
+		err = prepare_side(db, table_b, key, hash_expr, &b);
+	sqlite3_free(hash_expr);
+	if(err != SQLITE_OK)
+		goto done;
+
+	struct key_range full;
+	bool have_range = false;
+	err = extend_bounds(&a, &full, &have_range, err_msg);
+	if(err == SQLITE_DONE)
+		err = SQLITE_OK;
+	if(err == SQLITE_OK)
+		err = extend_bounds(&b, &full, &have_range, err_msg);
+	if(err == SQLITE_DONE)
+		err = SQLITE_OK;
+	if(err != SQLITE_OK || !have_range)
+		goto done;
+
+	stack_cap = 64;
+	stack = malloc(sizeof(struct key_range) * stack_cap);
+	if(stack == NULL) {
+		err = SQLITE_NOMEM;
+		goto done;
+	}
+	stack[stack_len++] = full;
+
+	while(stack_len != 0) {
+		struct key_range range = stack[--stack_len];
+
+		sqlite3_int64 count_a, hash_a, count_b, hash_b;
+		if( (err = range_hash(&a, range, &count_a, &hash_a)) != SQLITE_OK )
+			break;
+		if( (err = range_hash(&b, range, &count_b, &hash_b)) != SQLITE_OK )
+			break;
+		if(count_a == count_b && hash_a == hash_b)
+			continue;
+
+		if((count_a <= DIFF_LEAF_ROWS && count_b <= DIFF_LEAF_ROWS) || range.lo == range.hi) {
+			if( (err = compare_rows(&a, &b, range, out)) != SQLITE_OK )
+				break;
+			continue;
+		}
+
+		if(stack_len + 2 > stack_cap) {
+			struct key_range *new_stack = realloc(stack, sizeof(struct key_range) * stack_cap * 2);
+			if(new_stack == NULL) {
+				err = SQLITE_NOMEM;
+				break;
+			}
+			stack = new_stack;
+			stack_cap *= 2;
+		}
+		// Computed on unsigned values, as hi - lo may not fit in an int64
+		sqlite3_int64 mid = range.lo + (sqlite3_int64) (((uint64_t) range.hi - (uint64_t) range.lo) / 2);
+		stack[stack_len++] = (struct key_range) { mid + 1, range.hi };
+		stack[stack_len++] = (struct key_range) { range.lo, mid };
+	}
+
+	done:
+	free(stack);
+	finalize_side(&a);
+	finalize_side(&b);
+	if(err != SQLITE_OK)
+		table_diff_free(out);
+	return err;
+}
+
+void table_diff_free(struct table_diff *diff) {
+	free(diff->only_a.keys);
+	free(diff->only_b.keys);
+	free(diff->changed.keys);
+	memset(diff, 0, sizeof(struct table_diff));
+}
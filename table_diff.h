@@ -0,0 +1,26 @@
+#ifndef TABLE_DIFF_H_INCLUDED
+#define TABLE_DIFF_H_INCLUDED
+
+#include <sqlite3.h>
+
+#include <stddef.h>
+
+struct key_list {
+	sqlite3_int64 *keys;
+	size_t len, cap;
+};
+
+struct table_diff {
+	struct key_list only_a, only_b, changed;
+};
+
+// Compares two tables (optionally schema qualified, "aux.t") that share their columns and an integer key column.
+// Key ranges are compared with row_hash_sum(row_hash(...)) and bisected until the differing ranges are small,
+// so only the rows around actual differences are ever read one by one.
+// Requires the functions from row_hash.h to be registered on db.
+// On failure returns an SQLite error code and sets *err_msg to a static description.
+int table_diff(sqlite3 *db, const char *table_a, const char *table_b, const char *key, struct table_diff *out, const char **err_msg);
+
+void table_diff_free(struct table_diff *diff);
+
+#endif
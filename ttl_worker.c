@@ -0,0 +1,227 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ttl_worker.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct ttl_table {
+	char *table, *column;
+	sqlite3_stmt *stmt; // Prepared (and only ever used) by the worker thread
+	bool changed; // Set when the registration changes; the worker then prepares the statement again
+};
+
+struct ttl_worker {
+	pthread_t thread;
+	pthread_mutex_t mutex; // Protects tables and stop
+	pthread_cond_t cond;
+	bool stop;
+
+	sqlite3 *db;
+	struct ttl_options options;
+
+	struct ttl_table *tables;
+	int n_tables, tables_cap;
+
+	int64_t last_activity_ms; // Accessed atomically, as it is updated on every query
+};
+
+static int64_t monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool is_idle(struct ttl_worker *worker) {
+	return monotonic_ms() - __atomic_load_n(&worker->last_activity_ms, __ATOMIC_RELAXED) >= worker->options.idle_ms;
+}
+
+static bool should_stop(struct ttl_worker *worker) {
+	return __atomic_load_n(&worker->stop, __ATOMIC_RELAXED);
+}
+
+static int prepare_table(struct ttl_worker *worker, struct ttl_table *table) {
+	sqlite3_finalize(table->stmt);
+	table->stmt = NULL;
+	table->changed = false;
+
+	char *sql = sqlite3_mprintf(
+		"DELETE FROM \"%w\" WHERE rowid IN (SELECT rowid FROM \"%w\" WHERE \"%w\" <= ?1 LIMIT ?2)",
+		table->table, table->table, table->column
+	);
+	if(sql == NULL)
+		return SQLITE_NOMEM;
+	int err = sqlite3_prepare_v2(worker->db, sql, -1, &table->stmt, NULL);
+	sqlite3_free(sql);
+	return err;
+}
+
+// Deletes batches until no expired rows are left, the connection gets used again or the worker is stopped
+static void purge_table(struct ttl_worker *worker, sqlite3_stmt *stmt) {
+	while(is_idle(worker) && !should_stop(worker)) {
+		sqlite3_bind_int64(stmt, 1, time(NULL));
+		sqlite3_bind_int(stmt, 2, worker->options.batch_size);
+		int res = sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+		if(res != SQLITE_DONE || sqlite3_changes(worker->db) < worker->options.batch_size)
+			return; // Errors (most likely SQLITE_BUSY) are retried on the next round
+	}
+}
+
+static void *ttl_worker_main(void *arg) {
+	struct ttl_worker *worker = arg;
+
+	pthread_mutex_lock(&worker->mutex);
+	while(!worker->stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += worker->options.interval_ms / 1000;
+		deadline.tv_nsec += (long) (worker->options.interval_ms % 1000) * 1000000;
+		if(deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while(!worker->stop && pthread_cond_timedwait(&worker->cond, &worker->mutex, &deadline) == 0)
+			;
+
+		for(int i = 0; i < worker->n_tables && !worker->stop && is_idle(worker); i++) {
+			struct ttl_table *table = &worker->tables[i];
+			if((table->stmt == NULL || table->changed) && prepare_table(worker, table) != SQLITE_OK)
+				continue;
+
+			sqlite3_stmt *stmt = table->stmt;
+			pthread_mutex_unlock(&worker->mutex);
+			purge_table(worker, stmt);
+			pthread_mutex_lock(&worker->mutex);
+		}
+	}
+	pthread_mutex_unlock(&worker->mutex);
+
+	return NULL;
+}
+
+int ttl_worker_start(struct ttl_worker **out, sqlite3 *db, const struct ttl_options *options, int (*setup)(sqlite3 *db, void *ctx), void *setup_ctx) {
+	*out = NULL;
+
+	const char *path = sqlite3_db_filename(db, "main");
+	if(path == NULL || *path == '\0') // In-memory and temporary databases cannot be shared with another connection
+		return SQLITE_MISUSE;
+
+	sqlite3_vfs *vfs = NULL;
+	sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs);
+
+	struct ttl_worker *worker = calloc(1, sizeof(struct ttl_worker));
+	if(worker == NULL)
+		return SQLITE_NOMEM;
+	worker->options = *options;
+	worker->last_activity_ms = monotonic_ms();
+
+	int err = sqlite3_open_v2(path, &worker->db, SQLITE_OPEN_READWRITE, vfs ? vfs->zName : NULL);
+	if(err == SQLITE_OK) {
+		sqlite3_busy_timeout(worker->db, 50); // Losing a lock race only postpones the purge
+		if(setup != NULL)
+			err = setup(worker->db, setup_ctx);
+	}
+	if(err != SQLITE_OK) {
+		sqlite3_close(worker->db);
+		free(worker);
+		return err;
+	}
+
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&worker->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	pthread_mutex_init(&worker->mutex, NULL);
+
+	if(pthread_create(&worker->thread, NULL, ttl_worker_main, worker) != 0) {
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->mutex);
+		sqlite3_close(worker->db);
+		free(worker);
+		return SQLITE_ERROR;
+	}
+
+	*out = worker;
+	return SQLITE_OK;
+}
+
+static char *copy_str(const char *str) {
+	size_t len = strlen(str) + 1;
+	char *copy = malloc(len);
+	if(copy != NULL)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+int ttl_worker_add(struct ttl_worker *worker, const char *table, const char *column) {
+	char *column_copy = copy_str(column);
+	if(column_copy == NULL)
+		return SQLITE_NOMEM;
+
+	pthread_mutex_lock(&worker->mutex);
+
+	for(int i = 0; i < worker->n_tables; i++) {
+		if(strcmp(worker->tables[i].table, table) == 0) {
+			free(worker->tables[i].column);
+			worker->tables[i].column = column_copy;
+			worker->tables[i].changed = true;
+			pthread_mutex_unlock(&worker->mutex);
+			return SQLITE_OK;
+		}
+	}
+
+	int err = SQLITE_OK;
+	char *table_copy = copy_str(table);
+	if(table_copy == NULL)
+		err = SQLITE_NOMEM;
+
+	if(err == SQLITE_OK && worker->n_tables == worker->tables_cap) {
+		int new_cap = worker->tables_cap ? worker->tables_cap * 2 : 4;
+		struct ttl_table *new_tables = realloc(worker->tables, sizeof(struct ttl_table) * new_cap);
+		if(new_tables == NULL)
+			err = SQLITE_NOMEM;
+		else {
+			worker->tables = new_tables;
+			worker->tables_cap = new_cap;
+		}
+	}
+
+	if(err == SQLITE_OK)
+		worker->tables[worker->n_tables++] = (struct ttl_table) { table_copy, column_copy, NULL, true };
+	else {
+		free(table_copy);
+		free(column_copy);
+	}
+
+	pthread_mutex_unlock(&worker->mutex);
+	return err;
+}
+
+void ttl_worker_touch(struct ttl_worker *worker) {
+	__atomic_store_n(&worker->last_activity_ms, monotonic_ms(), __ATOMIC_RELAXED);
+}
+
+void ttl_worker_stop(struct ttl_worker *worker) {
+	pthread_mutex_lock(&worker->mutex);
+	__atomic_store_n(&worker->stop, true, __ATOMIC_RELAXED);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+	pthread_join(worker->thread, NULL);
+
+	for(int i = 0; i < worker->n_tables; i++) {
+		sqlite3_finalize(worker->tables[i].stmt);
+		free(worker->tables[i].table);
+		free(worker->tables[i].column);
+	}
+	free(worker->tables);
+	sqlite3_close(worker->db);
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->mutex);
+	free(worker);
+}
@@ -0,0 +1,30 @@
+#ifndef TTL_WORKER_H_INCLUDED
+#define TTL_WORKER_H_INCLUDED
+
+#include <sqlite3.h>
+
+// A background thread with a connection of its own that deletes expired rows, in small batches,
+// from the tables registered with it. It only purges while the owning connection has been idle.
+// Expiry columns hold unix timestamps (seconds); the tables must have rowids.
+struct ttl_worker;
+
+struct ttl_options {
+	int batch_size; // Rows per DELETE (each one its own transaction)
+	int interval_ms; // Time between checks for expired rows
+	int idle_ms; // How long the owning connection must have been unused before purging
+};
+
+// Opens a new connection to the same file (and VFS) as db, calls setup(conn, setup_ctx) (if not NULL) on it
+// and starts the thread
+int ttl_worker_start(struct ttl_worker **out, sqlite3 *db, const struct ttl_options *options, int (*setup)(sqlite3 *db, void *ctx), void *setup_ctx);
+
+// Registers (or, if already registered, updates) a table; may be called while the worker runs
+int ttl_worker_add(struct ttl_worker *worker, const char *table, const char *column);
+
+// Called on every use of the owning connection
+void ttl_worker_touch(struct ttl_worker *worker);
+
+// Stops and joins the thread and frees the worker
+void ttl_worker_stop(struct ttl_worker *worker);
+
+#endif
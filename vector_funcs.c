@@ -0,0 +1,398 @@
+#include "vector_funcs.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define VECTOR_X86
+	#include <immintrin.h>
+#endif
+
+// https://www.sqlite.org/appfunc.html
+
+struct cosine_parts {
+	float dot, norm_a, norm_b;
+};
+
+struct vector_kernels {
+	float (*dot)(const unsigned char *a, const unsigned char *b, size_t n);
+	float (*l2sq)(const unsigned char *a, const unsigned char *b, size_t n);
+	struct cosine_parts (*cosine)(const unsigned char *a, const unsigned char *b, size_t n);
+};
+
+// BLOB contents have no alignment guarantees, so every kernel uses unaligned loads
+static float load_float(const unsigned char *p) {
+	float f;
+	memcpy(&f, p, sizeof(f));
+	return f;
+}
+
+static float scalar_dot(const unsigned char *a, const unsigned char *b, size_t n) {
+	float sum = 0;
+	for(size_t i = 0; i < n; i++)
+		sum += load_float(a + i * 4) * load_float(b + i * 4);
+	return sum;
+}
+
+static float scalar_l2sq(const unsigned char *a, const unsigned char *b, size_t n) {
+	float sum = 0;
+	for(size_t i = 0; i < n; i++) {
+		float d = load_float(a + i * 4) - load_float(b + i * 4);
+		sum += d * d;
+	}
+	return sum;
+}
+
+static struct cosine_parts scalar_cosine(const unsigned char *a, const unsigned char *b, size_t n) {
+	struct cosine_parts res = { 0, 0, 0 };
+	for(size_t i = 0; i < n; i++) {
+		float x = load_float(a + i * 4), y = load_float(b + i * 4);
+		res.dot += x * y;
+		res.norm_a += x * x;
+		res.norm_b += y * y;
+	}
+	return res;
+}
+
+static const struct vector_kernels scalar_kernels = { scalar_dot, scalar_l2sq, scalar_cosine };
+
+#ifdef VECTOR_X86
+
+__attribute__((target("sse2"))) static float sse_hsum(__m128 v) {
+	__m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+	__m128 sums = _mm_add_ps(v, shuf);
+	shuf = _mm_movehl_ps(shuf, sums);
+	return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+__attribute__((target("sse2"))) static float sse_dot(const unsigned char *a, const unsigned char *b, size_t n) {
+	__m128 acc = _mm_setzero_ps();
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps((const float *) (a + i * 4)), _mm_loadu_ps((const float *) (b + i * 4))));
+	return sse_hsum(acc) + scalar_dot(a + i * 4, b + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static float sse_l2sq(const unsigned char *a, const unsigned char *b, size_t n) {
+	__m128 acc = _mm_setzero_ps();
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128 d = _mm_sub_ps(_mm_loadu_ps((const float *) (a + i * 4)), _mm_loadu_ps((const float *) (b + i * 4)));
+		acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+	}
+	return sse_hsum(acc) + scalar_l2sq(a + i * 4, b + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static struct cosine_parts sse_cosine(const unsigned char *a, const unsigned char *b, size_t n) {
+	__m128 dot = _mm_setzero_ps(), norm_a = _mm_setzero_ps(), norm_b = _mm_setzero_ps();
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps((const float *) (a + i * 4)), y = _mm_loadu_ps((const float *) (b + i * 4));
+		dot = _mm_add_ps(dot, _mm_mul_ps(x, y));
+		norm_a = _mm_add_ps(norm_a, _mm_mul_ps(x, x));
+		norm_b = _mm_add_ps(norm_b, _mm_mul_ps(y, y));
+	}
+	struct cosine_parts res = scalar_cosine(a + i * 4, b + i * 4, n - i);
+	res.dot += sse_hsum(dot);
+	res.norm_a += sse_hsum(norm_a);
+	res.norm_b += sse_hsum(norm_b);
+	return res;
+}
+
+static const struct vector_kernels sse_kernels = { sse_dot, sse_l2sq, sse_cosine };
+
+__attribute__((target("avx2,fma"))) static float avx2_hsum(__m256 v) {
+	__m128 lo = _mm256_castps256_ps128(v), hi = _mm256_extractf128_ps(v, 1);
+	return sse_hsum(_mm_add_ps(lo, hi));
+}
+
+// Two accumulators per sum to hide the FMA latency
+__attribute__((target("avx2,fma"))) static float avx2_dot(const unsigned char *a, const unsigned char *b, size_t n) {
+	__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		acc0 = _mm256_fmadd_ps(_mm256_loadu_ps((const float *) (a + i * 4)), _mm256_loadu_ps((const float *) (b + i * 4)), acc0);
+		acc1 = _mm256_fmadd_ps(_mm256_loadu_ps((const float *) (a + i * 4 + 32)), _mm256_loadu_ps((const float *) (b + i * 4 + 32)), acc1);
+	}
+	for(; i + 8 <= n; i += 8)
+		acc0 = _mm256_fmadd_ps(_mm256_loadu_ps((const float *) (a + i * 4)), _mm256_loadu_ps((const float *) (b + i * 4)), acc0);
+	return avx2_hsum(_mm256_add_ps(acc0, acc1)) + scalar_dot(a + i * 4, b + i * 4, n - i);
+}
+
+__attribute__((target("avx2,fma"))) static float avx2_l2sq(const unsigned char *a, const unsigned char *b, size_t n) {
+	__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps((const float *) (a + i * 4)), _mm256_loadu_ps((const float *) (b + i * 4)));
+		__m256 d1 = _mm256_sub_ps(_mm256_loadu_ps((const float *) (a + i * 4 + 32)), _mm256_loadu_ps((const float *) (b + i * 4 + 32)));
+		acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+		acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+	}
+	for(; i + 8 <= n; i += 8) {
+		__m256 d = _mm256_sub_ps(_mm256_loadu_ps((const float *) (a + i * 4)), _mm256_loadu_ps((const float *) (b + i * 4)));
+		acc0 = _mm256_fmadd_ps(d, d, acc0);
+	}
+	return avx2_hsum(_mm256_add_ps(acc0, acc1)) + scalar_l2sq(a + i * 4, b + i * 4, n - i);
+}
+
+__attribute__((target("avx2,fma"))) static struct cosine_parts avx2_cosine(const unsigned char *a, const unsigned char *b, size_t n) {
+	__m256 dot = _mm256_setzero_ps(), norm_a = _mm256_setzero_ps(), norm_b = _mm256_setzero_ps();
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_loadu_ps((const float *) (a + i * 4)), y = _mm256_loadu_ps((const float *) (b + i * 4));
+		dot = _mm256_fmadd_ps(x, y, dot);
+		norm_a = _mm256_fmadd_ps(x, x, norm_a);
+		norm_b = _mm256_fmadd_ps(y, y, norm_b);
+	}
+	struct cosine_parts res = scalar_cosine(a + i * 4, b + i * 4, n - i);
+	res.dot += avx2_hsum(dot);
+	res.norm_a += avx2_hsum(norm_a);
+	res.norm_b += avx2_hsum(norm_b);
+	return res;
+}
+
+static const struct vector_kernels avx2_kernels = { avx2_dot, avx2_l2sq, avx2_cosine };
+
+#endif
+
+static const struct vector_kernels *kernels = NULL;
+
+static const struct vector_kernels *select_kernels(void) {
+	#ifdef VECTOR_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return &avx2_kernels;
+	if(__builtin_cpu_supports("sse2"))
+		return &sse_kernels;
+	#endif
+	return &scalar_kernels;
+}
+
+// Fetches both arguments as vectors; reports an error and returns false if they are not equally sized float32 blobs
+static bool get_vector_args(sqlite3_context *ctx, sqlite3_value **argv, const unsigned char **a, const unsigned char **b, size_t *n) {
+	for(int i = 0; i < 2; i++) {
+		int type = sqlite3_value_type(argv[i]);
+		if(type == SQLITE_NULL) {
+			sqlite3_result_null(ctx);
+			return false;
+		}
+		if(type != SQLITE_BLOB) {
+			sqlite3_result_error(ctx, "Expected vector (float32 blob)", -1);
+			return false;
+		}
+	}
+
+	*a = sqlite3_value_blob(argv[0]);
+	*b = sqlite3_value_blob(argv[1]);
+	int len_a = sqlite3_value_bytes(argv[0]), len_b = sqlite3_value_bytes(argv[1]);
+	if(len_a != len_b || len_a % 4 != 0) {
+		sqlite3_result_error(ctx, "Vectors must be float32 blobs of the same length", -1);
+		return false;
+	}
+	*n = len_a / 4;
+	return true;
+}
+
+static void vec_dot_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	(void) argc;
+	const unsigned char *a, *b;
+	size_t n;
+	if(get_vector_args(ctx, argv, &a, &b, &n))
+		sqlite3_result_double(ctx, kernels->dot(a, b, n));
+}
+
+static void vec_l2_distance_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	(void) argc;
+	const unsigned char *a, *b;
+	size_t n;
+	if(get_vector_args(ctx, argv, &a, &b, &n))
+		sqlite3_result_double(ctx, sqrt(kernels->l2sq(a, b, n)));
+}
+
+static void vec_cosine_distance_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	(void) argc;
+	const unsigned char *a, *b;
+	size_t n;
+	if(!get_vector_args(ctx, argv, &a, &b, &n))
+		return;
+
+	struct cosine_parts parts = kernels->cosine(a, b, n);
+	if(parts.norm_a == 0 || parts.norm_b == 0) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	sqlite3_result_double(ctx, 1.0 - parts.dot / (sqrt(parts.norm_a) * sqrt(parts.norm_b)));
+}
+
+struct top_k_entry {
+	double distance;
+	sqlite3_value *id;
+};
+
+// The entries form a max-heap on distance, so the worst of the current k is always at the root
+struct top_k_state {
+	int k;
+	int n;
+	struct top_k_entry *entries;
+};
+
+static void top_k_sift_down(struct top_k_state *state, int i) {
+	for(;;) {
+		int largest = i, l = 2 * i + 1, r = 2 * i + 2;
+		if(l < state->n && state->entries[l].distance > state->entries[largest].distance)
+			largest = l;
+		if(r < state->n && state->entries[r].distance > state->entries[largest].distance)
+			largest = r;
+		if(largest == i)
+			return;
+		struct top_k_entry tmp = state->entries[i];
+		state->entries[i] = state->entries[largest];
+		state->entries[largest] = tmp;
+		i = largest;
+	}
+}
+
+static void top_k_sift_up(struct top_k_state *state, int i) {
+	while(i > 0) {
+		int parent = (i - 1) / 2;
+		if(state->entries[parent].distance >= state->entries[i].distance)
+			return;
+		struct top_k_entry tmp = state->entries[i];
+		state->entries[i] = state->entries[parent];
+		state->entries[parent] = tmp;
+		i = parent;
+	}
+}
+
+static void vec_top_k_step(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	(void) argc;
+	struct top_k_state *state = sqlite3_aggregate_context(ctx, sizeof(struct top_k_state));
+	if(state == NULL) {
+		sqlite3_result_error_nomem(ctx);
+		return;
+	}
+
+	if(state->entries == NULL) {
+		sqlite3_int64 k = sqlite3_value_int64(argv[0]);
+		if(k <= 0 || k > 100000) {
+			sqlite3_result_error(ctx, "vec_top_k: k must be between 1 and 100000", -1);
+			return;
+		}
+		state->entries = sqlite3_malloc64(sizeof(struct top_k_entry) * k);
+		if(state->entries == NULL) {
+			sqlite3_result_error_nomem(ctx);
+			return;
+		}
+		state->k = k;
+	}
+
+	if(sqlite3_value_type(argv[2]) == SQLITE_NULL)
+		return;
+	double distance = sqlite3_value_double(argv[2]);
+	if(state->n == state->k && distance >= state->entries[0].distance)
+		return;
+
+	sqlite3_value *id = sqlite3_value_dup(argv[1]);
+	if(id == NULL) {
+		sqlite3_result_error_nomem(ctx);
+		return;
+	}
+
+	if(state->n < state->k) {
+		state->entries[state->n] = (struct top_k_entry) { distance, id };
+		top_k_sift_up(state, state->n++);
+	} else {
+		sqlite3_value_free(state->entries[0].id);
+		state->entries[0] = (struct top_k_entry) { distance, id };
+		top_k_sift_down(state, 0);
+	}
+}
+
+static void append_json_value(sqlite3_str *str, sqlite3_value *val) {
+	switch(sqlite3_value_type(val)) {
+		case SQLITE_INTEGER:
+			sqlite3_str_appendf(str, "%lld", sqlite3_value_int64(val));
+			break;
+		case SQLITE_FLOAT:
+			sqlite3_str_appendf(str, "%!.15g", sqlite3_value_double(val));
+			break;
+		case SQLITE_NULL:
+			sqlite3_str_appendall(str, "null");
+			break;
+		default: {
+			const unsigned char *text = sqlite3_value_text(val);
+			sqlite3_str_appendchar(str, 1, '"');
+			for(; text != NULL && *text; text++) {
+				if(*text == '"' || *text == '\\')
+					sqlite3_str_appendf(str, "\\%c", *text);
+				else if(*text < 0x20)
+					sqlite3_str_appendf(str, "\\u%04x", *text);
+				else
+					sqlite3_str_appendchar(str, 1, *text);
+			}
+			sqlite3_str_appendchar(str, 1, '"');
+		} break;
+	}
+}
+
+static void vec_top_k_final(sqlite3_context *ctx) {
+	struct top_k_state *state = sqlite3_aggregate_context(ctx, 0);
+	if(state == NULL || state->entries == NULL) {
+		sqlite3_result_text(ctx, "[]", -1, SQLITE_STATIC);
+		return;
+	}
+
+	// Popping the max-heap yields the entries farthest first; fill the output order from the back
+	int n = state->n;
+	struct top_k_entry *sorted = sqlite3_malloc64(sizeof(struct top_k_entry) * (n ? n : 1));
+	if(sorted == NULL) {
+		for(int i = 0; i < n; i++)
+			sqlite3_value_free(state->entries[i].id);
+		sqlite3_free(state->entries);
+		sqlite3_result_error_nomem(ctx);
+		return;
+	}
+	for(int i = n - 1; i >= 0; i--) {
+		sorted[i] = state->entries[0];
+		state->entries[0] = state->entries[--state->n];
+		top_k_sift_down(state, 0);
+	}
+
+	sqlite3_str *str = sqlite3_str_new(NULL);
+	sqlite3_str_appendchar(str, 1, '[');
+	for(int i = 0; i < n; i++) {
+		if(i != 0)
+			sqlite3_str_appendchar(str, 1, ',');
+		append_json_value(str, sorted[i].id);
+		sqlite3_value_free(sorted[i].id);
+	}
+	sqlite3_str_appendchar(str, 1, ']');
+
+	sqlite3_free(sorted);
+	sqlite3_free(state->entries);
+
+	int len = sqlite3_str_length(str);
+	char *json = sqlite3_str_finish(str);
+	if(json == NULL) {
+		sqlite3_result_error_nomem(ctx);
+		return;
+	}
+	sqlite3_result_text(ctx, json, len, sqlite3_free);
+}
+
+int register_vector_functions(sqlite3 *db) {
+	if(kernels == NULL)
+		kernels = select_kernels();
+
+	const int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS;
+	int err;
+	if( (err = sqlite3_create_function(db, "vec_dot", 2, flags, NULL, vec_dot_func, NULL, NULL)) )
+		return err;
+	if( (err = sqlite3_create_function(db, "vec_cosine_distance", 2, flags, NULL, vec_cosine_distance_func, NULL, NULL)) )
+		return err;
+	if( (err = sqlite3_create_function(db, "vec_l2_distance", 2, flags, NULL, vec_l2_distance_func, NULL, NULL)) )
+		return err;
+	return sqlite3_create_function(db, "vec_top_k", 3, flags, NULL, NULL, vec_top_k_step, vec_top_k_final);
+}
@@ -0,0 +1,13 @@
+#ifndef VECTOR_FUNCS_H_INCLUDED
+#define VECTOR_FUNCS_H_INCLUDED
+
+#include <sqlite3.h>
+
+// Registers SQL functions operating on float32 vectors stored as BLOBs (native byte order):
+//   vec_dot(a, b)               Dot product
+//   vec_cosine_distance(a, b)   1 - cosine similarity
+//   vec_l2_distance(a, b)       Euclidean distance
+//   vec_top_k(k, id, distance)  Aggregate; JSON array of the k ids with the smallest distances, nearest first
+int register_vector_functions(sqlite3 *db);
+
+#endif
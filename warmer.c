@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "warmer.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WARMER_CHUNK_SIZE (1 << 20)
+
+struct warmer {
+	pthread_t thread;
+	char *path; // sqlite3_free
+	sqlite3 *db; // Only for named B-trees
+	char **names;
+	int n_names;
+
+	// Accessed atomically
+	bool stop;
+	int state;
+	uint64_t bytes_read;
+};
+
+static bool should_stop(struct warmer *warmer) {
+	return __atomic_load_n(&warmer->stop, __ATOMIC_RELAXED);
+}
+
+static bool read_file(struct warmer *warmer, const char *path, unsigned char *buf) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return false;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ssize_t n = 0;
+	while(!should_stop(warmer) && (n = read(fd, buf, WARMER_CHUNK_SIZE)) > 0)
+		__atomic_add_fetch(&warmer->bytes_read, n, __ATOMIC_RELAXED);
+	close(fd);
+	return n >= 0 || should_stop(warmer);
+}
+
+static bool warm_file(struct warmer *warmer) {
+	unsigned char *buf = malloc(WARMER_CHUNK_SIZE);
+	if(buf == NULL)
+		return false;
+	bool ok = read_file(warmer, warmer->path, buf);
+
+	char *wal_path = sqlite3_mprintf("%s-wal", warmer->path);
+	if(wal_path != NULL && access(wal_path, F_OK) == 0)
+		ok = read_file(warmer, wal_path, buf) && ok;
+	sqlite3_free(wal_path);
+	free(buf);
+	return ok;
+}
+
+// Counting the entries of a B-tree visits every one of its pages (overflow pages aside)
+static bool warm_btree(struct warmer *warmer, const char *name) {
+	sqlite3_stmt *stmt;
+	int err = sqlite3_prepare_v2(warmer->db, "SELECT type, tbl_name FROM sqlite_master WHERE name = ?1 AND type IN ('table', 'index')", -1, &stmt, NULL);
+	if(err)
+		return false;
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	char *sql = NULL;
+	if(sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *type = (const char *) sqlite3_column_text(stmt, 0);
+		const char *table = (const char *) sqlite3_column_text(stmt, 1);
+		if(strcmp(type, "table") == 0)
+			sql = sqlite3_mprintf("SELECT count(*) FROM \"%w\" NOT INDEXED", table);
+		else
+			sql = sqlite3_mprintf("SELECT count(*) FROM \"%w\" INDEXED BY \"%w\"", table, name);
+	}
+	sqlite3_finalize(stmt);
+	if(sql == NULL)
+		return false;
+
+	err = sqlite3_prepare_v2(warmer->db, sql, -1, &stmt, NULL);
+	sqlite3_free(sql);
+	if(err)
+		return false;
+	err = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	return err == SQLITE_ROW;
+}
+
+// Pages read from the file by the warmer's connection so far, in bytes
+static void note_pages_read(struct warmer *warmer, int page_size) {
+	int misses = 0, highwater;
+	sqlite3_db_status(warmer->db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &highwater, false);
+	__atomic_store_n(&warmer->bytes_read, (uint64_t) misses * page_size, __ATOMIC_RELAXED);
+}
+
+static bool warm_btrees(struct warmer *warmer) {
+	int page_size = 0;
+	sqlite3_stmt *stmt;
+	if(sqlite3_prepare_v2(warmer->db, "PRAGMA page_size", -1, &stmt, NULL) == SQLITE_OK) {
+		if(sqlite3_step(stmt) == SQLITE_ROW)
+			page_size = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+
+	bool ok = true;
+	for(int i = 0; i < warmer->n_names && !should_stop(warmer); i++) {
+		ok = warm_btree(warmer, warmer->names[i]) && ok;
+		note_pages_read(warmer, page_size);
+	}
+	return ok;
+}
+
+static void *warmer_main(void *arg) {
+	struct warmer *warmer = arg;
+	bool ok = warmer->db == NULL ? warm_file(warmer) : warm_btrees(warmer);
+	__atomic_store_n(&warmer->state, ok || should_stop(warmer) ? WARMER_DONE : WARMER_FAILED, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void free_warmer(struct warmer *warmer) {
+	for(int i = 0; warmer->names != NULL && i < warmer->n_names; i++)
+		sqlite3_free(warmer->names[i]);
+	free(warmer->names);
+	sqlite3_close(warmer->db);
+	sqlite3_free(warmer->path);
+	free(warmer);
+}
+
+int warmer_start(struct warmer **out, sqlite3 *db, const char *const *names, int n_names, int (*setup)(sqlite3 *db, void *ctx), void *setup_ctx) {
+	*out = NULL;
+	const char *path = sqlite3_db_filename(db, "main");
+	if(path == NULL || *path == '\0')
+		return SQLITE_MISUSE;
+
+	struct warmer *warmer = calloc(1, sizeof(struct warmer));
+	if(warmer == NULL)
+		return SQLITE_NOMEM;
+	warmer->state = WARMER_RUNNING;
+	warmer->path = sqlite3_mprintf("%s", path);
+	int err = warmer->path ? SQLITE_OK : SQLITE_NOMEM;
+
+	if(!err && n_names != 0) {
+		warmer->names = calloc(n_names, sizeof(char *));
+		err = warmer->names ? SQLITE_OK : SQLITE_NOMEM;
+		for(int i = 0; i < n_names && !err; i++) {
+			warmer->names[i] = sqlite3_mprintf("%s", names[i]);
+			warmer->n_names++;
+			err = warmer->names[i] ? SQLITE_OK : SQLITE_NOMEM;
+		}
+
+		sqlite3_vfs *vfs = NULL;
+		sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs);
+		if(!err)
+			err = sqlite3_open_v2(path, &warmer->db, SQLITE_OPEN_READONLY, vfs ? vfs->zName : NULL);
+		if(!err)
+			sqlite3_busy_timeout(warmer->db, 1000);
+		if(!err && setup != NULL)
+			err = setup(warmer->db, setup_ctx);
+	}
+
+	if(!err && pthread_create(&warmer->thread, NULL, warmer_main, warmer) != 0)
+		err = SQLITE_ERROR;
+	if(err) {
+		free_warmer(warmer);
+		return err;
+	}
+	*out = warmer;
+	return SQLITE_OK;
+}
+
+enum warmer_state warmer_state(const struct warmer *warmer, uint64_t *bytes_read) {
+	*bytes_read = __atomic_load_n(&warmer->bytes_read, __ATOMIC_RELAXED);
+	return __atomic_load_n(&warmer->state, __ATOMIC_ACQUIRE);
+}
+
+void warmer_stop(struct warmer *warmer) {
+	__atomic_store_n(&warmer->stop, true, __ATOMIC_RELAXED);
+	if(warmer->db != NULL)
+		sqlite3_interrupt(warmer->db);
+	pthread_join(warmer->thread, NULL);
+	free_warmer(warmer);
+}
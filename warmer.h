@@ -0,0 +1,30 @@
+#ifndef WARMER_H_INCLUDED
+#define WARMER_H_INCLUDED
+
+#include <sqlite3.h>
+
+#include <stdint.h>
+
+// Reads a database into the OS page cache on a background thread, so that the first queries after a
+// restart find their pages in memory instead of faulting them in one random read at a time.
+// Either the whole file (and its WAL) is read sequentially, or only the B-trees of the named tables and
+// indexes, through a connection of the warmer's own.
+struct warmer;
+
+enum warmer_state {
+	WARMER_RUNNING,
+	WARMER_DONE,
+	WARMER_FAILED
+};
+
+// names may be NULL (n_names 0) to read the whole file; the names are copied. setup(conn, setup_ctx) (if not NULL)
+// is called on the warmer's connection, which is only opened for named tables and indexes.
+// Returns SQLITE_MISUSE for in-memory and temporary databases.
+int warmer_start(struct warmer **out, sqlite3 *db, const char *const *names, int n_names, int (*setup)(sqlite3 *db, void *ctx), void *setup_ctx);
+
+enum warmer_state warmer_state(const struct warmer *warmer, uint64_t *bytes_read);
+
+// Cancels the warm-up if it is still running, joins the thread and frees the warmer
+void warmer_stop(struct warmer *warmer);
+
+#endif
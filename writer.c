@@ -0,0 +1,334 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "writer.h"
+#include "file_key.h"
+#include "stmt_cache.h"
+#include "completion.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WRITER_MAX_BATCH 256 // Writes per transaction
+#define WRITER_BUSY_TIMEOUT_MS 5000 // Only other processes can hold the lock
+
+// Intrusive multi-producer, single-consumer queue (Dmitry Vyukov's design): producers only do an atomic
+// exchange on head; the consumer owns tail. The stub node keeps the queue from ever being empty.
+struct mpsc_queue {
+	struct writer_node *head;
+	struct writer_node *tail;
+	struct writer_node stub;
+};
+
+static void mpsc_init(struct mpsc_queue *q) {
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static void mpsc_push(struct mpsc_queue *q, struct writer_node *node) {
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	struct writer_node *prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+// Returns NULL if the queue is empty or a push is only half done
+static struct writer_node *mpsc_pop(struct mpsc_queue *q) {
+	struct writer_node *tail = q->tail;
+	struct writer_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if(tail == &q->stub) {
+		if(next == NULL)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if(next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	if(tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if(next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+struct writer {
+	struct writer *next_writer; // Registry list, protected by registry_mutex
+	char *key;
+	int refs;
+
+	pthread_t thread;
+	sqlite3 *db;
+	struct stmt_cache stmts;
+	struct mpsc_queue queue;
+	sem_t pending; // Posted once per queued request
+	bool stop; // Accessed atomically
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct writer *registry = NULL;
+
+void native_value_free(struct native_value *val) {
+	free(val->data);
+	val->data = NULL;
+}
+
+int native_value_bind(sqlite3_stmt *stmt, int i, const struct native_value *val) {
+	switch(val->type) {
+		case SQLITE_INTEGER:
+			return sqlite3_bind_int64(stmt, i, val->i);
+		case SQLITE_FLOAT:
+			return sqlite3_bind_double(stmt, i, val->f);
+		case SQLITE_TEXT:
+			return sqlite3_bind_text64(stmt, i, val->data, val->len, SQLITE_STATIC, SQLITE_UTF8);
+		case SQLITE_BLOB:
+			return sqlite3_bind_blob64(stmt, i, val->data, val->len, SQLITE_STATIC);
+		default:
+			return sqlite3_bind_null(stmt, i);
+	}
+}
+
+bool native_value_from_column(sqlite3_stmt *stmt, int i, struct native_value *out) {
+	memset(out, 0, sizeof(struct native_value));
+	out->type = sqlite3_column_type(stmt, i);
+	switch(out->type) {
+		case SQLITE_INTEGER:
+			out->i = sqlite3_column_int64(stmt, i);
+			out->f = (double) out->i;
+			return true;
+		case SQLITE_FLOAT:
+			out->f = sqlite3_column_double(stmt, i);
+			return true;
+		case SQLITE_TEXT:
+		case SQLITE_BLOB: {
+			const void *data = sqlite3_column_blob(stmt, i);
+			out->len = sqlite3_column_bytes(stmt, i);
+			out->data = malloc(out->len ? out->len : 1);
+			if(out->data == NULL)
+				return false;
+			if(out->len != 0)
+				memcpy(out->data, data, out->len);
+			return true;
+		}
+		default:
+			return true;
+	}
+}
+
+static void set_error(struct writer *writer, struct write_request *req, int err) {
+	req->err = err;
+	snprintf(req->err_msg, sizeof(req->err_msg), "%s", err == sqlite3_errcode(writer->db) ? sqlite3_errmsg(writer->db) : sqlite3_errstr(err));
+}
+
+static void run_request(struct writer *writer, struct write_request *req) {
+	sqlite3_stmt *stmt = NULL;
+	int err = sqlite3_exec(writer->db, "SAVEPOINT beryl_writer", NULL, NULL, NULL);
+	if(!err)
+		err = stmt_cache_get(&writer->stmts, writer->db, req->sql, req->sql_len, &stmt);
+	for(int i = 0; i < req->n_params && !err; i++)
+		err = native_value_bind(stmt, i + 1, &req->params[i]);
+	if(!err) {
+		while( (err = sqlite3_step(stmt)) == SQLITE_ROW )
+			;
+		if(err == SQLITE_DONE)
+			err = SQLITE_OK;
+	}
+
+	if(err)
+		set_error(writer, req, err);
+	else {
+		req->err = SQLITE_OK;
+		req->changes = sqlite3_changes64(writer->db);
+		req->last_insert_rowid = sqlite3_last_insert_rowid(writer->db);
+	}
+	if(stmt != NULL)
+		sqlite3_reset(stmt);
+
+	if(err)
+		sqlite3_exec(writer->db, "ROLLBACK TO beryl_writer", NULL, NULL, NULL);
+	sqlite3_exec(writer->db, "RELEASE beryl_writer", NULL, NULL, NULL);
+}
+
+// Takes one queued request, for which a pending count must have been consumed
+static struct write_request *take_request(struct writer *writer) {
+	struct writer_node *node;
+	while( (node = mpsc_pop(&writer->queue)) == NULL )
+		sched_yield(); // A producer is between its exchange and its link
+	return (struct write_request *) node;
+}
+
+static void run_batch(struct writer *writer, struct write_request **batch, int n) {
+	int err = sqlite3_exec(writer->db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+	for(int i = 0; i < n; i++) {
+		if(err)
+			set_error(writer, batch[i], err);
+		else
+			run_request(writer, batch[i]);
+	}
+
+	if(!err) {
+		err = sqlite3_exec(writer->db, "COMMIT", NULL, NULL, NULL);
+		if(err) {
+			for(int i = 0; i < n; i++) {
+				if(batch[i]->err == SQLITE_OK)
+					set_error(writer, batch[i], err);
+			}
+			sqlite3_exec(writer->db, "ROLLBACK", NULL, NULL, NULL);
+		}
+	}
+
+	for(int i = 0; i < n; i++) {
+		if(batch[i]->notify != NULL)
+			completion_queue_push(batch[i]->notify, &batch[i]->node);
+		else
+			sem_post(&batch[i]->done);
+	}
+}
+
+static void *writer_main(void *arg) {
+	struct writer *writer = arg;
+	struct write_request *batch[WRITER_MAX_BATCH];
+
+	for(;;) {
+		while(sem_wait(&writer->pending) != 0)
+			;
+		if(__atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		int n = 0;
+		batch[n++] = take_request(writer);
+		while(n < WRITER_MAX_BATCH && sem_trywait(&writer->pending) == 0) {
+			if(__atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE)) {
+				sem_post(&writer->pending); // Seen again by the outer loop, after this batch
+				break;
+			}
+			batch[n++] = take_request(writer);
+		}
+		run_batch(writer, batch, n);
+	}
+	return NULL;
+}
+
+static char *writer_key(sqlite3 *db) {
+	sqlite3_vfs *vfs = NULL;
+	sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs);
+	return file_key(sqlite3_db_filename(db, "main"), vfs ? vfs->zName : NULL);
+}
+
+static int writer_start(struct writer **out, sqlite3 *db, char *key, int (*setup)(sqlite3 *db, void *ctx), void *setup_ctx) {
+	struct writer *writer = calloc(1, sizeof(struct writer));
+	if(writer == NULL)
+		return SQLITE_NOMEM;
+
+	sqlite3_vfs *vfs = NULL;
+	sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs);
+	int err = sqlite3_open_v2(sqlite3_db_filename(db, "main"), &writer->db, SQLITE_OPEN_READWRITE, vfs ? vfs->zName : NULL);
+	if(!err) {
+		sqlite3_busy_timeout(writer->db, WRITER_BUSY_TIMEOUT_MS);
+		if(setup != NULL)
+			err = setup(writer->db, setup_ctx);
+	}
+	if(err) {
+		sqlite3_close(writer->db);
+		free(writer);
+		return err;
+	}
+
+	stmt_cache_init(&writer->stmts, 64);
+	mpsc_init(&writer->queue);
+	sem_init(&writer->pending, 0, 0);
+	writer->key = key;
+	writer->refs = 1;
+
+	if(pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+		sem_destroy(&writer->pending);
+		sqlite3_close(writer->db);
+		free(writer);
+		return SQLITE_ERROR;
+	}
+	*out = writer;
+	return SQLITE_OK;
+}
+
+int writer_acquire(struct writer **out, sqlite3 *db, int (*setup)(sqlite3 *db, void *ctx), void *setup_ctx) {
+	*out = NULL;
+	const char *path = sqlite3_db_filename(db, "main");
+	if(path == NULL || *path == '\0') // In-memory and temporary databases cannot be shared with another connection
+		return SQLITE_MISUSE;
+	char *key = writer_key(db);
+	if(key == NULL)
+		return SQLITE_NOMEM;
+
+	pthread_mutex_lock(&registry_mutex);
+	for(struct writer *writer = registry; writer != NULL; writer = writer->next_writer) {
+		if(strcmp(writer->key, key) == 0) {
+			writer->refs++;
+			*out = writer;
+			break;
+		}
+	}
+
+	int err = SQLITE_OK;
+	if(*out == NULL) {
+		err = writer_start(out, db, key, setup, setup_ctx);
+		if(!err) {
+			(*out)->next_writer = registry;
+			registry = *out;
+			key = NULL; // Owned by the writer
+		}
+	}
+	pthread_mutex_unlock(&registry_mutex);
+
+	sqlite3_free(key);
+	return err;
+}
+
+void writer_release(struct writer *writer) {
+	pthread_mutex_lock(&registry_mutex);
+	bool last = --writer->refs == 0;
+	if(last) {
+		for(struct writer **link = &registry; *link != NULL; link = &(*link)->next_writer) {
+			if(*link == writer) {
+				*link = writer->next_writer;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&registry_mutex);
+	if(!last)
+		return;
+
+	// Nothing can be queued anymore, as the last reference is gone
+	__atomic_store_n(&writer->stop, true, __ATOMIC_RELEASE);
+	sem_post(&writer->pending);
+	pthread_join(writer->thread, NULL);
+
+	stmt_cache_free(&writer->stmts);
+	sqlite3_close(writer->db);
+	sem_destroy(&writer->pending);
+	sqlite3_free(writer->key);
+	free(writer);
+}
+
+void writer_submit(struct writer *writer, struct write_request *req) {
+	mpsc_push(&writer->queue, &req->node);
+	sem_post(&writer->pending);
+}
+
+void writer_execute(struct writer *writer, struct write_request *req) {
+	req->notify = NULL;
+	sem_init(&req->done, 0, 0);
+	writer_submit(writer, req);
+	while(sem_wait(&req->done) != 0)
+		;
+	sem_destroy(&req->done);
+}
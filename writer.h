@@ -0,0 +1,64 @@
+#ifndef WRITER_H_INCLUDED
+#define WRITER_H_INCLUDED
+
+#include <sqlite3.h>
+
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// One writer thread per database file in the process, owning the only connection that writes to it.
+// Any thread may submit writes through a lock-free multi-producer queue; the writer drains whatever
+// has queued up and runs it in a single transaction (each write in a savepoint of its own),
+// so concurrent writers never contend for the database lock and share their commits.
+
+// Parameter values, copied out of the interpreter so that they can cross threads
+struct native_value {
+	int type; // SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT or SQLITE_BLOB
+	sqlite3_int64 i;
+	double f;
+	void *data; // Text and blobs (owned)
+	size_t len;
+};
+
+void native_value_free(struct native_value *val);
+int native_value_bind(sqlite3_stmt *stmt, int i, const struct native_value *val); // Binds without copying
+bool native_value_from_column(sqlite3_stmt *stmt, int i, struct native_value *out); // Returns false if out of memory
+
+struct writer_node {
+	struct writer_node *next;
+};
+
+struct completion_queue;
+
+struct write_request {
+	struct writer_node node; // Must come first
+	const char *sql;
+	int sql_len;
+	const struct native_value *params;
+	int n_params;
+	struct completion_queue *notify; // Set for writer_submit; the request is pushed there instead of posting done
+
+	// Results, valid once done has been posted (or the request has been pushed to notify)
+	int err;
+	char err_msg[256];
+	sqlite3_int64 changes, last_insert_rowid;
+	sem_t done;
+};
+
+struct writer;
+
+// Finds the writer of db's main database file (by real path and VFS) or starts one, calling setup(db, setup_ctx)
+// (if not NULL) on the writer's new connection; writers are reference counted. Returns SQLITE_MISUSE for in-memory and
+// temporary databases.
+int writer_acquire(struct writer **out, sqlite3 *db, int (*setup)(sqlite3 *db, void *ctx), void *setup_ctx);
+void writer_release(struct writer *writer);
+
+// Initializes the request's semaphore, queues the request and waits until it has been committed (or has failed)
+void writer_execute(struct writer *writer, struct write_request *req);
+
+// Queues the request without waiting; it is pushed to req->notify once committed (or failed), and must stay
+// valid until then. The writer must not be released while requests are outstanding.
+void writer_submit(struct writer *writer, struct write_request *req);
+
+#endif
@@ -0,0 +1,965 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "zpage_vfs.h"
+
+#include <sqlite3.h>
+#include <zlib.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// https://www.sqlite.org/vfs.html
+
+#define ZPAGE_MAGIC "BRLZPG01"
+#define ZPAGE_INDEX_MAGIC "BRLZIDX1"
+#define ZPAGE_VERSION 1
+
+#define ZPAGE_HEADER_SIZE 64 // Compressed blocks start after this many bytes
+#define ZPAGE_GENERATION_OFFSET 16
+
+#define ZPAGE_INDEX_HEADER_SIZE 32
+#define ZPAGE_INDEX_ENTRY_SIZE 16
+
+#define ZPAGE_DEFAULT_BLOCK_SIZE 4096
+#define ZPAGE_SLOT_ALIGN 256 // Slots are rounded up so that a slightly larger rewrite can still happen in place
+#define ZPAGE_LEVEL 6
+
+struct zpage_block {
+	uint64_t offset; // 0 if the block has never been written; reads as zeroes
+	uint32_t len; // A length equal to the block size means the block is stored uncompressed
+	uint32_t cap;
+	uint32_t epoch; // The entry is only current if this equals zpage_file.epoch; otherwise it is read from the index file
+	bool dirty; // Changed since the index file was last written (and listed in zpage_file.dirty)
+};
+
+struct zpage_extent {
+	uint64_t offset, len;
+};
+
+// Free slots of one size class, as a stack of offsets
+struct zpage_slots {
+	uint64_t *offsets;
+	size_t n, cap;
+};
+
+struct zpage_file {
+	sqlite3_file base;
+	sqlite3_file *real; // Points just past this struct, see zpage_vfs.szOsFile
+
+	char *index_path;
+	int index_fd; // -1 while the index file does not exist (the first flush creates it)
+	uint64_t index_n_blocks; // Entries in the index file, as of the last load or flush
+
+	uint32_t block_size; // 0 until the first write to an empty file
+	uint64_t logical_size;
+	uint64_t data_end; // Covers every slot, as slots appended at the end are written in full
+	uint64_t generation; // Bumped whenever the index file is rewritten, so that other connections know to reload it
+	uint32_t epoch; // Bumped when another connection has changed the index, which makes every entry stale
+
+	struct zpage_block *blocks;
+	uint64_t n_blocks, blocks_cap;
+	bool index_dirty;
+	uint64_t *dirty; // Blocks whose entries have to be written by the next flush
+	size_t n_dirty, dirty_cap;
+
+	// Slots no block uses any more, reused before the file is grown. Slots given up since the last flush are still
+	// referenced by the index file, so they only become free once it has been written. The free slots are found
+	// by scanning the index on the first allocation; when another connection changes the index, they are forgotten
+	// (it may have taken them), so from then on only slots given up by this connection are reused.
+	struct zpage_slots *free; // One stack per multiple of ZPAGE_SLOT_ALIGN up to the block size
+	struct zpage_extent *pending;
+	size_t n_pending, pending_cap;
+	bool free_scanned;
+
+	int lock;
+
+	unsigned char *block_buf; // Holds the decompressed contents of cache_block
+	unsigned char *zbuf;
+	uLong zbuf_size;
+	uint64_t cache_block;
+	bool cache_valid;
+};
+
+static void put_u32(unsigned char *p, uint32_t v) {
+	for(int i = 0; i < 4; i++)
+		p[i] = (v >> (i * 8)) & 0xFF;
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+	for(int i = 0; i < 8; i++)
+		p[i] = (v >> (i * 8)) & 0xFF;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	uint32_t v = 0;
+	for(int i = 3; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t v = 0;
+	for(int i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static bool valid_block_size(uint64_t size) {
+	return size >= 512 && size <= 65536 && (size & (size - 1)) == 0;
+}
+
+static int read_at(int fd, void *buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+	while(done < len) {
+		ssize_t n = pread(fd, (unsigned char *) buf + done, len - done, offset + done);
+		if(n <= 0)
+			return n == 0 ? SQLITE_CORRUPT : SQLITE_IOERR_READ;
+		done += n;
+	}
+	return SQLITE_OK;
+}
+
+static int write_at(int fd, const void *buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+	while(done < len) {
+		ssize_t n = pwrite(fd, (const unsigned char *) buf + done, len - done, offset + done);
+		if(n <= 0)
+			return SQLITE_IOERR_WRITE;
+		done += n;
+	}
+	return SQLITE_OK;
+}
+
+static int zpage_n_size_classes(const struct zpage_file *p) {
+	return p->block_size / ZPAGE_SLOT_ALIGN + 1;
+}
+
+static int zpage_alloc_buffers(struct zpage_file *p) {
+	p->block_buf = malloc(p->block_size);
+	p->zbuf_size = compressBound(p->block_size);
+	p->zbuf = malloc(p->zbuf_size);
+	p->free = calloc(zpage_n_size_classes(p), sizeof(struct zpage_slots));
+	if(p->block_buf == NULL || p->zbuf == NULL || p->free == NULL)
+		return SQLITE_NOMEM;
+	return SQLITE_OK;
+}
+
+static void zpage_forget_free(struct zpage_file *p) {
+	for(int i = 0; p->free != NULL && i < zpage_n_size_classes(p); i++)
+		p->free[i].n = 0;
+}
+
+static void zpage_free_file(struct zpage_file *p) {
+	if(p->index_fd != -1)
+		close(p->index_fd);
+	for(int i = 0; p->free != NULL && i < zpage_n_size_classes(p); i++)
+		free(p->free[i].offsets);
+	free(p->free);
+	free(p->pending);
+	free(p->dirty);
+	free(p->blocks);
+	free(p->block_buf);
+	free(p->zbuf);
+	sqlite3_free(p->index_path);
+}
+
+// Adds the extent to the free slots, in pieces of at most a block; bytes beyond a multiple of ZPAGE_SLOT_ALIGN
+// are left unused. Running out of memory only means that the space is not reused.
+static void zpage_add_free(struct zpage_file *p, uint64_t offset, uint64_t len) {
+	while(len >= ZPAGE_SLOT_ALIGN) {
+		uint64_t piece = len < p->block_size ? len / ZPAGE_SLOT_ALIGN * ZPAGE_SLOT_ALIGN : p->block_size;
+		struct zpage_slots *slots = &p->free[piece / ZPAGE_SLOT_ALIGN];
+		if(slots->n == slots->cap) {
+			size_t new_cap = slots->cap ? slots->cap * 2 : 16;
+			uint64_t *new_offsets = realloc(slots->offsets, new_cap * sizeof(uint64_t));
+			if(new_offsets == NULL)
+				return;
+			slots->offsets = new_offsets;
+			slots->cap = new_cap;
+		}
+		slots->offsets[slots->n++] = offset;
+		offset += piece;
+		len -= piece;
+	}
+}
+
+// Gives up a slot; it becomes free once the index file no longer refers to it
+static void zpage_release_slot(struct zpage_file *p, uint64_t offset, uint64_t len) {
+	if(p->n_pending == p->pending_cap) {
+		size_t new_cap = p->pending_cap ? p->pending_cap * 2 : 16;
+		struct zpage_extent *new_pending = realloc(p->pending, new_cap * sizeof(struct zpage_extent));
+		if(new_pending == NULL)
+			return; // The slot is not reused
+		p->pending = new_pending;
+		p->pending_cap = new_cap;
+	}
+	p->pending[p->n_pending++] = (struct zpage_extent) { offset, len };
+}
+
+static int zpage_reserve_blocks(struct zpage_file *p, uint64_t n) {
+	if(n <= p->blocks_cap)
+		return SQLITE_OK;
+
+	uint64_t new_cap = p->blocks_cap ? p->blocks_cap : 64;
+	while(new_cap < n)
+		new_cap *= 2;
+
+	struct zpage_block *new_blocks = realloc(p->blocks, new_cap * sizeof(struct zpage_block));
+	if(new_blocks == NULL)
+		return SQLITE_NOMEM;
+	memset(new_blocks + p->blocks_cap, 0, (new_cap - p->blocks_cap) * sizeof(struct zpage_block)); // Epoch 0 is never current
+
+	p->blocks = new_blocks;
+	p->blocks_cap = new_cap;
+	return SQLITE_OK;
+}
+
+static int zpage_mark_dirty(struct zpage_file *p, uint64_t block) {
+	if(p->blocks[block].dirty)
+		return SQLITE_OK;
+	if(p->n_dirty == p->dirty_cap) {
+		size_t new_cap = p->dirty_cap ? p->dirty_cap * 2 : 64;
+		uint64_t *new_dirty = realloc(p->dirty, new_cap * sizeof(uint64_t));
+		if(new_dirty == NULL)
+			return SQLITE_NOMEM;
+		p->dirty = new_dirty;
+		p->dirty_cap = new_cap;
+	}
+	p->dirty[p->n_dirty++] = block;
+	p->blocks[block].dirty = true;
+	p->index_dirty = true;
+	return SQLITE_OK;
+}
+
+// Reads the entries of blocks [first, end) that are not current from the index file
+static int zpage_load_entries(struct zpage_file *p, uint64_t first, uint64_t end) {
+	unsigned char buf[ZPAGE_INDEX_ENTRY_SIZE * 256];
+	uint64_t i = first;
+	while(i < end) {
+		if(p->blocks[i].epoch == p->epoch) {
+			i++;
+			continue;
+		}
+		uint64_t n = end - i < 256 ? end - i : 256;
+		if(p->index_fd == -1 || i + n > p->index_n_blocks)
+			return SQLITE_CORRUPT;
+		int rc = read_at(p->index_fd, buf, n * ZPAGE_INDEX_ENTRY_SIZE, ZPAGE_INDEX_HEADER_SIZE + i * ZPAGE_INDEX_ENTRY_SIZE);
+		if(rc != SQLITE_OK)
+			return rc;
+
+		for(uint64_t j = 0; j < n; j++, i++) {
+			struct zpage_block *entry = &p->blocks[i];
+			if(entry->epoch == p->epoch) // Changed by this connection since
+				continue;
+			const unsigned char *raw = buf + j * ZPAGE_INDEX_ENTRY_SIZE;
+			entry->offset = get_u64(raw);
+			entry->len = get_u32(raw + 8);
+			entry->cap = get_u32(raw + 12);
+			if(entry->len > p->block_size || entry->len > entry->cap)
+				return SQLITE_CORRUPT;
+			entry->epoch = p->epoch;
+			entry->dirty = false;
+		}
+	}
+	return SQLITE_OK;
+}
+
+static int zpage_get_block(struct zpage_file *p, uint64_t block, struct zpage_block **out) {
+	int rc = zpage_load_entries(p, block, block + 1);
+	*out = &p->blocks[block];
+	return rc;
+}
+
+// Grows the file to n blocks; the new ones read as zeroes
+static int zpage_extend(struct zpage_file *p, uint64_t n) {
+	if(n <= p->n_blocks)
+		return SQLITE_OK;
+	int rc = zpage_reserve_blocks(p, n);
+	for(uint64_t i = p->n_blocks; i < n && rc == SQLITE_OK; i++) {
+		p->blocks[i] = (struct zpage_block) { 0, 0, 0, p->epoch, false };
+		if(i + 1 < n) // The index file may hold stale entries past its end after a crash; the last one is written anyway
+			rc = zpage_mark_dirty(p, i);
+	}
+	if(rc == SQLITE_OK)
+		p->n_blocks = n;
+	return rc;
+}
+
+static int compare_extents(const void *a, const void *b) {
+	uint64_t x = ((const struct zpage_extent *) a)->offset, y = ((const struct zpage_extent *) b)->offset;
+	return x < y ? -1 : x > y;
+}
+
+// Finds the space between the slots in use; only needs to be done once, as slots given up later are tracked
+static void zpage_scan_free(struct zpage_file *p) {
+	p->free_scanned = true;
+	if(zpage_load_entries(p, 0, p->n_blocks) != SQLITE_OK)
+		return; // Nothing is reused then
+
+	size_t n_used = p->n_pending;
+	for(uint64_t i = 0; i < p->n_blocks; i++)
+		n_used += p->blocks[i].offset != 0;
+	struct zpage_extent *used = malloc((n_used ? n_used : 1) * sizeof(struct zpage_extent));
+	if(used == NULL)
+		return;
+	size_t n = 0;
+	for(uint64_t i = 0; i < p->n_blocks; i++) {
+		if(p->blocks[i].offset != 0)
+			used[n++] = (struct zpage_extent) { p->blocks[i].offset, p->blocks[i].cap };
+	}
+	if(p->n_pending != 0)
+		memcpy(used + n, p->pending, p->n_pending * sizeof(struct zpage_extent));
+	qsort(used, n_used, sizeof(struct zpage_extent), compare_extents);
+
+	uint64_t pos = ZPAGE_HEADER_SIZE;
+	for(size_t i = 0; i < n_used; i++) {
+		if(used[i].offset > pos)
+			zpage_add_free(p, pos, used[i].offset - pos);
+		if(used[i].offset + used[i].len > pos)
+			pos = used[i].offset + used[i].len;
+	}
+	free(used);
+	if(pos > p->data_end) // Files written before slots at the end were padded out to their full size
+		p->data_end = pos;
+	else
+		zpage_add_free(p, pos, p->data_end - pos);
+}
+
+// Returns the offset of a slot of (at least) cap bytes; *appended tells whether it lies past the end of the file
+static uint64_t zpage_alloc_slot(struct zpage_file *p, uint32_t cap, bool *appended) {
+	if(!p->free_scanned)
+		zpage_scan_free(p);
+
+	*appended = false;
+	for(int c = cap / ZPAGE_SLOT_ALIGN; c < zpage_n_size_classes(p); c++) {
+		struct zpage_slots *slots = &p->free[c];
+		if(slots->n != 0) {
+			uint64_t offset = slots->offsets[--slots->n];
+			zpage_add_free(p, offset + cap, (uint64_t) c * ZPAGE_SLOT_ALIGN - cap);
+			return offset;
+		}
+	}
+
+	*appended = true;
+	uint64_t offset = p->data_end;
+	p->data_end += cap;
+	return offset;
+}
+
+static int zpage_write_header(struct zpage_file *p) {
+	unsigned char header[ZPAGE_HEADER_SIZE] = { 0 };
+	memcpy(header, ZPAGE_MAGIC, 8);
+	put_u32(header + 8, ZPAGE_VERSION);
+	put_u32(header + 12, p->block_size);
+	put_u64(header + ZPAGE_GENERATION_OFFSET, p->generation);
+	return p->real->pMethods->xWrite(p->real, header, sizeof(header), 0);
+}
+
+// Reads the header of the index file; the entries are read when needed
+static int zpage_load_index(struct zpage_file *p) {
+	p->n_blocks = 0;
+	p->index_n_blocks = 0;
+	p->logical_size = 0;
+	p->cache_valid = false;
+
+	if(p->index_fd == -1) {
+		p->index_fd = open(p->index_path, O_RDWR);
+		if(p->index_fd == -1 && errno == EACCES)
+			p->index_fd = open(p->index_path, O_RDONLY);
+	}
+	if(p->index_fd == -1) // A database that has had its header written but never been synced yet
+		return p->data_end > ZPAGE_HEADER_SIZE ? SQLITE_CORRUPT : SQLITE_OK;
+
+	unsigned char header[ZPAGE_INDEX_HEADER_SIZE];
+	struct stat st;
+	if(fstat(p->index_fd, &st) != 0)
+		return SQLITE_IOERR_FSTAT;
+	if(st.st_size < ZPAGE_INDEX_HEADER_SIZE || read_at(p->index_fd, header, sizeof(header), 0) != SQLITE_OK)
+		return SQLITE_CORRUPT;
+
+	uint64_t n_blocks = get_u64(header + 24);
+	if(memcmp(header, ZPAGE_INDEX_MAGIC, 8) != 0 || get_u32(header + 8) != p->block_size || n_blocks > ((uint64_t) st.st_size - ZPAGE_INDEX_HEADER_SIZE) / ZPAGE_INDEX_ENTRY_SIZE)
+		return SQLITE_CORRUPT;
+
+	int rc = zpage_reserve_blocks(p, n_blocks);
+	if(rc != SQLITE_OK)
+		return rc;
+	p->n_blocks = n_blocks;
+	p->index_n_blocks = n_blocks;
+	p->logical_size = get_u64(header + 16);
+	return SQLITE_OK;
+}
+
+static int zpage_sync_dir(const char *path) {
+	const char *slash = strrchr(path, '/');
+	char *dir = slash ? sqlite3_mprintf("%.*s", (int) (slash - path + 1), path) : sqlite3_mprintf(".");
+	if(dir == NULL)
+		return SQLITE_NOMEM;
+	int fd = open(dir, O_RDONLY);
+	sqlite3_free(dir);
+	if(fd == -1)
+		return SQLITE_IOERR_DIR_FSYNC;
+	int rc = fsync(fd) == 0 ? SQLITE_OK : SQLITE_IOERR_DIR_FSYNC;
+	close(fd);
+	return rc;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+// Writes the changed entries into the index file, in runs of consecutive blocks, then its header (so that a crash
+// in between never leaves the header counting entries that were not written), and bumps the generation in the data
+// file header. A torn update is repaired like torn page writes are: by SQLite rolling the journal back.
+static int zpage_flush_index(struct zpage_file *p, bool durable) {
+	bool created = false;
+	if(p->index_fd == -1) {
+		p->index_fd = open(p->index_path, O_RDWR | O_CREAT, 0644);
+		if(p->index_fd == -1)
+			return SQLITE_IOERR_WRITE;
+		created = true;
+	}
+
+	unsigned char buf[ZPAGE_INDEX_ENTRY_SIZE * 256];
+	qsort(p->dirty, p->n_dirty, sizeof(uint64_t), compare_blocks);
+	int rc = SQLITE_OK;
+	size_t i = 0;
+	while(i < p->n_dirty && rc == SQLITE_OK) {
+		uint64_t first = p->dirty[i];
+		if(first >= p->n_blocks) { // Truncated since
+			i++;
+			continue;
+		}
+		size_t n = 0;
+		while(i < p->n_dirty && p->dirty[i] == first + n && first + n < p->n_blocks && n < 256) {
+			const struct zpage_block *entry = &p->blocks[first + n];
+			unsigned char *raw = buf + n * ZPAGE_INDEX_ENTRY_SIZE;
+			put_u64(raw, entry->offset);
+			put_u32(raw + 8, entry->len);
+			put_u32(raw + 12, entry->cap);
+			n++;
+			i++;
+		}
+		while(i < p->n_dirty && p->dirty[i] < first + n) // Listed twice (truncated and extended again)
+			i++;
+		rc = write_at(p->index_fd, buf, n * ZPAGE_INDEX_ENTRY_SIZE, ZPAGE_INDEX_HEADER_SIZE + first * ZPAGE_INDEX_ENTRY_SIZE);
+	}
+
+	unsigned char header[ZPAGE_INDEX_HEADER_SIZE] = { 0 };
+	memcpy(header, ZPAGE_INDEX_MAGIC, 8);
+	put_u32(header + 8, p->block_size);
+	put_u64(header + 16, p->logical_size);
+	put_u64(header + 24, p->n_blocks);
+	if(rc == SQLITE_OK)
+		rc = write_at(p->index_fd, header, sizeof(header), 0);
+	if(rc == SQLITE_OK && p->n_blocks < p->index_n_blocks && ftruncate(p->index_fd, ZPAGE_INDEX_HEADER_SIZE + p->n_blocks * ZPAGE_INDEX_ENTRY_SIZE) != 0)
+		rc = SQLITE_IOERR_TRUNCATE;
+	if(rc == SQLITE_OK && durable && fsync(p->index_fd) != 0)
+		rc = SQLITE_IOERR_FSYNC;
+	if(rc == SQLITE_OK && durable && created)
+		rc = zpage_sync_dir(p->index_path);
+	if(rc != SQLITE_OK)
+		return rc;
+	p->index_n_blocks = p->n_blocks;
+
+	for(size_t j = 0; j < p->n_dirty; j++) {
+		if(p->dirty[j] < p->blocks_cap)
+			p->blocks[p->dirty[j]].dirty = false;
+	}
+	p->n_dirty = 0;
+	for(size_t j = 0; j < p->n_pending; j++) // No longer referenced by the index file
+		zpage_add_free(p, p->pending[j].offset, p->pending[j].len);
+	p->n_pending = 0;
+
+	p->generation++;
+	unsigned char gen[8];
+	put_u64(gen, p->generation);
+	rc = p->real->pMethods->xWrite(p->real, gen, sizeof(gen), ZPAGE_GENERATION_OFFSET);
+	if(rc == SQLITE_OK && durable)
+		rc = p->real->pMethods->xSync(p->real, SQLITE_SYNC_NORMAL);
+	if(rc == SQLITE_OK)
+		p->index_dirty = false;
+	return rc;
+}
+
+static int zpage_real_size(struct zpage_file *p, uint64_t *size) {
+	sqlite3_int64 real_size;
+	int rc = p->real->pMethods->xFileSize(p->real, &real_size);
+	*size = real_size;
+	return rc;
+}
+
+// Reads the data file header and the index header; used on open and whenever another connection has changed the index
+static int zpage_load(struct zpage_file *p) {
+	p->epoch++;
+	zpage_forget_free(p);
+
+	uint64_t real_size;
+	int rc = zpage_real_size(p, &real_size);
+	if(rc != SQLITE_OK)
+		return rc;
+
+	if(real_size == 0) {
+		p->n_blocks = 0;
+		p->logical_size = 0;
+		p->data_end = ZPAGE_HEADER_SIZE;
+		p->cache_valid = false;
+		return SQLITE_OK;
+	}
+
+	unsigned char header[ZPAGE_HEADER_SIZE];
+	if(real_size < ZPAGE_HEADER_SIZE || p->real->pMethods->xRead(p->real, header, sizeof(header), 0) != SQLITE_OK)
+		return SQLITE_NOTADB;
+	if(memcmp(header, ZPAGE_MAGIC, 8) != 0 || get_u32(header + 8) != ZPAGE_VERSION || !valid_block_size(get_u32(header + 12)))
+		return SQLITE_NOTADB;
+
+	uint32_t block_size = get_u32(header + 12);
+	if(p->block_size == 0) {
+		p->block_size = block_size;
+		rc = zpage_alloc_buffers(p);
+		if(rc != SQLITE_OK)
+			return rc;
+	} else if(p->block_size != block_size)
+		return SQLITE_CORRUPT;
+
+	p->generation = get_u64(header + ZPAGE_GENERATION_OFFSET);
+	p->data_end = real_size;
+	return zpage_load_index(p);
+}
+
+static int zpage_check_generation(struct zpage_file *p) {
+	uint64_t real_size;
+	int rc = zpage_real_size(p, &real_size);
+	if(rc != SQLITE_OK)
+		return rc;
+	if(real_size < ZPAGE_HEADER_SIZE)
+		return SQLITE_OK;
+
+	unsigned char gen[8];
+	rc = p->real->pMethods->xRead(p->real, gen, sizeof(gen), ZPAGE_GENERATION_OFFSET);
+	if(rc != SQLITE_OK)
+		return rc;
+
+	if(p->block_size == 0 || get_u64(gen) != p->generation)
+		return zpage_load(p);
+	return SQLITE_OK;
+}
+
+static int zpage_load_block(struct zpage_file *p, uint64_t block) {
+	if(p->cache_valid && p->cache_block == block)
+		return SQLITE_OK;
+
+	p->cache_valid = false;
+	struct zpage_block *entry = NULL;
+	if(block < p->n_blocks) {
+		int rc = zpage_get_block(p, block, &entry);
+		if(rc != SQLITE_OK)
+			return rc;
+	}
+	if(entry == NULL || entry->offset == 0) {
+		memset(p->block_buf, 0, p->block_size);
+	} else {
+		if(entry->len == p->block_size) {
+			if(p->real->pMethods->xRead(p->real, p->block_buf, entry->len, entry->offset) != SQLITE_OK)
+				return SQLITE_IOERR_READ;
+		} else {
+			if(p->real->pMethods->xRead(p->real, p->zbuf, entry->len, entry->offset) != SQLITE_OK)
+				return SQLITE_IOERR_READ;
+
+			uLongf out_len = p->block_size;
+			if(uncompress(p->block_buf, &out_len, p->zbuf, entry->len) != Z_OK || out_len != p->block_size)
+				return SQLITE_CORRUPT;
+		}
+	}
+
+	p->cache_block = block;
+	p->cache_valid = true;
+	return SQLITE_OK;
+}
+
+static int zpage_store_block(struct zpage_file *p, uint64_t block, const unsigned char *data) {
+	unsigned char *src = p->zbuf;
+	uLongf len = p->zbuf_size;
+	if(compress2(p->zbuf, &len, data, p->block_size, ZPAGE_LEVEL) != Z_OK || len >= p->block_size) {
+		src = (unsigned char *) data;
+		len = p->block_size;
+	}
+
+	int rc = zpage_extend(p, block + 1);
+	struct zpage_block *entry;
+	if(rc == SQLITE_OK)
+		rc = zpage_get_block(p, block, &entry);
+	if(rc == SQLITE_OK)
+		rc = zpage_mark_dirty(p, block);
+	if(rc != SQLITE_OK)
+		return rc;
+
+	uLongf write_len = len;
+	if(entry->offset == 0 || entry->cap < len) {
+		if(entry->offset != 0)
+			zpage_release_slot(p, entry->offset, entry->cap);
+		uint32_t cap = (len + ZPAGE_SLOT_ALIGN - 1) / ZPAGE_SLOT_ALIGN * ZPAGE_SLOT_ALIGN;
+		bool appended;
+		entry->offset = zpage_alloc_slot(p, cap, &appended);
+		entry->cap = cap;
+		if(appended && cap > len) { // Padded out, so that the file size covers the whole slot (see data_end)
+			memset(p->zbuf + len, 0, cap - len);
+			write_len = cap;
+		}
+	}
+	entry->len = len;
+
+	rc = p->real->pMethods->xWrite(p->real, src, write_len, entry->offset);
+	if(rc != SQLITE_OK)
+		return rc;
+
+	if(data != p->block_buf)
+		memcpy(p->block_buf, data, p->block_size);
+	p->cache_block = block;
+	p->cache_valid = true;
+	return SQLITE_OK;
+}
+
+static int zpage_close(sqlite3_file *file) {
+	struct zpage_file *p = (struct zpage_file *) file;
+
+	int rc = SQLITE_OK;
+	if(p->index_dirty)
+		rc = zpage_flush_index(p, false);
+
+	int close_rc = p->real->pMethods->xClose(p->real);
+	if(rc == SQLITE_OK)
+		rc = close_rc;
+
+	zpage_free_file(p);
+	return rc;
+}
+
+static int zpage_read(sqlite3_file *file, void *buf, int amt, sqlite3_int64 offset) {
+	struct zpage_file *p = (struct zpage_file *) file;
+	unsigned char *out = buf;
+	uint64_t off = offset;
+
+	while(amt > 0) {
+		if(p->block_size == 0 || off >= p->logical_size) {
+			memset(out, 0, amt);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+
+		uint64_t block = off / p->block_size;
+		uint32_t in_block = off % p->block_size;
+		uint64_t n = p->block_size - in_block;
+		if(n > (uint64_t) amt)
+			n = amt;
+		if(n > p->logical_size - off)
+			n = p->logical_size - off;
+
+		int rc = zpage_load_block(p, block);
+		if(rc != SQLITE_OK)
+			return rc;
+		memcpy(out, p->block_buf + in_block, n);
+
+		out += n;
+		off += n;
+		amt -= n;
+	}
+	return SQLITE_OK;
+}
+
+static int zpage_write(sqlite3_file *file, const void *buf, int amt, sqlite3_int64 offset) {
+	struct zpage_file *p = (struct zpage_file *) file;
+	const unsigned char *in = buf;
+	uint64_t off = offset;
+	int rc;
+
+	if(p->block_size == 0) { // The first write to a new database is page 1, so its size is the page size
+		p->block_size = (off == 0 && valid_block_size(amt)) ? (uint32_t) amt : ZPAGE_DEFAULT_BLOCK_SIZE;
+		rc = zpage_alloc_buffers(p);
+		if(rc != SQLITE_OK)
+			return rc;
+		rc = zpage_write_header(p);
+		if(rc != SQLITE_OK)
+			return rc;
+	}
+
+	while(amt > 0) {
+		uint64_t block = off / p->block_size;
+		uint32_t in_block = off % p->block_size;
+		uint64_t n = p->block_size - in_block;
+		if(n > (uint64_t) amt)
+			n = amt;
+
+		if(n == p->block_size) {
+			rc = zpage_store_block(p, block, in);
+		} else {
+			rc = zpage_load_block(p, block);
+			if(rc == SQLITE_OK) {
+				memcpy(p->block_buf + in_block, in, n);
+				rc = zpage_store_block(p, block, p->block_buf);
+			}
+		}
+		if(rc != SQLITE_OK)
+			return rc;
+
+		in += n;
+		off += n;
+		amt -= n;
+	}
+
+	if(off > p->logical_size) {
+		p->logical_size = off;
+		p->index_dirty = true;
+	}
+	return SQLITE_OK;
+}
+
+// The slots of the blocks cut off are given up for reuse; the data file itself never shrinks
+static int zpage_truncate(sqlite3_file *file, sqlite3_int64 size) {
+	struct zpage_file *p = (struct zpage_file *) file;
+	if((uint64_t) size >= p->logical_size)
+		return SQLITE_OK;
+
+	if(p->block_size != 0) {
+		uint64_t n_blocks = (size + p->block_size - 1) / p->block_size;
+		if(n_blocks < p->n_blocks) {
+			int rc = zpage_load_entries(p, n_blocks, p->n_blocks);
+			if(rc != SQLITE_OK)
+				return rc;
+			for(uint64_t i = n_blocks; i < p->n_blocks; i++) {
+				if(p->blocks[i].offset != 0)
+					zpage_release_slot(p, p->blocks[i].offset, p->blocks[i].cap);
+				p->blocks[i].offset = 0;
+			}
+			p->n_blocks = n_blocks;
+		}
+		if(p->cache_valid && p->cache_block >= n_blocks)
+			p->cache_valid = false;
+	}
+	p->logical_size = size;
+	p->index_dirty = true;
+	return SQLITE_OK;
+}
+
+static int zpage_sync(sqlite3_file *file, int flags) {
+	struct zpage_file *p = (struct zpage_file *) file;
+
+	int rc = p->real->pMethods->xSync(p->real, flags); // Blocks must be on disk before the index points at them
+	if(rc != SQLITE_OK || !p->index_dirty)
+		return rc;
+	return zpage_flush_index(p, true);
+}
+
+static int zpage_file_size(sqlite3_file *file, sqlite3_int64 *size) {
+	struct zpage_file *p = (struct zpage_file *) file;
+	*size = p->logical_size;
+	return SQLITE_OK;
+}
+
+static int zpage_lock(sqlite3_file *file, int lock) {
+	struct zpage_file *p = (struct zpage_file *) file;
+
+	int rc = p->real->pMethods->xLock(p->real, lock);
+	if(rc != SQLITE_OK)
+		return rc;
+
+	if(p->lock == SQLITE_LOCK_NONE && lock >= SQLITE_LOCK_SHARED) {
+		p->lock = lock;
+		rc = zpage_check_generation(p);
+		if(rc != SQLITE_OK) {
+			p->real->pMethods->xUnlock(p->real, SQLITE_LOCK_NONE);
+			p->lock = SQLITE_LOCK_NONE;
+		}
+		return rc;
+	}
+	p->lock = lock;
+	return SQLITE_OK;
+}
+
+static int zpage_unlock(sqlite3_file *file, int lock) {
+	struct zpage_file *p = (struct zpage_file *) file;
+
+	if(p->index_dirty && lock <= SQLITE_LOCK_SHARED) { // Make the changes visible before another connection can start writing
+		int rc = zpage_flush_index(p, false);
+		if(rc != SQLITE_OK)
+			return rc;
+	}
+
+	p->lock = lock;
+	return p->real->pMethods->xUnlock(p->real, lock);
+}
+
+static int zpage_check_reserved_lock(sqlite3_file *file, int *out) {
+	struct zpage_file *p = (struct zpage_file *) file;
+	return p->real->pMethods->xCheckReservedLock(p->real, out);
+}
+
+static int zpage_file_control(sqlite3_file *file, int op, void *arg) {
+	struct zpage_file *p = (struct zpage_file *) file;
+
+	switch(op) {
+		case SQLITE_FCNTL_SIZE_HINT: // These describe the logical size, which says nothing about the size on disk
+		case SQLITE_FCNTL_CHUNK_SIZE:
+			return SQLITE_OK;
+		default:
+			return p->real->pMethods->xFileControl(p->real, op, arg);
+	}
+}
+
+static int zpage_sector_size(sqlite3_file *file) {
+	struct zpage_file *p = (struct zpage_file *) file;
+	return p->real->pMethods->xSectorSize(p->real);
+}
+
+static int zpage_device_characteristics(sqlite3_file *file) {
+	(void) file;
+	return 0; // Block writes are neither atomic nor append-safe, whatever the underlying file claims
+}
+
+// Version 1: no shared memory, so WAL mode is only available with locking_mode=EXCLUSIVE
+static const sqlite3_io_methods zpage_io_methods = {
+	1,
+	zpage_close,
+	zpage_read,
+	zpage_write,
+	zpage_truncate,
+	zpage_sync,
+	zpage_file_size,
+	zpage_lock,
+	zpage_unlock,
+	zpage_check_reserved_lock,
+	zpage_file_control,
+	zpage_sector_size,
+	zpage_device_characteristics,
+	NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+#define ROOT_VFS(vfs) ((sqlite3_vfs *) (vfs)->pAppData)
+
+static int zpage_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *file, int flags, int *out_flags) {
+	sqlite3_vfs *root = ROOT_VFS(vfs);
+	if(!(flags & SQLITE_OPEN_MAIN_DB) || name == NULL) // zpage_vfs.szOsFile leaves enough room for the root VFS's file
+		return root->xOpen(root, name, file, flags, out_flags);
+
+	struct zpage_file *p = (struct zpage_file *) file;
+	memset(p, 0, sizeof(struct zpage_file));
+	p->real = (sqlite3_file *) &p[1];
+	p->index_fd = -1;
+
+	p->index_path = sqlite3_mprintf("%s-zidx", name);
+	if(p->index_path == NULL)
+		return SQLITE_NOMEM;
+
+	int rc = root->xOpen(root, name, p->real, flags, out_flags);
+	if(rc != SQLITE_OK) {
+		sqlite3_free(p->index_path);
+		return rc;
+	}
+
+	rc = zpage_load(p);
+	if(rc != SQLITE_OK) {
+		p->real->pMethods->xClose(p->real);
+		zpage_free_file(p);
+		return rc;
+	}
+
+	p->base.pMethods = &zpage_io_methods;
+	return SQLITE_OK;
+}
+
+static int zpage_delete(sqlite3_vfs *vfs, const char *name, int sync_dir) {
+	return ROOT_VFS(vfs)->xDelete(ROOT_VFS(vfs), name, sync_dir);
+}
+
+static int zpage_access(sqlite3_vfs *vfs, const char *name, int flags, int *out) {
+	return ROOT_VFS(vfs)->xAccess(ROOT_VFS(vfs), name, flags, out);
+}
+
+static int zpage_full_pathname(sqlite3_vfs *vfs, const char *name, int n_out, char *out) {
+	return ROOT_VFS(vfs)->xFullPathname(ROOT_VFS(vfs), name, n_out, out);
+}
+
+static void *zpage_dl_open(sqlite3_vfs *vfs, const char *name) {
+	return ROOT_VFS(vfs)->xDlOpen(ROOT_VFS(vfs), name);
+}
+
+static void zpage_dl_error(sqlite3_vfs *vfs, int n, char *msg) {
+	ROOT_VFS(vfs)->xDlError(ROOT_VFS(vfs), n, msg);
+}
+
+static void (*zpage_dl_sym(sqlite3_vfs *vfs, void *handle, const char *sym))(void) {
+	return ROOT_VFS(vfs)->xDlSym(ROOT_VFS(vfs), handle, sym);
+}
+
+static void zpage_dl_close(sqlite3_vfs *vfs, void *handle) {
+	ROOT_VFS(vfs)->xDlClose(ROOT_VFS(vfs), handle);
+}
+
+static int zpage_randomness(sqlite3_vfs *vfs, int n, char *out) {
+	return ROOT_VFS(vfs)->xRandomness(ROOT_VFS(vfs), n, out);
+}
+
+static int zpage_sleep(sqlite3_vfs *vfs, int microseconds) {
+	return ROOT_VFS(vfs)->xSleep(ROOT_VFS(vfs), microseconds);
+}
+
+static int zpage_current_time(sqlite3_vfs *vfs, double *out) {
+	return ROOT_VFS(vfs)->xCurrentTime(ROOT_VFS(vfs), out);
+}
+
+static int zpage_get_last_error(sqlite3_vfs *vfs, int n, char *out) {
+	return ROOT_VFS(vfs)->xGetLastError(ROOT_VFS(vfs), n, out);
+}
+
+static int zpage_current_time_int64(sqlite3_vfs *vfs, sqlite3_int64 *out) {
+	sqlite3_vfs *root = ROOT_VFS(vfs);
+	if(root->iVersion >= 2 && root->xCurrentTimeInt64 != NULL)
+		return root->xCurrentTimeInt64(root, out);
+
+	double now;
+	int rc = root->xCurrentTime(root, &now);
+	*out = (sqlite3_int64) (now * 86400000.0);
+	return rc;
+}
+
+static sqlite3_vfs zpage_vfs;
+
+int zpage_vfs_register(void) {
+	if(sqlite3_vfs_find(ZPAGE_VFS_NAME) != NULL)
+		return SQLITE_OK;
+
+	sqlite3_vfs *root = sqlite3_vfs_find(NULL);
+	if(root == NULL)
+		return SQLITE_ERROR;
+
+	zpage_vfs = (sqlite3_vfs) {
+		2,
+		sizeof(struct zpage_file) + root->szOsFile,
+		root->mxPathname,
+		NULL,
+		ZPAGE_VFS_NAME,
+		root,
+		zpage_open,
+		zpage_delete,
+		zpage_access,
+		zpage_full_pathname,
+		zpage_dl_open,
+		zpage_dl_error,
+		zpage_dl_sym,
+		zpage_dl_close,
+		zpage_randomness,
+		zpage_sleep,
+		zpage_current_time,
+		zpage_get_last_error,
+		zpage_current_time_int64,
+		NULL, NULL, NULL
+	};
+	return sqlite3_vfs_register(&zpage_vfs, 0);
+}
@@ -0,0 +1,22 @@
+#ifndef ZPAGE_VFS_H_INCLUDED
+#define ZPAGE_VFS_H_INCLUDED
+
+// A VFS shim that stores the main database file as individually zlib-compressed blocks.
+// Journals and temporary files are passed through to the default VFS untouched.
+//
+// On disk a compressed database consists of two files:
+//   <path>        A small header followed by the compressed blocks
+//   <path>-zidx   The block index (block number -> offset and length in <path>)
+// Both files are required to open the database again.
+//
+// Blocks are rewritten in place when they still fit their slot, otherwise moved to a free slot or the end of the file.
+// Space given up by moved or truncated blocks is reused for later writes, but the data file never shrinks; space
+// freed by other connections is only picked up once the database is opened again. Commits write just the index
+// entries that changed.
+
+#define ZPAGE_VFS_NAME "beryl-zpage"
+
+// Registers the VFS (as a non-default VFS) on first use; returns an SQLite error code
+int zpage_vfs_register(void);
+
+#endif